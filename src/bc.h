@@ -0,0 +1,436 @@
+#ifndef BC_H
+#define BC_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <smmintrin.h>
+
+/*
+ * BC1 and BC3 block encoder for RGBA8 images. Kept free of Windows
+ * headers so it can be built and benchmarked anywhere.
+ */
+
+namespace atfix {
+
+enum class BcFormat : uint32_t {
+  /** Opaque color, 8 bytes per block */
+  Bc1,
+  /** Color and interpolated alpha, 16 bytes per block */
+  Bc3,
+};
+
+inline constexpr uint32_t bcBlockBytes(BcFormat format) {
+  return format == BcFormat::Bc1 ? 8U : 16U;
+}
+
+/** 4x4 texels as RGBA8 words with red in the low byte, row by row */
+using BcTexels = std::array<uint32_t, 16>;
+
+/** Color block endpoints as floats from 0 to 255 */
+struct BcEndpoints {
+  std::array<float, 3> e0;
+  std::array<float, 3> e1;
+};
+
+/** Channels of the block in planar floats, four texels per vector */
+struct BcPlanes {
+  __m128 r[4];
+  __m128 g[4];
+  __m128 b[4];
+};
+
+inline BcPlanes loadBcPlanes(const BcTexels& texels) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  BcPlanes planes;
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const __m128i quad = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&texels[i * 4U]));
+    planes.r[i] = _mm_cvtepi32_ps(_mm_and_si128(quad, mask));
+    planes.g[i] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(quad, 8), mask));
+    planes.b[i] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(quad, 16), mask));
+  }
+
+  return planes;
+}
+
+inline float sumLanes(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 0x55));
+  return _mm_cvtss_f32(v);
+}
+
+/** Range of one channel over all 16 texels */
+inline float rangeLanes(const __m128 (&plane)[4]) {
+  __m128 lo = _mm_min_ps(_mm_min_ps(plane[0], plane[1]), _mm_min_ps(plane[2], plane[3]));
+  __m128 hi = _mm_max_ps(_mm_max_ps(plane[0], plane[1]), _mm_max_ps(plane[2], plane[3]));
+
+  lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, 0x4E));
+  lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, 0xB1));
+  hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, 0x4E));
+  hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, 0xB1));
+
+  return _mm_cvtss_f32(_mm_sub_ps(hi, lo));
+}
+
+/** Rounds a color to RGB565 */
+inline uint16_t packRgb565(const std::array<float, 3>& color) {
+  const auto quantize = [] (float value, float levels) {
+    return static_cast<uint32_t>(std::clamp(value, 0.0f, 255.0f) * levels / 255.0f + 0.5f);
+  };
+
+  return static_cast<uint16_t>((quantize(color[0], 31.0f) << 11)
+                             | (quantize(color[1], 63.0f) << 5)
+                             |  quantize(color[2], 31.0f));
+}
+
+/** Expands RGB565 the way the hardware does, by bit replication */
+inline std::array<float, 3> unpackRgb565(uint16_t color) {
+  const uint32_t r = (color >> 11) & 0x1FU;
+  const uint32_t g = (color >> 5) & 0x3FU;
+  const uint32_t b = color & 0x1FU;
+
+  return {{
+    static_cast<float>((r << 3) | (r >> 2)),
+    static_cast<float>((g << 2) | (g >> 4)),
+    static_cast<float>((b << 3) | (b >> 2)),
+  }};
+}
+
+/**
+ * \brief Picks 2-bit indices against two endpoints
+ *
+ * Every texel is projected onto the line between the endpoints and
+ * snapped to the nearest of the four palette entries.
+ *
+ * \param [out] pError Squared error of the block
+ * \returns Indices, texel 0 in the low bits
+ */
+inline uint32_t pickColorIndices(const BcPlanes& planes, const std::array<float, 3>& e0,
+        const std::array<float, 3>& e1, float* pError) {
+  const float dr = e1[0] - e0[0];
+  const float dg = e1[1] - e0[1];
+  const float db = e1[2] - e0[2];
+  const float length = dr * dr + dg * dg + db * db;
+  const float scale = length > 0.0f ? 3.0f / length : 0.0f;
+
+  /* Palette order is e0, e1, 2/3 e0 + 1/3 e1, 1/3 e0 + 2/3 e1 */
+  constexpr std::array<uint32_t, 4> Order = { 0U, 2U, 3U, 1U };
+
+  __m128 error = _mm_setzero_ps();
+  uint32_t indices = 0U;
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const __m128 pr = _mm_sub_ps(planes.r[i], _mm_set1_ps(e0[0]));
+    const __m128 pg = _mm_sub_ps(planes.g[i], _mm_set1_ps(e0[1]));
+    const __m128 pb = _mm_sub_ps(planes.b[i], _mm_set1_ps(e0[2]));
+
+    __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pr, _mm_set1_ps(dr)), _mm_mul_ps(pg, _mm_set1_ps(dg))), _mm_mul_ps(pb, _mm_set1_ps(db)));
+    t = _mm_round_ps(_mm_mul_ps(t, _mm_set1_ps(scale)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(3.0f));
+
+    /* Distance to the palette entry, which sits at t/3 along the line */
+    const __m128 w = _mm_mul_ps(t, _mm_set1_ps(1.0f / 3.0f));
+    const __m128 er = _mm_sub_ps(pr, _mm_mul_ps(w, _mm_set1_ps(dr)));
+    const __m128 eg = _mm_sub_ps(pg, _mm_mul_ps(w, _mm_set1_ps(dg)));
+    const __m128 eb = _mm_sub_ps(pb, _mm_mul_ps(w, _mm_set1_ps(db)));
+    error = _mm_add_ps(error, _mm_add_ps(_mm_add_ps(_mm_mul_ps(er, er), _mm_mul_ps(eg, eg)), _mm_mul_ps(eb, eb)));
+
+    alignas(16) std::array<int32_t, 4> steps;
+    _mm_store_si128(reinterpret_cast<__m128i*>(steps.data()), _mm_cvtps_epi32(t));
+
+    for (uint32_t j = 0U; j < 4U; j++) {
+      indices |= Order[static_cast<uint32_t>(steps[j])] << (2U * (i * 4U + j));
+    }
+  }
+
+  *pError = sumLanes(error);
+  return indices;
+}
+
+/**
+ * \brief Fits endpoints along the principal axis of the block
+ *
+ * The axis is found by power iteration on the color covariance,
+ * starting from the bounding box diagonal. The endpoints are the
+ * extreme projections of the texels onto it.
+ */
+inline BcEndpoints fitColorAxis(const BcPlanes& planes) {
+  __m128 sr = _mm_setzero_ps(), sg = _mm_setzero_ps(), sb = _mm_setzero_ps();
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    sr = _mm_add_ps(sr, planes.r[i]);
+    sg = _mm_add_ps(sg, planes.g[i]);
+    sb = _mm_add_ps(sb, planes.b[i]);
+  }
+
+  const float mr = sumLanes(sr) / 16.0f;
+  const float mg = sumLanes(sg) / 16.0f;
+  const float mb = sumLanes(sb) / 16.0f;
+
+  __m128 crr = _mm_setzero_ps(), cgg = _mm_setzero_ps(), cbb = _mm_setzero_ps();
+  __m128 crg = _mm_setzero_ps(), crb = _mm_setzero_ps(), cgb = _mm_setzero_ps();
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const __m128 r = _mm_sub_ps(planes.r[i], _mm_set1_ps(mr));
+    const __m128 g = _mm_sub_ps(planes.g[i], _mm_set1_ps(mg));
+    const __m128 b = _mm_sub_ps(planes.b[i], _mm_set1_ps(mb));
+
+    crr = _mm_add_ps(crr, _mm_mul_ps(r, r));
+    cgg = _mm_add_ps(cgg, _mm_mul_ps(g, g));
+    cbb = _mm_add_ps(cbb, _mm_mul_ps(b, b));
+    crg = _mm_add_ps(crg, _mm_mul_ps(r, g));
+    crb = _mm_add_ps(crb, _mm_mul_ps(r, b));
+    cgb = _mm_add_ps(cgb, _mm_mul_ps(g, b));
+  }
+
+  const float c00 = sumLanes(crr), c11 = sumLanes(cgg), c22 = sumLanes(cbb);
+  const float c01 = sumLanes(crg), c02 = sumLanes(crb), c12 = sumLanes(cgb);
+
+  float ar = rangeLanes(planes.r);
+  float ag = rangeLanes(planes.g);
+  float ab = rangeLanes(planes.b);
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const float nr = c00 * ar + c01 * ag + c02 * ab;
+    const float ng = c01 * ar + c11 * ag + c12 * ab;
+    const float nb = c02 * ar + c12 * ag + c22 * ab;
+    const float length = std::max({ std::fabs(nr), std::fabs(ng), std::fabs(nb) });
+
+    if (length < 1.0e-6f) {
+      break;
+    }
+
+    ar = nr / length;
+    ag = ng / length;
+    ab = nb / length;
+  }
+
+  const float length = std::sqrt(ar * ar + ag * ag + ab * ab);
+
+  if (length < 1.0e-6f) {
+    return { {{ mr, mg, mb }}, {{ mr, mg, mb }} };
+  }
+
+  ar /= length;
+  ag /= length;
+  ab /= length;
+
+  __m128 tMin = _mm_set1_ps(1.0e9f), tMax = _mm_set1_ps(-1.0e9f);
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const __m128 t = _mm_add_ps(_mm_add_ps(
+      _mm_mul_ps(_mm_sub_ps(planes.r[i], _mm_set1_ps(mr)), _mm_set1_ps(ar)),
+      _mm_mul_ps(_mm_sub_ps(planes.g[i], _mm_set1_ps(mg)), _mm_set1_ps(ag))),
+      _mm_mul_ps(_mm_sub_ps(planes.b[i], _mm_set1_ps(mb)), _mm_set1_ps(ab)));
+
+    tMin = _mm_min_ps(tMin, t);
+    tMax = _mm_max_ps(tMax, t);
+  }
+
+  tMin = _mm_min_ps(tMin, _mm_shuffle_ps(tMin, tMin, 0x4E));
+  tMin = _mm_min_ps(tMin, _mm_shuffle_ps(tMin, tMin, 0xB1));
+  tMax = _mm_max_ps(tMax, _mm_shuffle_ps(tMax, tMax, 0x4E));
+  tMax = _mm_max_ps(tMax, _mm_shuffle_ps(tMax, tMax, 0xB1));
+
+  const float t0 = _mm_cvtss_f32(tMax);
+  const float t1 = _mm_cvtss_f32(tMin);
+
+  return {
+    {{ mr + ar * t0, mg + ag * t0, mb + ab * t0 }},
+    {{ mr + ar * t1, mg + ag * t1, mb + ab * t1 }},
+  };
+}
+
+/**
+ * \brief Least-squares endpoints for a given set of indices
+ *
+ * \returns \c false if the indices do not constrain both endpoints
+ */
+inline bool refitColorEndpoints(const BcTexels& texels, uint32_t indices, BcEndpoints& endpoints) {
+  constexpr std::array<float, 4> Weights = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+  float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+  std::array<float, 3> ap = { }, bp = { };
+
+  for (uint32_t i = 0U; i < 16U; i++) {
+    const float b = Weights[(indices >> (2U * i)) & 3U];
+    const float a = 1.0f - b;
+
+    const std::array<float, 3> p = {{
+      static_cast<float>(texels[i] & 0xFFU),
+      static_cast<float>((texels[i] >> 8) & 0xFFU),
+      static_cast<float>((texels[i] >> 16) & 0xFFU),
+    }};
+
+    aa += a * a;
+    ab += a * b;
+    bb += b * b;
+
+    for (uint32_t c = 0U; c < 3U; c++) {
+      ap[c] += a * p[c];
+      bp[c] += b * p[c];
+    }
+  }
+
+  const float det = aa * bb - ab * ab;
+
+  if (std::fabs(det) < 1.0e-6f) {
+    return false;
+  }
+
+  for (uint32_t c = 0U; c < 3U; c++) {
+    endpoints.e0[c] = std::clamp((ap[c] * bb - bp[c] * ab) / det, 0.0f, 255.0f);
+    endpoints.e1[c] = std::clamp((bp[c] * aa - ap[c] * ab) / det, 0.0f, 255.0f);
+  }
+
+  return true;
+}
+
+/**
+ * \brief Quantizes endpoints and picks indices for them
+ *
+ * Orders the endpoints so that BC1 decodes the block in four-color
+ * mode.
+ */
+inline uint64_t quantizeColorBlock(const BcPlanes& planes, const BcEndpoints& endpoints,
+        float* pError, uint32_t* pIndices) {
+  uint16_t c0 = packRgb565(endpoints.e0);
+  uint16_t c1 = packRgb565(endpoints.e1);
+
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+
+  /* Equal endpoints give a zero-length line, so all indices are 0 */
+  const uint32_t indices = pickColorIndices(planes, unpackRgb565(c0), unpackRgb565(c1), pError);
+
+  *pIndices = indices;
+  return c0 | (static_cast<uint64_t>(c1) << 16) | (static_cast<uint64_t>(indices) << 32);
+}
+
+/** Encodes the color half of a block, which is a full BC1 block */
+inline void encodeColorBlock(const BcTexels& texels, uint8_t* pDst) {
+  const BcPlanes planes = loadBcPlanes(texels);
+  BcEndpoints endpoints = fitColorAxis(planes);
+
+  float error = 0.0f;
+  uint32_t indices = 0U;
+  uint64_t block = quantizeColorBlock(planes, endpoints, &error, &indices);
+
+  if (indices && refitColorEndpoints(texels, indices, endpoints)) {
+    float refitError = 0.0f;
+    uint32_t refitIndices = 0U;
+    const uint64_t refit = quantizeColorBlock(planes, endpoints, &refitError, &refitIndices);
+
+    if (refitError < error) {
+      block = refit;
+    }
+  }
+
+  std::memcpy(pDst, &block, sizeof(block));
+}
+
+/** Encodes an alpha block in eight-value mode */
+inline void encodeAlphaBlock(const BcTexels& texels, uint8_t* pDst) {
+  uint32_t lo = 255U;
+  uint32_t hi = 0U;
+
+  for (uint32_t texel : texels) {
+    lo = std::min(lo, texel >> 24);
+    hi = std::max(hi, texel >> 24);
+  }
+
+  uint64_t block = hi | (lo << 8);
+
+  if (hi != lo) {
+    const float scale = 7.0f / static_cast<float>(hi - lo);
+
+    for (uint32_t i = 0U; i < 16U; i++) {
+      const auto t = static_cast<uint32_t>(static_cast<float>((texels[i] >> 24) - lo) * scale + 0.5f);
+
+      /* Palette order is hi, lo, then six steps from hi towards lo */
+      const uint64_t index = t == 7U ? 0U : (t == 0U ? 1U : 8U - t);
+      block |= index << (16U + 3U * i);
+    }
+  }
+
+  std::memcpy(pDst, &block, sizeof(block));
+}
+
+/**
+ * \brief Gathers a 4x4 block from an image
+ *
+ * Texels past the right or bottom edge repeat the last column or
+ * row, so mips smaller than a block encode cleanly.
+ *
+ * \param [in] swapRb Source is BGRA
+ */
+inline BcTexels loadBcBlock(const uint8_t* pSrc, size_t pitch, uint32_t x, uint32_t width, uint32_t rows, bool swapRb) {
+  BcTexels texels;
+
+  for (uint32_t row = 0U; row < 4U; row++) {
+    const uint8_t* pRow = pSrc + std::min(row, rows - 1U) * pitch;
+
+    for (uint32_t col = 0U; col < 4U; col++) {
+      uint32_t texel;
+      std::memcpy(&texel, pRow + std::min(x + col, width - 1U) * 4U, sizeof(texel));
+
+      if (swapRb) {
+        texel = (texel & 0xFF00FF00U) | ((texel >> 16) & 0xFFU) | ((texel & 0xFFU) << 16);
+      }
+
+      texels[row * 4U + col] = texel;
+    }
+  }
+
+  return texels;
+}
+
+/**
+ * \brief Encodes one row of blocks
+ *
+ * \param [in] pSrc First of up to four texel rows
+ * \param [in] rows Texel rows present, from 1 to 4
+ * \param [out] pDst Output for (width + 3) / 4 blocks
+ */
+inline void encodeBcRow(const uint8_t* pSrc, size_t pitch, uint32_t width, uint32_t rows,
+        bool swapRb, BcFormat format, uint8_t* pDst) {
+  for (uint32_t x = 0U; x < width; x += 4U) {
+    const BcTexels texels = loadBcBlock(pSrc, pitch, x, width, rows, swapRb);
+
+    if (format == BcFormat::Bc3) {
+      encodeAlphaBlock(texels, pDst);
+      pDst += 8U;
+    }
+
+    encodeColorBlock(texels, pDst);
+    pDst += 8U;
+  }
+}
+
+/** Checks RGBA8 texels for alpha below 255 */
+inline bool hasAlpha(const uint8_t* pSrc, size_t bytes) {
+  const __m128i mask = _mm_set1_epi32(static_cast<int32_t>(0xFF000000U));
+  __m128i all = mask;
+  size_t i = 0U;
+
+  for (; i + 16U <= bytes; i += 16U) {
+    all = _mm_and_si128(all, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i)));
+  }
+
+  for (; i + 4U <= bytes; i += 4U) {
+    if (pSrc[i + 3U] != 0xFFU) {
+      return true;
+    }
+  }
+
+  return !_mm_test_all_ones(_mm_or_si128(all, _mm_xor_si128(mask, _mm_set1_epi32(-1))));
+}
+
+}
+
+#endif
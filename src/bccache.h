@@ -0,0 +1,315 @@
+#ifndef BCCACHE_H
+#define BCCACHE_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <d3d11.h>
+
+#include "bc.h"
+#include "cbcache.h"
+#include "formats.h"
+#include "pool.h"
+#include "util.h"
+
+namespace atfix {
+
+/** Multiplicative hash, independent of the CRC so that both make a 96-bit key */
+inline uint64_t mixBytes(const void* pData, size_t size, uint64_t hash) {
+  constexpr uint64_t Prime = 0x9E3779B97F4A7C15ULL;
+  const auto* bytes = static_cast<const uint8_t*>(pData);
+  size_t i = 0U;
+
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t qword;
+    std::memcpy(&qword, bytes + i, sizeof(qword));
+    hash = (hash ^ qword) * Prime;
+    hash ^= hash >> 29;
+  }
+
+  for (; i < size; i++) {
+    hash = (hash ^ bytes[i]) * Prime;
+  }
+
+  return hash;
+}
+
+/**
+ * \brief Compresses immutable RGBA8 textures when they are created
+ *
+ * Opaque textures become BC1, all others BC3. Rows of blocks are
+ * encoded on the worker pool. The result is stored in a directory,
+ * one file per texture named after a hash of its description and
+ * contents, so later launches read it back instead of encoding.
+ *
+ * Only textures whose views and shaders cannot tell the difference
+ * are eligible: shader resources without CPU access, with both sides
+ * a multiple of the block size and at least MinSize. Eligible is not
+ * enough, since normal maps, lookup tables and UI atlases lose too
+ * much, so only textures the caller allows by name are compressed.
+ * Every eligible texture is appended to the report file with its
+ * name, whether it was allowed, and the size it would have.
+ */
+class TextureCompressor {
+
+public:
+
+  static constexpr uint32_t FileMagic   = 0x43424641U;
+  static constexpr uint32_t FileVersion = 1U;
+
+  TextureCompressor(const char* directory, const char* report, UINT minSize, WorkerPool& pool)
+  : m_directory(directory), m_report(report), m_minSize(minSize), m_pool(pool) { }
+
+  bool isEligible(const D3D11_TEXTURE2D_DESC& desc) const {
+    return desc.Usage == D3D11_USAGE_IMMUTABLE
+        && desc.BindFlags == D3D11_BIND_SHADER_RESOURCE
+        && !desc.CPUAccessFlags
+        && !(desc.MiscFlags & ~static_cast<UINT>(D3D11_RESOURCE_MISC_TEXTURECUBE))
+        && desc.SampleDesc.Count == 1U
+        && getBcFormat(desc.Format, BcFormat::Bc1) != DXGI_FORMAT_UNKNOWN
+        && !(desc.Width % 4U) && !(desc.Height % 4U)
+        && std::min(desc.Width, desc.Height) >= m_minSize;
+  }
+
+  /**
+   * \brief Compresses an eligible texture and creates it
+   *
+   * \param [in] isAllowed Checks the name of the texture against the allowlist
+   * \param [in] createTexture Creates a 2D texture from a description and initial data
+   * \param [out] pFormat Block format of the new texture
+   * \returns Result of the creation, or \c S_FALSE if the texture is
+   *    not allowed. The caller should create the uncompressed texture
+   *    unless the result is \c S_OK.
+   */
+  template<typename Allow, typename Create>
+  HRESULT create(const D3D11_TEXTURE2D_DESC& desc, const D3D11_SUBRESOURCE_DATA* pData,
+          ID3D11Texture2D** ppTexture, Allow&& isAllowed, Create&& createTexture, DXGI_FORMAT* pFormat) {
+    const auto start = std::chrono::steady_clock::now();
+
+    uint64_t crc = hashBytes(&desc, sizeof(desc));
+    uint64_t mix = mixBytes(&desc, sizeof(desc), 0U);
+    bool alpha = false;
+
+    forEachSpan(desc, pData, [&] (const uint8_t* pBytes, size_t length) {
+      crc = hashBytes(pBytes, length, crc);
+      mix = mixBytes(pBytes, length, mix);
+      alpha = alpha || hasAlpha(pBytes, length);
+    });
+
+    const BcFormat bc = alpha ? BcFormat::Bc3 : BcFormat::Bc1;
+    const DXGI_FORMAT format = getBcFormat(desc.Format, bc);
+
+    D3D11_TEXTURE2D_DESC bcDesc = desc;
+    bcDesc.Format = format;
+
+    /* Every mip and layer is a list of block rows in one allocation */
+    const UINT mips = mipCount(desc);
+    const UINT subresources = mips * desc.ArraySize;
+    std::vector<D3D11_SUBRESOURCE_DATA> bcData(subresources);
+    size_t size = 0U;
+
+    for (UINT i = 0U; i < subresources; i++) {
+      const UINT mip = i % mips;
+      const UINT pitch = blockCount(desc.Width, mip) * bcBlockBytes(bc);
+
+      bcData[i].SysMemPitch = pitch;
+      bcData[i].SysMemSlicePitch = pitch * blockCount(desc.Height, mip);
+      size += bcData[i].SysMemSlicePitch;
+    }
+
+    std::array<char, 32> name = { };
+    std::snprintf(name.data(), name.size(), "%08x%016llx",
+      static_cast<uint32_t>(crc), static_cast<unsigned long long>(mix));
+
+    if (!isAllowed(name.data())) {
+      const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      report(desc, name.data(), format, false, false, ms, size);
+      return S_FALSE;
+    }
+
+    std::vector<uint8_t> blocks(size);
+    size_t offset = 0U;
+
+    for (auto& sub : bcData) {
+      sub.pSysMem = &blocks[offset];
+      offset += sub.SysMemSlicePitch;
+    }
+
+    const std::string path = std::string(m_directory) + "/" + name.data() + ".bc";
+    const bool cached = readFile(path, bcDesc, blocks);
+
+    if (!cached) {
+      encode(desc, pData, bc, bcData, blocks.data());
+      writeFile(path, bcDesc, blocks);
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const HRESULT hr = createTexture(&bcDesc, bcData.data(), ppTexture);
+
+    if (SUCCEEDED(hr)) {
+      *pFormat = format;
+      report(desc, name.data(), format, true, cached, ms, size);
+    }
+
+    return hr;
+  }
+
+private:
+
+  static DXGI_FORMAT getBcFormat(DXGI_FORMAT format, BcFormat bc) {
+    switch (format) {
+      case DXGI_FORMAT_R8G8B8A8_UNORM:
+      case DXGI_FORMAT_B8G8R8A8_UNORM:
+        return bc == BcFormat::Bc1 ? DXGI_FORMAT_BC1_UNORM : DXGI_FORMAT_BC3_UNORM;
+
+      case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+      case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        return bc == BcFormat::Bc1 ? DXGI_FORMAT_BC1_UNORM_SRGB : DXGI_FORMAT_BC3_UNORM_SRGB;
+
+      default:
+        return DXGI_FORMAT_UNKNOWN;
+    }
+  }
+
+  static UINT blockCount(UINT size, UINT mip) {
+    return (std::max(size >> mip, 1U) + 3U) / 4U;
+  }
+
+  struct FileHeader {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  format;
+    uint32_t  width;
+    uint32_t  height;
+    uint32_t  mips;
+    uint32_t  layers;
+    uint32_t  reserved;
+    uint64_t  size;
+  };
+
+  static FileHeader getHeader(const D3D11_TEXTURE2D_DESC& desc, size_t size) {
+    return { FileMagic, FileVersion, static_cast<uint32_t>(desc.Format), desc.Width, desc.Height,
+      mipCount(desc), desc.ArraySize, 0U, size };
+  }
+
+  void encode(const D3D11_TEXTURE2D_DESC& desc, const D3D11_SUBRESOURCE_DATA* pData,
+          BcFormat bc, const std::vector<D3D11_SUBRESOURCE_DATA>& bcData, uint8_t* pBlocks) {
+    struct BlockRow {
+      const uint8_t*  src;
+      size_t          pitch;
+      uint32_t        width;
+      uint32_t        rows;
+      uint8_t*        dst;
+    };
+
+    const UINT mips = mipCount(desc);
+    const bool swapRb = desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM
+                     || desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+
+    std::vector<BlockRow> rows;
+
+    for (UINT i = 0U; i < bcData.size(); i++) {
+      const UINT width = std::max(desc.Width >> (i % mips), 1U);
+      const UINT height = std::max(desc.Height >> (i % mips), 1U);
+      const auto* pSrc = static_cast<const uint8_t*>(pData[i].pSysMem);
+
+      for (UINT y = 0U; y < height; y += 4U) {
+        rows.push_back({ pSrc + static_cast<size_t>(y) * pData[i].SysMemPitch, pData[i].SysMemPitch,
+          width, std::min(height - y, 4U), pBlocks + static_cast<size_t>(y / 4U) * bcData[i].SysMemPitch });
+      }
+
+      pBlocks += bcData[i].SysMemSlicePitch;
+    }
+
+    m_pool.run(static_cast<uint32_t>(rows.size()), [&] (uint32_t i) {
+      const BlockRow& row = rows[i];
+      encodeBcRow(row.src, row.pitch, row.width, row.rows, swapRb, bc, row.dst);
+    });
+  }
+
+  static bool readFile(const std::string& path, const D3D11_TEXTURE2D_DESC& desc, std::vector<uint8_t>& blocks) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+
+    if (!file) {
+      return false;
+    }
+
+    const FileHeader expected = getHeader(desc, blocks.size());
+    FileHeader header = { };
+
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+     || std::memcmp(&header, &expected, sizeof(header))) {
+      return false;
+    }
+
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(blocks.data()), static_cast<std::streamsize>(blocks.size())));
+  }
+
+  /** Writes to a temporary file first, so that a crash never leaves a partial entry */
+  void writeFile(const std::string& path, const D3D11_TEXTURE2D_DESC& desc, const std::vector<uint8_t>& blocks) {
+    {
+      const std::lock_guard lock(m_mutex);
+
+      if (!m_directoryCreated) {
+        CreateDirectoryA(m_directory, nullptr);
+        m_directoryCreated = true;
+      }
+    }
+
+    const std::string temp = path + ".tmp";
+    const FileHeader header = getHeader(desc, blocks.size());
+
+    {
+      std::ofstream file(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char*>(blocks.data()), static_cast<std::streamsize>(blocks.size()));
+
+      if (!file) {
+        return;
+      }
+    }
+
+    if (std::rename(temp.c_str(), path.c_str())) {
+      std::remove(temp.c_str());
+    }
+  }
+
+  void report(const D3D11_TEXTURE2D_DESC& desc, const char* name, DXGI_FORMAT format,
+          bool allowed, bool cached, double ms, size_t size) {
+    const std::lock_guard lock(m_mutex);
+
+    if (!m_count) {
+      m_file.open(m_report, std::ios::out | std::ios::trunc);
+      m_file << "texture  name  size  mips  layers  from  to  allowed  cached  ms  bytes_before  bytes_after" << std::endl;
+    }
+
+    const uint64_t before = textureBytes(desc, desc.Format);
+
+    m_file << ++m_count << "  " << name << "  " << desc.Width << "x" << desc.Height << "  " << mipCount(desc)
+           << "  " << desc.ArraySize << "  " << formatName(desc.Format)
+           << "  " << formatName(format) << "  " << (allowed ? 1 : 0)
+           << "  " << (cached ? 1 : 0) << "  " << ms << "  " << before << "  " << size << std::endl;
+  }
+
+  const char*   m_directory;
+  const char*   m_report;
+  UINT          m_minSize;
+  WorkerPool&   m_pool;
+
+  mutex         m_mutex;
+  bool          m_directoryCreated = false;
+  std::ofstream m_file;
+  uint32_t      m_count = 0U;
+
+};
+
+}
+
+#endif
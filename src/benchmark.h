@@ -0,0 +1,277 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <unordered_map>
+#include <vector>
+
+#include <d3d11.h>
+
+#include "profiler.h"
+#include "tag.h"
+
+namespace atfix {
+
+/** Private data GUID linking a replacement shader to the game's original */
+inline constexpr GUID AbOriginalGuid = { 0x2e8c4d71, 0x0b5a, 0x4f63, { 0xa1, 0x97, 0x3c, 0x5e, 0x20, 0xf4, 0x8b, 0x16 } };
+
+/**
+ * \brief A/B benchmark for replacement shaders
+ *
+ * Every replaced shader keeps the game's original next to it.
+ * Binds on the immediate context alternate between the two in
+ * blocks of BlockFrames frames, and draws that use a replaced
+ * shader are timed on the GPU. Both stages flip together, so
+ * samples are keyed by the pair of replaced vertex and pixel
+ * shaders in use, and the saving of a pair is reported as one.
+ * The report lists the GPU time per frame of both variants and
+ * the saving with a 95% confidence interval (Welch), accumulated
+ * over the whole session.
+ */
+class AbBenchmark {
+
+public:
+
+  static constexpr uint32_t BlockFrames     = 1U;
+  static constexpr uint32_t ReportInterval  = 1200U;
+  static constexpr uint32_t MaxPairs        = 4096U;
+
+  /** Shader bound on one stage, both variants are referenced */
+  struct Binding {
+    ID3D11DeviceChild*  shader = nullptr;
+    ID3D11DeviceChild*  original = nullptr;
+    uint32_t            index = 0U;
+    uint32_t            variant = 0U;
+
+    ID3D11DeviceChild* get() const {
+      return variant ? original : shader;
+    }
+
+    void reset() {
+      if (shader) {
+        shader->Release();
+        original->Release();
+      }
+
+      *this = Binding();
+    }
+  };
+
+  AbBenchmark(const char* filename)
+  : m_filename(filename) {
+    m_touched.reserve(MaxPairs);
+    m_pairKeys.reserve(MaxPairs);
+  }
+
+  /** Variant bound this frame, 1 means the game's original */
+  uint32_t variant() const {
+    return (m_frame / BlockFrames) & 1U;
+  }
+
+  /**
+   * \brief Picks the shader to bind
+   *
+   * Call from the bind hooks with the shader the game asked for.
+   * Returns the original in odd blocks if the shader was replaced.
+   */
+  template<typename T>
+  T* bind(Binding& binding, T* pShader, uint32_t tag) {
+    binding.reset();
+
+    if (!(tag & TAG_REPLACED)) {
+      return pShader;
+    }
+
+    IUnknown* original = nullptr;
+    UINT size = sizeof(original);
+
+    if (FAILED(pShader->GetPrivateData(AbOriginalGuid, &size, &original)) || !original) {
+      return pShader;
+    }
+
+    pShader->AddRef();
+
+    binding.shader = pShader;
+    binding.original = static_cast<T*>(original);
+    binding.index = tagIndex(tag);
+    binding.variant = variant();
+    return static_cast<T*>(binding.get());
+  }
+
+  /**
+   * \brief Times a draw
+   *
+   * Rebinds shaders that were bound before the variant flipped and
+   * starts a new timer sample keyed by the replaced shaders in use.
+   */
+  template<typename SetPS, typename SetVS>
+  void draw(ID3D11DeviceContext* pContext, SetPS&& setPs, SetVS&& setVs) {
+    const uint32_t current = variant();
+
+    if (m_ps.shader && m_ps.variant != current) {
+      m_ps.variant = current;
+      setPs(static_cast<ID3D11PixelShader*>(m_ps.get()));
+    }
+
+    if (m_vs.shader && m_vs.variant != current) {
+      m_vs.variant = current;
+      setVs(static_cast<ID3D11VertexShader*>(m_vs.get()));
+    }
+
+    m_timer.draw(pContext, getPair(m_vs.index, m_ps.index), 0U);
+  }
+
+  template<typename Create>
+  void present(ID3D11DeviceContext* pContext, const ShaderTable& shaders, Create&& createProc) {
+    m_frame++;
+    m_timer.present(pContext, variant(), createProc, *this);
+
+    if (m_resolved && !(m_resolved % ReportInterval)) {
+      report(shaders);
+    }
+  }
+
+  void reset() {
+    m_ps.reset();
+    m_vs.reset();
+  }
+
+  Binding& ps() {
+    return m_ps;
+  }
+
+  Binding& vs() {
+    return m_vs;
+  }
+
+  void addSample(uint32_t index, uint32_t, double ms) {
+    if (!index) {
+      return;
+    }
+
+    if (!m_seen[index]) {
+      m_seen[index] = true;
+      m_touched.push_back(index);
+    }
+
+    m_frameTime[index] += ms;
+  }
+
+  void addFrame(uint32_t tag) {
+    for (uint32_t index : m_touched) {
+      auto& stat = m_stats[index];
+      stat.count[tag]++;
+      stat.sum[tag] += m_frameTime[index];
+      stat.sumSq[tag] += m_frameTime[index] * m_frameTime[index];
+      m_frameTime[index] = 0.0;
+      m_seen[index] = false;
+    }
+
+    m_touched.clear();
+    m_resolved++;
+  }
+
+  void dropFrame() {
+    m_dropped++;
+  }
+
+private:
+
+  struct Pair {
+    uint32_t vs = 0U;
+    uint32_t ps = 0U;
+  };
+
+  struct Stat {
+    std::array<uint32_t, 2> count = { };
+    std::array<double, 2>   sum = { };
+    std::array<double, 2>   sumSq = { };
+
+    double mean(uint32_t v) const {
+      return sum[v] / static_cast<double>(count[v]);
+    }
+
+    double variance(uint32_t v) const {
+      const double n = static_cast<double>(count[v]);
+      return std::max(0.0, (sumSq[v] - sum[v] * sum[v] / n) / (n - 1.0));
+    }
+  };
+
+  /** Returns the sample key of a shader pair, 0 if nothing is replaced or the table is full */
+  uint32_t getPair(uint32_t vs, uint32_t ps) {
+    if (!vs && !ps) {
+      return 0U;
+    }
+
+    const uint32_t packed = (vs << 16U) | ps;
+    auto entry = m_pairKeys.find(packed);
+
+    if (entry != m_pairKeys.end()) {
+      return entry->second;
+    }
+
+    if (m_pairCount + 1U >= MaxPairs) {
+      return 0U;
+    }
+
+    const uint32_t key = ++m_pairCount;
+    m_pairs[key] = { vs, ps };
+    m_pairKeys.emplace(packed, key);
+    return key;
+  }
+
+  void report(const ShaderTable& shaders) {
+    std::ofstream file(m_filename, std::ios::out | std::ios::trunc);
+
+    file << "A/B over " << m_resolved << " frames (" << m_dropped << " dropped), "
+         << BlockFrames << " frame blocks" << std::endl << std::endl
+         << "  saving  +/- 95%  original  replaced  frames  vs / ps" << std::endl;
+
+    for (uint32_t index = 1U; index <= m_pairCount; index++) {
+      const Stat& stat = m_stats[index];
+      const Pair& pair = m_pairs[index];
+
+      if (stat.count[0] < 2U || stat.count[1] < 2U) {
+        continue;
+      }
+
+      const double saving = stat.mean(1U) - stat.mean(0U);
+      const double error = 1.96 * std::sqrt(stat.variance(0U) / static_cast<double>(stat.count[0])
+                                          + stat.variance(1U) / static_cast<double>(stat.count[1]));
+
+      file << std::fixed << std::setprecision(3)
+           << std::setw(8) << saving << " "
+           << std::setw(8) << error << " "
+           << std::setw(9) << stat.mean(1U) << " "
+           << std::setw(9) << stat.mean(0U) << " "
+           << std::setw(7) << stat.count[0] + stat.count[1] << "  "
+           << (pair.vs ? shaders.name(pair.vs) : "-") << " / "
+           << (pair.ps ? shaders.name(pair.ps) : "-") << std::endl;
+    }
+  }
+
+  const char*                                   m_filename;
+  GpuTimer<1024U>                               m_timer;
+  Binding                                       m_ps;
+  Binding                                       m_vs;
+  uint32_t                                      m_frame = 0U;
+  uint32_t                                      m_resolved = 0U;
+  uint32_t                                      m_dropped = 0U;
+  std::array<Pair, MaxPairs>                    m_pairs = { };
+  std::unordered_map<uint32_t, uint32_t>        m_pairKeys;
+  uint32_t                                      m_pairCount = 0U;
+  std::array<double, MaxPairs>                  m_frameTime = { };
+  std::array<bool, MaxPairs>                    m_seen = { };
+  std::vector<uint32_t>                         m_touched;
+  std::array<Stat, MaxPairs>                    m_stats = { };
+
+};
+
+}
+
+#endif
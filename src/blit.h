@@ -0,0 +1,159 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <d3d11.h>
+#include <d3dcommon.h>
+
+namespace atfix {
+
+using PFN_D3DCompile = HRESULT(WINAPI*)(LPCVOID, SIZE_T, LPCSTR, const D3D_SHADER_MACRO*, ID3DInclude*,
+  LPCSTR, LPCSTR, UINT, UINT, ID3DBlob**, ID3DBlob**);
+
+/** Fullscreen triangle with texture coordinates, entry point vs_main */
+inline constexpr char FullscreenVsHlsl[] = R"(
+void vs_main(uint id : SV_VertexID, out float4 pos : SV_Position, out float2 uv : TEXCOORD0) {
+  uv = float2((id << 1) & 2, id & 2);
+  pos = float4(uv * float2(2.0f, -2.0f) + float2(-1.0f, 1.0f), 0.0f, 1.0f);
+}
+)";
+
+/**
+ * \brief Compiles embedded HLSL
+ *
+ * Uses the system's d3dcompiler_47.dll, loaded on first use.
+ *
+ * \returns Bytecode blob, or null if the compiler is missing
+ *    or compilation failed
+ */
+inline ID3DBlob* compileHlsl(const char* pSource, const char* pEntry, const char* pTarget,
+        const D3D_SHADER_MACRO* pDefines = nullptr) {
+  static const PFN_D3DCompile compile = [] {
+    HMODULE library = LoadLibraryA("d3dcompiler_47.dll");
+    return library ? reinterpret_cast<PFN_D3DCompile>(GetProcAddress(library, "D3DCompile")) : nullptr;
+  } ();
+
+  ID3DBlob* blob = nullptr;
+
+  if (!compile || FAILED(compile(pSource, std::strlen(pSource), pEntry, pDefines, nullptr,
+      pEntry, pTarget, 0U, 0U, &blob, nullptr))) {
+    return nullptr;
+  }
+
+  return blob;
+}
+
+/** Bilinear sampler with clamp addressing, as used by blits */
+inline D3D11_SAMPLER_DESC linearClampSamplerDesc() {
+  D3D11_SAMPLER_DESC desc = { };
+  desc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+  desc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+  desc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+  desc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+  desc.MaxAnisotropy = 1U;
+  desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+  desc.MaxLOD = D3D11_FLOAT32_MAX;
+  return desc;
+}
+
+template<typename T>
+void releaseRef(T*& pObject) {
+  if (pObject) {
+    pObject->Release();
+    pObject = nullptr;
+  }
+}
+
+/**
+ * \brief Pipeline state touched by a blit
+ *
+ * Captures shaders, input assembly, slot 0 of pixel shader resources
+ * and samplers, and the output merger and rasterizer state objects.
+ * Render targets and viewports are up to the caller. Shaders and
+ * resources are restored through the original procs, so state that
+ * hooks track stays as the game left it.
+ */
+class BlitState {
+
+public:
+
+  explicit BlitState(ID3D11DeviceContext* pContext) {
+    pContext->VSGetShader(&m_vs, nullptr, nullptr);
+    pContext->PSGetShader(&m_ps, nullptr, nullptr);
+    pContext->IAGetInputLayout(&m_layout);
+    pContext->IAGetPrimitiveTopology(&m_topology);
+    pContext->PSGetShaderResources(0U, 1U, &m_srv);
+    pContext->PSGetSamplers(0U, 1U, &m_sampler);
+    pContext->OMGetBlendState(&m_blend, m_blendFactor, &m_sampleMask);
+    pContext->OMGetDepthStencilState(&m_depth, &m_stencilRef);
+    pContext->RSGetState(&m_rasterizer);
+  }
+
+  ~BlitState() {
+    releaseRef(m_vs);
+    releaseRef(m_ps);
+    releaseRef(m_layout);
+    releaseRef(m_srv);
+    releaseRef(m_sampler);
+    releaseRef(m_blend);
+    releaseRef(m_depth);
+    releaseRef(m_rasterizer);
+  }
+
+  BlitState(const BlitState&) = delete;
+  BlitState& operator = (const BlitState&) = delete;
+
+  /**
+   * \brief Draws a fullscreen triangle that samples one texture
+   *
+   * Blend state and render targets are used as bound.
+   */
+  template<typename Procs>
+  static void draw(ID3D11DeviceContext* pContext, const Procs* procs, ID3D11VertexShader* pVs,
+          ID3D11PixelShader* pPs, ID3D11ShaderResourceView* pSrv, ID3D11SamplerState* pSampler) {
+    pContext->IASetInputLayout(nullptr);
+    pContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    procs->VSSetShader(pContext, pVs, nullptr, 0U);
+    procs->PSSetShader(pContext, pPs, nullptr, 0U);
+    procs->PSSetShaderResources(pContext, 0U, 1U, &pSrv);
+    pContext->PSSetSamplers(0U, 1U, &pSampler);
+    pContext->OMSetDepthStencilState(nullptr, 0U);
+    pContext->RSSetState(nullptr);
+    procs->Draw(pContext, 3U, 0U);
+  }
+
+  template<typename Procs>
+  void restore(ID3D11DeviceContext* pContext, const Procs* procs) {
+    pContext->IASetInputLayout(m_layout);
+    pContext->IASetPrimitiveTopology(m_topology);
+    procs->VSSetShader(pContext, m_vs, nullptr, 0U);
+    procs->PSSetShader(pContext, m_ps, nullptr, 0U);
+    procs->PSSetShaderResources(pContext, 0U, 1U, &m_srv);
+    pContext->PSSetSamplers(0U, 1U, &m_sampler);
+    pContext->OMSetBlendState(m_blend, m_blendFactor, m_sampleMask);
+    pContext->OMSetDepthStencilState(m_depth, m_stencilRef);
+    pContext->RSSetState(m_rasterizer);
+  }
+
+private:
+
+  ID3D11VertexShader*       m_vs = nullptr;
+  ID3D11PixelShader*        m_ps = nullptr;
+  ID3D11InputLayout*        m_layout = nullptr;
+  D3D11_PRIMITIVE_TOPOLOGY  m_topology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+  ID3D11ShaderResourceView* m_srv = nullptr;
+  ID3D11SamplerState*       m_sampler = nullptr;
+  ID3D11BlendState*         m_blend = nullptr;
+  FLOAT                     m_blendFactor[4] = { };
+  UINT                      m_sampleMask = 0xFFFFFFFFU;
+  ID3D11DepthStencilState*  m_depth = nullptr;
+  UINT                      m_stencilRef = 0U;
+  ID3D11RasterizerState*    m_rasterizer = nullptr;
+
+};
+
+}
+
+#endif
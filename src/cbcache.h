@@ -0,0 +1,156 @@
+#ifndef CBCACHE_H
+#define CBCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <d3d11.h>
+#include <nmmintrin.h>
+
+#include "object.h"
+
+namespace atfix {
+
+/** Private data GUID of the shadow copy attached to constant buffers */
+inline constexpr GUID CbShadowGuid = { 0x2c81e5a7, 0x0f3d, 0x4b92, { 0xa6, 0x14, 0x5e, 0xd0, 0x37, 0xc9, 0x8b, 0x21 } };
+
+/** CRC of a block of memory, eight bytes per step. Pass the previous result to chain blocks. */
+inline uint64_t hashBytes(const void* pData, size_t size, uint64_t crc = 0U) {
+  const auto* bytes = static_cast<const uint8_t*>(pData);
+  size_t i = 0U;
+
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t qword;
+    std::memcpy(&qword, bytes + i, sizeof(qword));
+    crc = _mm_crc32_u64(crc, qword);
+  }
+
+  for (; i < size; i++) {
+    crc = _mm_crc32_u8(static_cast<uint32_t>(crc), bytes[i]);
+  }
+
+  return crc;
+}
+
+/**
+ * \brief Shadow copy of a small constant buffer
+ *
+ * Attached to the buffer as private data interface, so it lives
+ * exactly as long as the buffer. Remembers the last contents that
+ * were uploaded on the immediate context, so that byte-identical
+ * uploads can be dropped.
+ *
+ * WRITE_DISCARD maps are redirected to a scratch copy and only
+ * uploaded at Unmap if the contents changed. Immediate context
+ * writes the shadow cannot follow invalidate it until the next full
+ * upload. Writes recorded on deferred contexts take effect whenever
+ * the command list runs, so they disable the shadow for good.
+ */
+class CbShadow final : public PrivateObject {
+
+public:
+
+  static constexpr UINT MaxSize = 4096U;
+
+  explicit CbShadow(UINT size)
+  : m_size(size),
+    m_data(std::make_unique<uint8_t[]>(size)),
+    m_scratch(std::make_unique<uint8_t[]>(size)) { }
+
+  /** Attaches a shadow to a new buffer, optionally seeded with its initial data */
+  static void attach(ID3D11Buffer* pBuffer, UINT size, const void* pInitialData) {
+    auto* shadow = new CbShadow(size);
+
+    if (pInitialData) {
+      shadow->update(pInitialData);
+    }
+
+    PrivateObject::attach(pBuffer, CbShadowGuid, shadow);
+  }
+
+  /** Shadow of a resource, if any. The caller must release it. */
+  static CbShadow* get(ID3D11Resource* pResource) {
+    return PrivateObject::get<CbShadow>(pResource, CbShadowGuid);
+  }
+
+  UINT size() const {
+    return m_size;
+  }
+
+  /** Contents of the last upload, or null if they are not known */
+  const void* data() const {
+    return m_valid && !disabled() ? m_data.get() : nullptr;
+  }
+
+  /**
+   * \brief Compares new contents against the last upload
+   *
+   * \returns \c true if they are identical. Otherwise the new
+   *    contents are recorded and the caller must upload them.
+   */
+  bool update(const void* pData) {
+    if (disabled()) {
+      return false;
+    }
+
+    const uint64_t hash = hashBytes(pData, m_size);
+
+    if (m_valid && hash == m_hash && !std::memcmp(pData, m_data.get(), m_size)) {
+      return true;
+    }
+
+    if (pData != m_data.get()) {
+      std::memcpy(m_data.get(), pData, m_size);
+    }
+
+    m_hash = hash;
+    m_valid = true;
+    return false;
+  }
+
+  /** Forgets the contents after an upload we could not follow */
+  void invalidate() {
+    m_valid = false;
+  }
+
+  /** Stops tracking for good, may be called from any thread */
+  void disable() {
+    m_disabled = true;
+  }
+
+  bool disabled() const {
+    return m_disabled;
+  }
+
+  void* map() {
+    m_mapped = true;
+    return m_scratch.get();
+  }
+
+  /** Ends a redirected map, returns the written contents or null */
+  const void* unmap() {
+    if (!m_mapped) {
+      return nullptr;
+    }
+
+    m_mapped = false;
+    return m_scratch.get();
+  }
+
+private:
+
+  UINT                        m_size;
+  std::unique_ptr<uint8_t[]>  m_data;
+  std::unique_ptr<uint8_t[]>  m_scratch;
+  uint64_t                    m_hash = 0U;
+  bool                        m_valid = false;
+  bool                        m_mapped = false;
+  std::atomic<bool>           m_disabled = { false };
+
+};
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+
+namespace atfix {
+
+/** Frame counters, new entries need a name in FrameCounters */
+enum class Counter : uint32_t {
+  CbUploads,
+  CbSkippedUploads,
+  CbSkippedBytes,
+  RingAllocations,
+  RingFallbacks,
+  StagingRedirects,
+  StagingStalls,
+  ReadbackLatent,
+  ReadbackBlocked,
+  ReadbackRemovedUs,
+  ShadowDrawsSkipped,
+  ShadowFramesReused,
+  ShadowCastersCulled,
+  ShadowIndicesCulled,
+  GrassDrawsThinned,
+  GrassUnitsDropped,
+  ParticleDrawsSkipped,
+  ParticleDrawsReduced,
+  ParticleGpuUs,
+  ReducedPasses,
+  QualityTier,
+  Count
+};
+
+/**
+ * \brief Frame counters
+ *
+ * Cheap enough to bump unconditionally from any hook on the
+ * immediate context. Counters accumulate over a window of frames,
+ * gauges written with \c set() keep the value of the last frame.
+ * Every full window, or earlier on request, one row with the
+ * totals and the number of frames they cover is appended to a CSV
+ * file and the window starts over.
+ */
+class FrameCounters {
+
+public:
+
+  static constexpr uint32_t CounterCount = static_cast<uint32_t>(Counter::Count);
+
+  FrameCounters(const char* filename, uint32_t interval)
+  : m_filename(filename), m_interval(interval) { }
+
+  void add(Counter counter, uint64_t value = 1U) {
+    m_values[static_cast<uint32_t>(counter)] += value;
+  }
+
+  void set(Counter counter, uint64_t value) {
+    m_values[static_cast<uint32_t>(counter)] = value;
+  }
+
+  /**
+   * \brief Ends a frame
+   *
+   * \param [in] flush Writes the current window even if it is not full
+   */
+  void present(uint64_t frame, bool flush) {
+    m_frames++;
+
+    if (flush || m_frames >= m_interval) {
+      write(frame);
+      m_values = { };
+      m_frames = 0U;
+    }
+  }
+
+private:
+
+  static constexpr std::array<const char*, CounterCount> Names = {
+    "cb_uploads",
+    "cb_skipped_uploads",
+    "cb_skipped_bytes",
+    "ring_allocations",
+    "ring_fallbacks",
+    "staging_stalls_avoided",
+    "staging_stalls",
+    "readback_latent",
+    "readback_blocked",
+    "readback_removed_us",
+    "shadow_draws_skipped",
+    "shadow_frames_reused",
+    "shadow_casters_culled",
+    "shadow_indices_culled",
+    "grass_draws_thinned",
+    "grass_units_dropped",
+    "particle_draws_skipped",
+    "particle_draws_reduced",
+    "particle_gpu_us",
+    "reduced_passes",
+    "quality_tier",
+  };
+
+  void write(uint64_t frame) {
+    std::ofstream file(m_filename, std::ios::out | (m_header ? std::ios::app : std::ios::trunc));
+
+    if (!m_header) {
+      file << "frame,frames";
+
+      for (const char* name : Names) {
+        file << "," << name;
+      }
+
+      file << std::endl;
+      m_header = true;
+    }
+
+    file << frame << "," << m_frames;
+
+    for (uint64_t value : m_values) {
+      file << "," << value;
+    }
+
+    file << std::endl;
+  }
+
+  const char*                           m_filename;
+  uint32_t                              m_interval;
+  uint32_t                              m_frames = 0U;
+  std::array<uint64_t, CounterCount>    m_values = { };
+  bool                                  m_header = false;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <d3d11.h>
+
+#include "cbcache.h"
+#include "formats.h"
+#include "util.h"
+
+namespace atfix {
+
+/** Walks the initial data of a buffer, always in one span */
+template<typename Fn>
+bool forEachSpan(const D3D11_BUFFER_DESC& desc, const D3D11_SUBRESOURCE_DATA* pData, Fn&& fn) {
+  fn(static_cast<const uint8_t*>(pData->pSysMem), static_cast<size_t>(desc.ByteWidth));
+  return true;
+}
+
+/**
+ * \brief Shares byte-identical immutable resources
+ *
+ * Immutable buffers and 2D textures are looked up by a CRC of their
+ * description and initial data. On a match, the data is compared to
+ * a copy kept by the cache, and the existing resource is returned
+ * with a new reference instead of creating another one.
+ *
+ * Resources only the cache still references are released at the end
+ * of every load, i.e. once LoadGapFrames frames went by without an
+ * immutable resource being created. Each load appends a line with
+ * the shared resources, the memory they saved and an estimate of the
+ * creation time saved to the report file.
+ */
+class ResourceDedup {
+
+public:
+
+  static constexpr size_t   MaxCachedBytes  = static_cast<size_t>(256U) << 20;
+  static constexpr uint64_t LoadGapFrames   = 30U;
+
+  ResourceDedup(const char* filename)
+  : m_filename(filename) { }
+
+  ~ResourceDedup() {
+    clear(m_buffers);
+    clear(m_textures);
+  }
+
+  ResourceDedup(const ResourceDedup&) = delete;
+  ResourceDedup& operator = (const ResourceDedup&) = delete;
+
+  /**
+   * \brief Creates or shares an immutable resource
+   *
+   * Resources that are not immutable or have no initial data are
+   * passed straight to \c createResource.
+   *
+   * \param [in] createResource Creates the resource into the given pointer
+   */
+  template<typename Desc, typename Resource, typename Create>
+  HRESULT create(const Desc* pDesc, const D3D11_SUBRESOURCE_DATA* pData, Resource** ppResource, Create&& createResource) {
+    if (!pDesc || !pData || !ppResource || !isShareable(*pDesc)) {
+      return createResource(ppResource);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    uint64_t hash = hashBytes(pDesc, sizeof(*pDesc));
+    size_t size = 0U;
+
+    const bool known = forEachSpan(*pDesc, pData, [&] (const uint8_t* pBytes, size_t length) {
+      hash = hashBytes(pBytes, length, hash);
+      size += length;
+    });
+
+    if (!known) {
+      return createResource(ppResource);
+    }
+
+    auto& table = getTable(*pDesc);
+
+    {
+      const std::lock_guard lock(m_mutex);
+      m_lastCreate = m_frame;
+      m_loading = true;
+
+      const auto range = table.equal_range(hash);
+
+      for (auto entry = range.first; entry != range.second; entry++) {
+        if (entry->second.matches(*pDesc, pData, size)) {
+          entry->second.resource->AddRef();
+          *ppResource = entry->second.resource;
+
+          m_load.shared++;
+          m_load.savedBytes += size;
+          m_load.hashUs += elapsedUs(start);
+          return S_OK;
+        }
+      }
+
+      m_load.hashUs += elapsedUs(start);
+    }
+
+    const auto createStart = std::chrono::steady_clock::now();
+    const HRESULT hr = createResource(ppResource);
+    const uint64_t createUs = elapsedUs(createStart);
+
+    if (FAILED(hr) || !*ppResource) {
+      return hr;
+    }
+
+    const std::lock_guard lock(m_mutex);
+
+    m_load.created++;
+    m_load.createUs += createUs;
+    m_createdBytes += size;
+    m_createUs += createUs;
+
+    if (m_cachedBytes + size > MaxCachedBytes) {
+      return hr;
+    }
+
+    Entry<Desc, Resource> entry = { *pDesc, std::make_unique<uint8_t[]>(size), size, *ppResource };
+    size_t offset = 0U;
+
+    forEachSpan(*pDesc, pData, [&] (const uint8_t* pBytes, size_t length) {
+      std::memcpy(&entry.data[offset], pBytes, length);
+      offset += length;
+    });
+
+    entry.resource->AddRef();
+    table.emplace(hash, std::move(entry));
+    m_cachedBytes += size;
+    return hr;
+  }
+
+  /** Ends a load once creations stopped, call once per present */
+  void present(uint64_t frame) {
+    const std::lock_guard lock(m_mutex);
+    m_frame = frame;
+
+    if (!m_loading || frame - m_lastCreate < LoadGapFrames) {
+      return;
+    }
+
+    m_loading = false;
+    sweep(m_buffers);
+    sweep(m_textures);
+    report();
+    m_load = { };
+  }
+
+private:
+
+  template<typename Desc, typename Resource>
+  struct Entry {
+    Desc                        desc;
+    std::unique_ptr<uint8_t[]>  data;
+    size_t                      size;
+    Resource*                   resource;
+
+    bool matches(const Desc& other, const D3D11_SUBRESOURCE_DATA* pData, size_t otherSize) const {
+      if (otherSize != size || std::memcmp(&desc, &other, sizeof(desc))) {
+        return false;
+      }
+
+      size_t offset = 0U;
+      bool equal = true;
+
+      forEachSpan(other, pData, [&] (const uint8_t* pBytes, size_t length) {
+        equal = equal && !std::memcmp(&data[offset], pBytes, length);
+        offset += length;
+      });
+
+      return equal;
+    }
+  };
+
+  template<typename Desc, typename Resource>
+  using Table = std::unordered_multimap<uint64_t, Entry<Desc, Resource>>;
+
+  struct LoadStats {
+    uint32_t  created;
+    uint32_t  shared;
+    uint64_t  savedBytes;
+    uint64_t  createUs;
+    uint64_t  hashUs;
+  };
+
+  static bool isShareable(const D3D11_BUFFER_DESC& desc) {
+    return desc.Usage == D3D11_USAGE_IMMUTABLE && !desc.CPUAccessFlags;
+  }
+
+  static bool isShareable(const D3D11_TEXTURE2D_DESC& desc) {
+    return desc.Usage == D3D11_USAGE_IMMUTABLE && !desc.CPUAccessFlags
+        && !(desc.MiscFlags & ~static_cast<UINT>(D3D11_RESOURCE_MISC_TEXTURECUBE));
+  }
+
+  Table<D3D11_BUFFER_DESC, ID3D11Buffer>& getTable(const D3D11_BUFFER_DESC&) {
+    return m_buffers;
+  }
+
+  Table<D3D11_TEXTURE2D_DESC, ID3D11Texture2D>& getTable(const D3D11_TEXTURE2D_DESC&) {
+    return m_textures;
+  }
+
+  static uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  /** Releases resources that nobody but the cache references */
+  template<typename Desc, typename Resource>
+  void sweep(Table<Desc, Resource>& table) {
+    for (auto entry = table.begin(); entry != table.end(); ) {
+      Resource* resource = entry->second.resource;
+      resource->AddRef();
+
+      if (resource->Release() > 1U) {
+        entry++;
+        continue;
+      }
+
+      resource->Release();
+      m_cachedBytes -= entry->second.size;
+      m_sweptResources++;
+      entry = table.erase(entry);
+    }
+  }
+
+  template<typename Desc, typename Resource>
+  void clear(Table<Desc, Resource>& table) {
+    for (auto& entry : table) {
+      entry.second.resource->Release();
+    }
+
+    table.clear();
+    m_cachedBytes = 0U;
+  }
+
+  void report() {
+    std::ofstream file(m_filename, std::ios::out | (m_loads ? std::ios::app : std::ios::trunc));
+
+    if (!m_loads) {
+      file << "load  end_frame  created  shared  saved_bytes  create_ms  est_saved_ms  hash_ms  cached  cached_bytes  released" << std::endl;
+    }
+
+    /* Creation time scales with size, so estimate from the mean per byte */
+    const double savedMs = m_createdBytes
+      ? static_cast<double>(m_createUs) * static_cast<double>(m_load.savedBytes) / static_cast<double>(m_createdBytes) / 1000.0 : 0.0;
+
+    file << ++m_loads << "  " << m_frame << "  " << m_load.created << "  " << m_load.shared
+         << "  " << m_load.savedBytes << "  " << static_cast<double>(m_load.createUs) / 1000.0
+         << "  " << savedMs << "  " << static_cast<double>(m_load.hashUs) / 1000.0
+         << "  " << (m_buffers.size() + m_textures.size()) << "  " << m_cachedBytes
+         << "  " << m_sweptResources << std::endl;
+
+    m_sweptResources = 0U;
+  }
+
+  const char*                                   m_filename;
+  mutex                                         m_mutex;
+
+  Table<D3D11_BUFFER_DESC, ID3D11Buffer>        m_buffers;
+  Table<D3D11_TEXTURE2D_DESC, ID3D11Texture2D>  m_textures;
+  size_t                                        m_cachedBytes = 0U;
+
+  uint64_t                                      m_frame = 0U;
+  uint64_t                                      m_lastCreate = 0U;
+  bool                                          m_loading = false;
+
+  LoadStats                                     m_load = { };
+  uint32_t                                      m_loads = 0U;
+  uint32_t                                      m_sweptResources = 0U;
+  uint64_t                                      m_createdBytes = 0U;
+  uint64_t                                      m_createUs = 0U;
+
+};
+
+}
+
+#endif
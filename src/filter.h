@@ -0,0 +1,122 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Upscaling filter shared by the GPU pass and its CPU reference.
+ * Kept free of Windows headers so the reference builds anywhere;
+ * both versions must be changed together.
+ */
+
+namespace atfix {
+
+/**
+ * \brief Upscaling pixel shader, entry point ps_main
+ *
+ * Samples the source bilinearly at the output pixel and at one source
+ * texel up, down, left and right of it, then sharpens with a negative
+ * lobe that shrinks where the local contrast is already high. The
+ * result is clamped to the range of the five samples, so that edges
+ * do not ring. Expects SHARPNESS defined from 0 to 1.
+ */
+inline constexpr char UpscaleHlsl[] = R"(
+Texture2D<float4> src : register(t0);
+SamplerState linearClamp : register(s0);
+
+float4 ps_main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+  float2 size;
+  src.GetDimensions(size.x, size.y);
+  float2 texel = 1.0f / size;
+
+  float3 c = src.SampleLevel(linearClamp, uv, 0.0f).rgb;
+  float3 n = src.SampleLevel(linearClamp, uv - float2(0.0f, texel.y), 0.0f).rgb;
+  float3 s = src.SampleLevel(linearClamp, uv + float2(0.0f, texel.y), 0.0f).rgb;
+  float3 w = src.SampleLevel(linearClamp, uv - float2(texel.x, 0.0f), 0.0f).rgb;
+  float3 e = src.SampleLevel(linearClamp, uv + float2(texel.x, 0.0f), 0.0f).rgb;
+
+  float3 lo = min(c, min(min(n, s), min(w, e)));
+  float3 hi = max(c, max(max(n, s), max(w, e)));
+  float3 amp = sqrt(saturate(min(lo, 1.0f - hi) / max(hi, 1.0f / 65536.0f)));
+  float3 lobe = -amp * lerp(0.125f, 0.2f, SHARPNESS);
+
+  return float4(saturate(clamp((c + lobe * (n + s + w + e)) / (1.0f + 4.0f * lobe), lo, hi)), 1.0f);
+}
+)";
+
+/**
+ * \brief Bilinear sample of an RGBA32F image
+ *
+ * Clamp addressing with texel centers at half-integer coordinates,
+ * as on the GPU.
+ */
+inline void sampleBilinear(const float* pSrc, uint32_t width, uint32_t height, float u, float v, float* pOut) {
+  const float x = u * static_cast<float>(width) - 0.5f;
+  const float y = v * static_cast<float>(height) - 0.5f;
+  const float x0 = std::floor(x);
+  const float y0 = std::floor(y);
+  const float fx = x - x0;
+  const float fy = y - y0;
+
+  const auto clampCoord = [] (float coord, uint32_t size) {
+    return static_cast<uint32_t>(std::clamp(coord, 0.0f, static_cast<float>(size - 1U)));
+  };
+
+  const uint32_t xa = clampCoord(x0, width);
+  const uint32_t xb = clampCoord(x0 + 1.0f, width);
+  const uint32_t ya = clampCoord(y0, height);
+  const uint32_t yb = clampCoord(y0 + 1.0f, height);
+
+  for (uint32_t i = 0U; i < 4U; i++) {
+    const float top = pSrc[(ya * width + xa) * 4U + i] * (1.0f - fx) + pSrc[(ya * width + xb) * 4U + i] * fx;
+    const float bottom = pSrc[(yb * width + xa) * 4U + i] * (1.0f - fx) + pSrc[(yb * width + xb) * 4U + i] * fx;
+    pOut[i] = top * (1.0f - fy) + bottom * fy;
+  }
+}
+
+/**
+ * \brief CPU reference of UpscaleHlsl
+ *
+ * Images are tightly packed RGBA32F rows. Output alpha is 1.
+ */
+inline void upscaleReference(const float* pSrc, uint32_t srcWidth, uint32_t srcHeight,
+        float* pDst, uint32_t dstWidth, uint32_t dstHeight, float sharpness) {
+  const float texelU = 1.0f / static_cast<float>(srcWidth);
+  const float texelV = 1.0f / static_cast<float>(srcHeight);
+  const float weight = 0.125f + (0.2f - 0.125f) * sharpness;
+
+  for (uint32_t y = 0U; y < dstHeight; y++) {
+    for (uint32_t x = 0U; x < dstWidth; x++) {
+      const float u = (static_cast<float>(x) + 0.5f) / static_cast<float>(dstWidth);
+      const float v = (static_cast<float>(y) + 0.5f) / static_cast<float>(dstHeight);
+
+      float c[4], n[4], s[4], w[4], e[4];
+      sampleBilinear(pSrc, srcWidth, srcHeight, u, v, c);
+      sampleBilinear(pSrc, srcWidth, srcHeight, u, v - texelV, n);
+      sampleBilinear(pSrc, srcWidth, srcHeight, u, v + texelV, s);
+      sampleBilinear(pSrc, srcWidth, srcHeight, u - texelU, v, w);
+      sampleBilinear(pSrc, srcWidth, srcHeight, u + texelU, v, e);
+
+      float* pOut = &pDst[(y * dstWidth + x) * 4U];
+
+      for (uint32_t i = 0U; i < 3U; i++) {
+        const float lo = std::min({ c[i], n[i], s[i], w[i], e[i] });
+        const float hi = std::max({ c[i], n[i], s[i], w[i], e[i] });
+        const float amp = std::sqrt(std::clamp(std::min(lo, 1.0f - hi) / std::max(hi, 1.0f / 65536.0f), 0.0f, 1.0f));
+        const float lobe = -amp * weight;
+
+        const float sharpened = (c[i] + lobe * (n[i] + s[i] + w[i] + e[i])) / (1.0f + 4.0f * lobe);
+
+        pOut[i] = std::clamp(std::clamp(sharpened, lo, hi), 0.0f, 1.0f);
+      }
+
+      pOut[3] = 1.0f;
+    }
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+
+#include <d3d11.h>
+
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Render target format downgrade
+ *
+ * Render targets created with \c from, and the given size unless it
+ * is 0, are created with \c to instead. Views are rewritten to match.
+ */
+struct FormatDowngrade {
+  DXGI_FORMAT   from;
+  DXGI_FORMAT   to;
+  UINT          width;
+  UINT          height;
+
+  bool matches(const D3D11_TEXTURE2D_DESC& desc) const {
+    return desc.Format == from
+        && (!width || desc.Width == width)
+        && (!height || desc.Height == height);
+  }
+};
+
+inline const char* formatName(DXGI_FORMAT format) {
+  switch (format) {
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:    return "R32G32B32A32_FLOAT";
+    case DXGI_FORMAT_R16G16B16A16_TYPELESS: return "R16G16B16A16_TYPELESS";
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:    return "R16G16B16A16_FLOAT";
+    case DXGI_FORMAT_R32G32_FLOAT:          return "R32G32_FLOAT";
+    case DXGI_FORMAT_R10G10B10A2_UNORM:     return "R10G10B10A2_UNORM";
+    case DXGI_FORMAT_R11G11B10_FLOAT:       return "R11G11B10_FLOAT";
+    case DXGI_FORMAT_R8G8B8A8_TYPELESS:     return "R8G8B8A8_TYPELESS";
+    case DXGI_FORMAT_R8G8B8A8_UNORM:        return "R8G8B8A8_UNORM";
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:   return "R8G8B8A8_UNORM_SRGB";
+    case DXGI_FORMAT_R16G16_FLOAT:          return "R16G16_FLOAT";
+    case DXGI_FORMAT_B8G8R8A8_UNORM:        return "B8G8R8A8_UNORM";
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:   return "B8G8R8A8_UNORM_SRGB";
+    case DXGI_FORMAT_BC1_UNORM:             return "BC1_UNORM";
+    case DXGI_FORMAT_BC1_UNORM_SRGB:        return "BC1_UNORM_SRGB";
+    case DXGI_FORMAT_BC3_UNORM:             return "BC3_UNORM";
+    case DXGI_FORMAT_BC3_UNORM_SRGB:        return "BC3_UNORM_SRGB";
+    default:                                return "?";
+  }
+}
+
+/** Size of the smallest addressable block of a format, 1x1 texels unless compressed */
+struct FormatBlock {
+  UINT extent;
+  UINT bytes;
+};
+
+/** Block of the common color and depth formats, 0 bytes if unknown */
+inline FormatBlock getFormatBlock(DXGI_FORMAT format) {
+  switch (format) {
+    case DXGI_FORMAT_BC1_TYPELESS:
+    case DXGI_FORMAT_BC1_UNORM:
+    case DXGI_FORMAT_BC1_UNORM_SRGB:
+    case DXGI_FORMAT_BC4_TYPELESS:
+    case DXGI_FORMAT_BC4_UNORM:
+    case DXGI_FORMAT_BC4_SNORM:
+      return { 4U, 8U };
+
+    case DXGI_FORMAT_BC2_TYPELESS:
+    case DXGI_FORMAT_BC2_UNORM:
+    case DXGI_FORMAT_BC2_UNORM_SRGB:
+    case DXGI_FORMAT_BC3_TYPELESS:
+    case DXGI_FORMAT_BC3_UNORM:
+    case DXGI_FORMAT_BC3_UNORM_SRGB:
+    case DXGI_FORMAT_BC5_TYPELESS:
+    case DXGI_FORMAT_BC5_UNORM:
+    case DXGI_FORMAT_BC5_SNORM:
+    case DXGI_FORMAT_BC7_TYPELESS:
+    case DXGI_FORMAT_BC7_UNORM:
+    case DXGI_FORMAT_BC7_UNORM_SRGB:
+      return { 4U, 16U };
+
+    case DXGI_FORMAT_R8_UNORM:
+    case DXGI_FORMAT_A8_UNORM:
+      return { 1U, 1U };
+
+    case DXGI_FORMAT_R8G8_UNORM:
+    case DXGI_FORMAT_R16_FLOAT:
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_B5G6R5_UNORM:
+    case DXGI_FORMAT_B5G5R5A1_UNORM:
+      return { 1U, 2U };
+
+    case DXGI_FORMAT_R8G8B8A8_TYPELESS:
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_B8G8R8A8_TYPELESS:
+    case DXGI_FORMAT_B8G8R8A8_UNORM:
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+    case DXGI_FORMAT_B8G8R8X8_UNORM:
+    case DXGI_FORMAT_R10G10B10A2_UNORM:
+    case DXGI_FORMAT_R11G11B10_FLOAT:
+    case DXGI_FORMAT_R16G16_FLOAT:
+    case DXGI_FORMAT_R32_FLOAT:
+      return { 1U, 4U };
+
+    case DXGI_FORMAT_R16G16B16A16_TYPELESS:
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R16G16B16A16_UNORM:
+    case DXGI_FORMAT_R32G32_FLOAT:
+      return { 1U, 8U };
+
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+      return { 1U, 16U };
+
+    default:
+      return { 1U, 0U };
+  }
+}
+
+/** Number of mips of a texture, MipLevels 0 stands for the full chain */
+inline UINT mipCount(const D3D11_TEXTURE2D_DESC& desc) {
+  if (desc.MipLevels) {
+    return desc.MipLevels;
+  }
+
+  UINT count = 1U;
+
+  while ((std::max(desc.Width, desc.Height) >> count) != 0U) {
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * \brief Walks the initial data of a 2D texture row by row
+ *
+ * Rows are cut to their packed size, so pitch padding is ignored.
+ *
+ * \returns \c false if the format is unknown
+ */
+template<typename Fn>
+bool forEachSpan(const D3D11_TEXTURE2D_DESC& desc, const D3D11_SUBRESOURCE_DATA* pData, Fn&& fn) {
+  const FormatBlock block = getFormatBlock(desc.Format);
+
+  if (!block.bytes) {
+    return false;
+  }
+
+  const UINT mips = mipCount(desc);
+
+  for (UINT layer = 0U; layer < desc.ArraySize; layer++) {
+    for (UINT mip = 0U; mip < mips; mip++) {
+      const D3D11_SUBRESOURCE_DATA& sub = pData[layer * mips + mip];
+      const UINT width = std::max(desc.Width >> mip, 1U);
+      const UINT height = std::max(desc.Height >> mip, 1U);
+      const UINT rows = (height + block.extent - 1U) / block.extent;
+      const size_t rowBytes = static_cast<size_t>((width + block.extent - 1U) / block.extent) * block.bytes;
+
+      for (UINT row = 0U; row < rows; row++) {
+        fn(static_cast<const uint8_t*>(sub.pSysMem) + static_cast<size_t>(row) * sub.SysMemPitch, rowBytes);
+      }
+    }
+  }
+
+  return true;
+}
+
+/** Memory of a texture with all mips, layers and samples, 0 if the format is unknown */
+inline uint64_t textureBytes(const D3D11_TEXTURE2D_DESC& desc, DXGI_FORMAT format) {
+  const FormatBlock block = getFormatBlock(format);
+  const UINT mips = mipCount(desc);
+  uint64_t blocks = 0U;
+
+  for (UINT i = 0U; i < mips; i++) {
+    const UINT width = std::max(desc.Width >> i, 1U);
+    const UINT height = std::max(desc.Height >> i, 1U);
+    blocks += static_cast<uint64_t>((width + block.extent - 1U) / block.extent) * ((height + block.extent - 1U) / block.extent);
+  }
+
+  return blocks * block.bytes * desc.ArraySize * std::max(desc.SampleDesc.Count, 1U);
+}
+
+/**
+ * \brief Report of downgraded render targets
+ *
+ * Appends one line per downgraded resource with the bytes it saves
+ * and the running total. Targets are created rarely, so the file is
+ * opened for every entry.
+ */
+class FormatReport {
+
+public:
+
+  FormatReport(const char* filename)
+  : m_filename(filename) { }
+
+  void add(const D3D11_TEXTURE2D_DESC& desc, DXGI_FORMAT to) {
+    const uint64_t before = textureBytes(desc, desc.Format);
+    const uint64_t after = textureBytes(desc, to);
+    const uint64_t saved = before > after ? before - after : 0U;
+
+    const std::lock_guard lock(m_mutex);
+
+    std::ofstream file(m_filename, std::ios::out | (m_count ? std::ios::app : std::ios::trunc));
+
+    if (!m_count) {
+      file << "resource  size  mips  layers  samples  from  to  saved_bytes  total_saved_bytes" << std::endl;
+    }
+
+    m_total += saved;
+
+    file << ++m_count << "  " << desc.Width << "x" << desc.Height << "  " << mipCount(desc)
+         << "  " << desc.ArraySize << "  " << desc.SampleDesc.Count
+         << "  " << formatName(desc.Format) << "  " << formatName(to)
+         << "  " << saved << "  " << m_total << std::endl;
+  }
+
+private:
+
+  const char* m_filename;
+  mutex       m_mutex;
+  uint32_t    m_count = 0U;
+  uint64_t    m_total = 0U;
+
+};
+
+}
+
+#endif
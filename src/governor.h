@@ -0,0 +1,212 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <d3d11.h>
+
+#include "profiler.h"
+
+namespace atfix {
+
+/** Replacement tiers, each one includes the ones before it */
+enum class QualityTier : uint32_t {
+  /** Game's original shaders everywhere */
+  Original,
+  /** Simplified replacement shaders */
+  Simplified,
+  /** Draws of disabled effects are dropped */
+  Skipped,
+  /** Grass density and shadow caster culling at low quality settings */
+  Reduced,
+  Count
+};
+
+/**
+ * \brief Moves between quality tiers to hold a frame time
+ *
+ * Decisions are based on work time rather than frame time, since
+ * frame time never drops below the refresh interval under vsync or
+ * a frame limiter. The CPU time of a frame is measured from the end
+ * of one present to the start of the next, so that waits inside
+ * Present do not count. The GPU time runs from the first draw to
+ * the present, measured with a GpuTimer, and lags
+ * GpuTimer FrameCount frames behind. Work time is the larger of the
+ * two means, or the mean frame time if no GPU time was resolved.
+ *
+ * Times are averaged over windows of WindowFrames frames. A window
+ * whose work time is above the target by more than UpMargin moves
+ * one tier down in quality. Moving back up needs UpgradeWindows
+ * consecutive windows below the target by more than DownMargin, so
+ * that a tier that only just holds the target is kept. Frames above
+ * MaxFrameMs, e.g. loading screens, are ignored.
+ */
+class QualityGovernor {
+
+public:
+
+  static constexpr uint32_t WindowFrames    = 60U;
+  static constexpr uint32_t UpgradeWindows  = 3U;
+  static constexpr double   UpMargin        = 0.05;
+  static constexpr double   DownMargin      = 0.15;
+  static constexpr double   MaxFrameMs      = 250.0;
+
+  /** Mean times of the window that caused the last switch */
+  struct Switch {
+    QualityTier from;
+    QualityTier to;
+    double      frameMs;
+    double      cpuMs;
+    double      gpuMs;
+  };
+
+  QualityGovernor(double targetMs, QualityTier initial)
+  : m_targetMs(targetMs), m_tier(initial) { }
+
+  QualityTier tier() const {
+    return m_tier;
+  }
+
+  bool atLeast(QualityTier tier) const {
+    return m_tier >= tier;
+  }
+
+  double targetMs() const {
+    return m_targetMs;
+  }
+
+  const Switch& lastSwitch() const {
+    return m_switch;
+  }
+
+  static const char* tierName(QualityTier tier) {
+    static constexpr std::array<const char*, static_cast<uint32_t>(QualityTier::Count)> Names = {
+      "original", "simplified", "skipped", "reduced",
+    };
+
+    return Names[static_cast<uint32_t>(tier)];
+  }
+
+  /** Starts GPU timing of the frame, call before every immediate draw */
+  void draw(ID3D11DeviceContext* pContext) {
+    m_timer.draw(pContext, 1U, 0U);
+  }
+
+  /**
+   * \brief Records a frame, call before the swap chain's Present
+   *
+   * \param [in] createProc Creates driver queries, see GpuTimer
+   * \returns \c true if the tier changed, see lastSwitch
+   */
+  template<typename Create>
+  bool present(ID3D11DeviceContext* pContext, Create&& createProc) {
+    m_timer.present(pContext, 0U, createProc, *this);
+
+    const auto now = std::chrono::steady_clock::now();
+    const double frameMs = std::chrono::duration<double, std::milli>(now - m_last).count();
+    const double cpuMs = std::chrono::duration<double, std::milli>(now - m_presented).count();
+    const bool first = m_frames == UINT64_MAX;
+    m_last = now;
+
+    if (first) {
+      m_frames = 0U;
+      return false;
+    }
+
+    if (frameMs > MaxFrameMs) {
+      return false;
+    }
+
+    m_frameSumMs += frameMs;
+    m_cpuSumMs += std::min(cpuMs, frameMs);
+
+    if (++m_frames < WindowFrames) {
+      return false;
+    }
+
+    const double meanMs = m_frameSumMs / static_cast<double>(m_frames);
+    const double cpuMeanMs = m_cpuSumMs / static_cast<double>(m_frames);
+    const double gpuMeanMs = m_gpuFrames ? m_gpuSumMs / static_cast<double>(m_gpuFrames) : 0.0;
+    const double workMs = m_gpuFrames ? std::max(cpuMeanMs, gpuMeanMs) : meanMs;
+
+    m_frames = 0U;
+    m_frameSumMs = 0.0;
+    m_cpuSumMs = 0.0;
+    m_gpuSumMs = 0.0;
+    m_gpuFrames = 0U;
+
+    constexpr auto Lowest = static_cast<uint32_t>(QualityTier::Count) - 1U;
+    const auto current = static_cast<uint32_t>(m_tier.load());
+    uint32_t next = current;
+
+    if (workMs > m_targetMs * (1.0 + UpMargin)) {
+      m_goodWindows = 0U;
+      next = std::min(current + 1U, Lowest);
+    } else if (workMs < m_targetMs * (1.0 - DownMargin)) {
+      if (++m_goodWindows >= UpgradeWindows) {
+        m_goodWindows = 0U;
+        next = current ? current - 1U : 0U;
+      }
+    } else {
+      m_goodWindows = 0U;
+    }
+
+    if (next == current) {
+      return false;
+    }
+
+    m_tier = static_cast<QualityTier>(next);
+    m_switch = { static_cast<QualityTier>(current), static_cast<QualityTier>(next), meanMs, cpuMeanMs, gpuMeanMs };
+    return true;
+  }
+
+  /** Marks the end of the swap chain's Present */
+  void presented() {
+    m_presented = std::chrono::steady_clock::now();
+  }
+
+  void addSample(uint32_t key, uint32_t, double ms) {
+    if (key) {
+      m_gpuFrameMs += ms;
+    }
+  }
+
+  void addFrame(uint32_t) {
+    if (m_gpuFrameMs <= MaxFrameMs) {
+      m_gpuSumMs += m_gpuFrameMs;
+      m_gpuFrames++;
+    }
+
+    m_gpuFrameMs = 0.0;
+  }
+
+  void dropFrame() {
+    m_gpuFrameMs = 0.0;
+  }
+
+private:
+
+  double                                  m_targetMs;
+  std::atomic<QualityTier>                m_tier;
+  Switch                                  m_switch = { };
+
+  GpuTimer<2U>                            m_timer;
+  std::chrono::steady_clock::time_point   m_last = { };
+  std::chrono::steady_clock::time_point   m_presented = { };
+  uint64_t                                m_frames = UINT64_MAX;
+  double                                  m_frameSumMs = 0.0;
+  double                                  m_cpuSumMs = 0.0;
+  double                                  m_gpuFrameMs = 0.0;
+  double                                  m_gpuSumMs = 0.0;
+  uint32_t                                m_gpuFrames = 0U;
+  uint32_t                                m_goodWindows = 0U;
+
+};
+
+}
+
+#endif
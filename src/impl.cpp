@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <array>
 #include <bit>
 #include <cstdint>
+#include <cstring>
 #include <mutex>
 
 #include <basetsd.h>
@@ -10,8 +12,29 @@
 #include <winnt.h>
 
 #include "impl.h"
+#include "bccache.h"
+#include "benchmark.h"
+#include "cbcache.h"
+#include "counters.h"
+#include "dedup.h"
+#include "formats.h"
+#include "governor.h"
+#include "layouts.h"
 #include "MinHook.h"
+#include "mips.h"
+#include "msaa.h"
+#include "particles.h"
+#include "pool.h"
+#include "profiler.h"
+#include "query.h"
+#include "readback.h"
+#include "reduced.h"
+#include "ring.h"
+#include "rules.h"
+#include "samplers.h"
 #include "shaderbool.h"
+#include "shadow.h"
+#include "skip.h"
 #include "shaders/Default.h"
 #include "shaders/DiffSpheric.h"
 #include "shaders/Grass.h"
@@ -25,6 +48,10 @@
 #include "shaders/Tex.h"
 #include "shaders/VolumeFog.h"
 #include "shaders/SwordTrail.h"
+#include "staging.h"
+#include "stats.h"
+#include "tag.h"
+#include "upscale.h"
 
 #ifdef OLD_SHADERS
 #include "oldshaders/Default.h"
@@ -39,49 +66,256 @@
 
 // #define OLD_SHADERS
 // #define NO_GRASS
+// #define GPU_PROFILER
+// #define AB_BENCHMARK
+// #define DRAW_STATS
+// #define FEED_SKIP
+// #define RING_BUFFERS
+// #define STAGING_WRITES
+// #define LATENT_READBACK
+// #define SAMPLER_LIMITS
+// #define SHADOW_DOWNSCALE
+// #define SHADOW_REUSE
+// #define SHADOW_CULL
+// #define GRASS_DENSITY
+// #define PARTICLE_BUDGET
+// #define REDUCED_EFFECTS
+// #define SPATIAL_UPSCALE
+// #define QUALITY_GOVERNOR
+// #define RT_DOWNGRADE
+// #define MSAA_CAP
+// #define IMMUTABLE_DEDUP
+// #define BC_COMPRESS
+// #define MIP_GENERATION
+
+#if defined(GPU_PROFILER) || defined(AB_BENCHMARK) || defined(PARTICLE_BUDGET) || defined(QUALITY_GOVERNOR)
+#define GPU_TIMERS
+#endif
+
+#if defined(GPU_TIMERS) || defined(RING_BUFFERS)
+#define DRIVER_QUERIES
+#endif
+
+#if defined(AB_BENCHMARK) || defined(QUALITY_GOVERNOR)
+#define KEEP_ORIGINALS
+#endif
+
 namespace atfix {
 
 /** Hooking-related stuff */
 using PFN_ID3D11Device_CreateVertexShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11VertexShader**);
 using PFN_ID3D11Device_CreatePixelShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11PixelShader**);
 using PFN_ID3D11Device_CreateBuffer = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_BUFFER_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Buffer**);
+using PFN_ID3D11Device_CreateTexture2D = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_TEXTURE2D_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Texture2D**);
+using PFN_ID3D11Device_CreateShaderResourceView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_SHADER_RESOURCE_VIEW_DESC*, ID3D11ShaderResourceView**);
+using PFN_ID3D11Device_CreateRenderTargetView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_RENDER_TARGET_VIEW_DESC*, ID3D11RenderTargetView**);
+using PFN_ID3D11Device_CreateDepthStencilView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_DEPTH_STENCIL_VIEW_DESC*, ID3D11DepthStencilView**);
+using PFN_ID3D11Device_CreateInputLayout = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_INPUT_ELEMENT_DESC*, UINT, const void*, SIZE_T, ID3D11InputLayout**);
+using PFN_ID3D11Device_CreateSamplerState = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_SAMPLER_DESC*, ID3D11SamplerState**);
 using PFN_ID3D11Device_CreateQuery = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_QUERY_DESC*, ID3D11Query **);
+using PFN_ID3D11Device_CreatePredicate = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_QUERY_DESC*, ID3D11Predicate **);
 
 
 using PFN_ID3D11DeviceContext_IASetIndexBuffer = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, DXGI_FORMAT, UINT);
+using PFN_ID3D11DeviceContext_IASetVertexBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*, const UINT*, const UINT*);
+using PFN_ID3D11DeviceContext_VSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_PSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_GSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_HSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_DSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_CSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
 using PFN_ID3D11DeviceContext_PSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11PixelShader*,ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_PSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_VSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11VertexShader*,ID3D11ClassInstance* const*, UINT);
 using PFN_ID3D11DeviceContext_DrawIndexed = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, INT);
 using PFN_ID3D11DeviceContext_Draw = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT);
 using PFN_ID3D11DeviceContext_UpdateSubresource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT);
 using PFN_ID3D11DeviceContext_Map = HRESULT(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, D3D11_MAP, UINT, D3D11_MAPPED_SUBRESOURCE*);
+using PFN_ID3D11DeviceContext_Unmap = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT);
+using PFN_ID3D11DeviceContext_CopySubresourceRegion = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, UINT, UINT, UINT, ID3D11Resource*, UINT, const D3D11_BOX*);
+using PFN_ID3D11DeviceContext_CopyResource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, ID3D11Resource*);
+using PFN_ID3D11DeviceContext_ResolveSubresource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, ID3D11Resource*, UINT, DXGI_FORMAT);
+using PFN_ID3D11DeviceContext_Begin = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Asynchronous*);
+using PFN_ID3D11DeviceContext_End = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Asynchronous*);
+using PFN_ID3D11DeviceContext_GetData = HRESULT(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Asynchronous*, void*, UINT, UINT);
+using PFN_ID3D11DeviceContext_SetPredication = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Predicate*, BOOL);
+using PFN_ID3D11DeviceContext_DrawIndexedInstanced = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, UINT, INT, UINT);
+using PFN_ID3D11DeviceContext_DrawInstanced = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext_ClearDepthStencilView = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11DepthStencilView*, UINT, FLOAT, UINT8);
+using PFN_ID3D11DeviceContext_RSSetViewports = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, const D3D11_VIEWPORT*);
+using PFN_ID3D11DeviceContext_RSSetScissorRects = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, const D3D11_RECT*);
+using PFN_ID3D11DeviceContext_RSGetViewports = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT*, D3D11_VIEWPORT*);
+using PFN_ID3D11DeviceContext_RSGetScissorRects = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT*, D3D11_RECT*);
+using PFN_ID3D11DeviceContext_OMSetRenderTargets = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*);
+using PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*, UINT, UINT, ID3D11UnorderedAccessView* const*, const UINT*);
+using PFN_ID3D11DeviceContext_OMSetBlendState = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11BlendState*, const FLOAT[4], UINT);
+using PFN_ID3D11DeviceContext_VSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_GSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_HSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_DSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_CSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_CopyStructureCount = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, UINT, ID3D11UnorderedAccessView*);
+using PFN_ID3D11DeviceContext1_CopySubresourceRegion1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*, UINT, UINT, UINT, UINT, ID3D11Resource*, UINT, const D3D11_BOX*, UINT);
+using PFN_ID3D11DeviceContext1_UpdateSubresource1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext1_DiscardResource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*);
+using PFN_ID3D11DeviceContext_CSSetUnorderedAccessViews = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11UnorderedAccessView* const*, const UINT*);
+using PFN_ID3D11DeviceContext_ClearState = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_ExecuteCommandList = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11CommandList*, BOOL);
+using PFN_ID3D11DeviceContext_FinishCommandList = HRESULT(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, BOOL, ID3D11CommandList**);
 
 using PFN_IDXGISwapChain_Present = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain*, UINT, UINT);
+using PFN_IDXGISwapChain_GetBuffer = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain*, UINT, REFIID, void**);
+using PFN_IDXGISwapChain_ResizeBuffers = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain*, UINT, UINT, UINT, DXGI_FORMAT, UINT);
+using PFN_IDXGIFactory_CreateSwapChain = HRESULT(STDMETHODCALLTYPE*)(IDXGIFactory*, IUnknown*, DXGI_SWAP_CHAIN_DESC*, IDXGISwapChain**);
 
 struct DeviceProcs {
     PFN_ID3D11Device_CreateBuffer                           CreateBuffer                    = nullptr;
+    PFN_ID3D11Device_CreateTexture2D                        CreateTexture2D                 = nullptr;
+    PFN_ID3D11Device_CreateShaderResourceView               CreateShaderResourceView        = nullptr;
+    PFN_ID3D11Device_CreateRenderTargetView                 CreateRenderTargetView          = nullptr;
+    PFN_ID3D11Device_CreateDepthStencilView                 CreateDepthStencilView          = nullptr;
+    PFN_ID3D11Device_CreateInputLayout                      CreateInputLayout               = nullptr;
     PFN_ID3D11Device_CreateVertexShader                     CreateVertexShader              = nullptr;
     PFN_ID3D11Device_CreatePixelShader                      CreatePixelShader               = nullptr;
+    PFN_ID3D11Device_CreateSamplerState                     CreateSamplerState              = nullptr;
     PFN_ID3D11Device_CreateQuery                            CreateQuery                     = nullptr;
+    PFN_ID3D11Device_CreatePredicate                        CreatePredicate                 = nullptr;
 };
 
 struct ContextProcs {
     PFN_ID3D11DeviceContext_IASetIndexBuffer                IASetIndexBuffer                = nullptr;
+    PFN_ID3D11DeviceContext_IASetVertexBuffers              IASetVertexBuffers              = nullptr;
+    PFN_ID3D11DeviceContext_VSSetConstantBuffers            VSSetConstantBuffers            = nullptr;
+    PFN_ID3D11DeviceContext_PSSetConstantBuffers            PSSetConstantBuffers            = nullptr;
+    PFN_ID3D11DeviceContext_GSSetConstantBuffers            GSSetConstantBuffers            = nullptr;
+    PFN_ID3D11DeviceContext_HSSetConstantBuffers            HSSetConstantBuffers            = nullptr;
+    PFN_ID3D11DeviceContext_DSSetConstantBuffers            DSSetConstantBuffers            = nullptr;
+    PFN_ID3D11DeviceContext_CSSetConstantBuffers            CSSetConstantBuffers            = nullptr;
     PFN_ID3D11DeviceContext_PSSetShader                     PSSetShader                     = nullptr;
+    PFN_ID3D11DeviceContext_PSSetShaderResources            PSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_VSSetShader                     VSSetShader                     = nullptr;
     PFN_ID3D11DeviceContext_DrawIndexed                     DrawIndexed                     = nullptr;
     PFN_ID3D11DeviceContext_Draw                            Draw                            = nullptr;
     PFN_ID3D11DeviceContext_UpdateSubresource               UpdateSubresource               = nullptr;
     PFN_ID3D11DeviceContext_Map                             Map                             = nullptr;
+    PFN_ID3D11DeviceContext_Unmap                           Unmap                           = nullptr;
+    PFN_ID3D11DeviceContext_CopySubresourceRegion           CopySubresourceRegion           = nullptr;
+    PFN_ID3D11DeviceContext_CopyResource                    CopyResource                    = nullptr;
+    PFN_ID3D11DeviceContext_ResolveSubresource              ResolveSubresource              = nullptr;
+    PFN_ID3D11DeviceContext_Begin                           Begin                           = nullptr;
+    PFN_ID3D11DeviceContext_End                             End                             = nullptr;
+    PFN_ID3D11DeviceContext_GetData                         GetData                         = nullptr;
+    PFN_ID3D11DeviceContext_SetPredication                  SetPredication                  = nullptr;
+    PFN_ID3D11DeviceContext_DrawIndexedInstanced            DrawIndexedInstanced            = nullptr;
+    PFN_ID3D11DeviceContext_DrawInstanced                   DrawInstanced                   = nullptr;
+    PFN_ID3D11DeviceContext_OMSetRenderTargets              OMSetRenderTargets              = nullptr;
+    PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews OMSetRenderTargetsAndUnorderedAccessViews = nullptr;
+    PFN_ID3D11DeviceContext_OMSetBlendState                 OMSetBlendState                 = nullptr;
+    PFN_ID3D11DeviceContext_VSSetShaderResources            VSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_GSSetShaderResources            GSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_HSSetShaderResources            HSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_DSSetShaderResources            DSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_CSSetShaderResources            CSSetShaderResources            = nullptr;
+    PFN_ID3D11DeviceContext_CSSetUnorderedAccessViews       CSSetUnorderedAccessViews       = nullptr;
+    PFN_ID3D11DeviceContext_CopyStructureCount              CopyStructureCount              = nullptr;
+    PFN_ID3D11DeviceContext1_CopySubresourceRegion1         CopySubresourceRegion1          = nullptr;
+    PFN_ID3D11DeviceContext1_UpdateSubresource1             UpdateSubresource1              = nullptr;
+    PFN_ID3D11DeviceContext1_DiscardResource                DiscardResource                 = nullptr;
+    PFN_ID3D11DeviceContext_RSSetViewports                  RSSetViewports                  = nullptr;
+    PFN_ID3D11DeviceContext_RSSetScissorRects               RSSetScissorRects               = nullptr;
+    PFN_ID3D11DeviceContext_RSGetViewports                  RSGetViewports                  = nullptr;
+    PFN_ID3D11DeviceContext_RSGetScissorRects               RSGetScissorRects               = nullptr;
+    PFN_ID3D11DeviceContext_ClearDepthStencilView           ClearDepthStencilView           = nullptr;
+    PFN_ID3D11DeviceContext_ClearState                      ClearState                      = nullptr;
+    PFN_ID3D11DeviceContext_ExecuteCommandList              ExecuteCommandList              = nullptr;
+    PFN_ID3D11DeviceContext_FinishCommandList               FinishCommandList               = nullptr;
 };
 
 struct DxgiProcs {
-    PFN_IDXGISwapChain_Present  Present = nullptr;
+    PFN_IDXGISwapChain_Present          Present         = nullptr;
+    PFN_IDXGISwapChain_GetBuffer        GetBuffer       = nullptr;
+    PFN_IDXGISwapChain_ResizeBuffers    ResizeBuffers   = nullptr;
+    PFN_IDXGIFactory_CreateSwapChain    CreateSwapChain = nullptr;
+};
+
+#ifdef RING_BUFFERS
+/** Shader stages a ring-backed constant buffer can be bound to */
+enum class CbStage : uint32_t {
+    VS, HS, DS, GS, PS, CS, Count
+};
+#endif
+
+/** Pipeline state we track per context, shaders are shader table indices */
+struct ContextState {
+    static constexpr uint32_t MaxSrvs = 16U;
+    static constexpr uint32_t MaxViewports = D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE;
+
+    uint32_t vs = 0U;
+    uint32_t ps = 0U;
+    uint32_t pass = 0U;
+    uint32_t stateChanges = 0U;
+    uint32_t rule = 0U;
+    bool vsDisabled = false;
+    bool psDisabled = false;
+    bool vsReduced = false;
+    bool psReduced = false;
+#ifdef FEED_SKIP
+    bool feedPass = false;
+#endif
+    uint32_t srvCount = 0U;
+    std::array<ID3D11ShaderResourceView*, MaxSrvs> srvs = { };
+
+    /* Viewports and scissor rects as set by the game, scaled while a
+     * shrunk shadow map, a reduced resolution target or a render size
+     * target is bound. Render scale only applies to viewports of the
+     * output size. */
+    bool shadowPass = false;
+    UINT shadowDivisor = 1U;
+    UINT reducedDivisor = 1U;
+    float renderScale = 1.0f;
+    UINT outputWidth = 0U;
+    UINT outputHeight = 0U;
+    UINT viewportCount = 0U;
+    std::array<D3D11_VIEWPORT, MaxViewports> viewports = { };
+    UINT scissorCount = 0U;
+    std::array<D3D11_RECT, MaxViewports> scissors = { };
+
+#ifdef REDUCED_EFFECTS
+    /* Render targets and blend mode as bound by the game, before redirection */
+    UINT rtvCount = 0U;
+    ID3D11RenderTargetView* rtv = nullptr;
+    ID3D11DepthStencilView* dsv = nullptr;
+    ReducedBlend blendClass = ReducedBlend::Incompatible;
+#endif
+
+#ifdef RING_BUFFERS
+    /* Game buffers as bound by the game, before ring redirection */
+    static constexpr uint32_t MaxVbs = 16U;
+    static constexpr uint32_t MaxCbs = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+
+    std::array<ID3D11Buffer*, MaxVbs> vbs = { };
+    std::array<UINT, MaxVbs> vbStrides = { };
+    std::array<UINT, MaxVbs> vbOffsets = { };
+    std::array<std::array<ID3D11Buffer*, MaxCbs>, static_cast<uint32_t>(CbStage::Count)> cbs = { };
+#endif
 };
 
-struct UpdateSubresourceCache {
-    ID3D11Resource* resource = nullptr;
-    UINT subresource;
-    std::vector<uint8_t> data;
+/** Private data GUID of the state of a deferred context */
+inline constexpr GUID ContextStateGuid = { 0x8c2f4d61, 0x3b7e, 0x4a95, { 0x9d, 0x0c, 0x62, 0xe1, 0x5a, 0x37, 0xb8, 0x14 } };
+
+/**
+ * State of one deferred context, attached to it on first use.
+ * Deferred contexts may record on any thread, but each context
+ * is only used by one thread at a time.
+ */
+class DeferredContextState final : public PrivateObject {
+
+public:
+
+    ContextState state;
+
 };
+
 namespace {
     mutex  g_hookMutex;
     uint32_t g_installedHooks = 0U;
@@ -98,9 +332,259 @@ ContextProcs  g_immContextProcs;
 ContextProcs  g_defContextProcs;
 DxgiProcs g_dxgiProcs;
 
-constexpr uint32_t HOOK_DEVICE  = (1u << 0);
-constexpr uint32_t HOOK_IMM_CTX = (1u << 1);
-constexpr uint32_t HOOK_DEF_CTX = (1u << 2);
+ContextState  g_immContextState;
+ShaderTable   g_shaders;
+FrameCounters g_counters("atfix_frames.csv", 600U); /* frames per row */
+InputLayoutCache g_inputLayouts;
+
+#ifdef GPU_PROFILER
+GpuProfiler   g_profiler("atfix_gpu.txt");
+#endif
+
+#ifdef AB_BENCHMARK
+AbBenchmark   g_abBenchmark("atfix_ab.txt");
+#endif
+
+#ifdef FEED_SKIP
+FeedTracker   g_feeds;
+#endif
+
+#ifdef DRAW_STATS
+DrawStats     g_drawStats("atfix_draws.csv");
+
+/**
+ * Snapshot hotkey, and snapshot interval in frames (0 = hotkey only).
+ * Snapshots also write the frame counters gathered so far.
+ */
+constexpr int       DRAW_STATS_KEY      = VK_F9;
+constexpr uint64_t  DRAW_STATS_INTERVAL = 0U;
+#endif
+
+#ifdef RING_BUFFERS
+/**
+ * Dynamic buffers up to RING_MAX_SLICE bytes are sub-allocated from
+ * these rings on the immediate context. Constant buffers need
+ * feature level 11.1 with constant buffer offsetting.
+ */
+constexpr UINT RING_VB_SIZE   = 8U << 20;
+constexpr UINT RING_CB_SIZE   = 4U << 20;
+constexpr UINT RING_MAX_SLICE = 64U << 10;
+
+UploadRing              g_vbRing;
+UploadRing              g_cbRing;
+ID3D11DeviceContext1*   g_immContext1 = nullptr;
+#endif
+
+#ifdef STAGING_WRITES
+StagingPool   g_stagingPool;
+#endif
+
+#ifdef SHADOW_REUSE
+/**
+ * Shadow map reuse, see shadow.h. Either skip every other frame, or
+ * frames whose vertex constants moved less than the relative epsilon,
+ * for at most SHADOW_REUSE_MAX_FRAMES frames in a row. Shadows of
+ * moving objects lag behind while maps are reused.
+ */
+constexpr bool      SHADOW_REUSE_ALTERNATE  = false;
+constexpr float     SHADOW_REUSE_EPSILON    = 1.0e-3f;
+constexpr uint32_t  SHADOW_REUSE_MAX_FRAMES = 4U;
+
+ShadowReuse   g_shadowReuse(SHADOW_REUSE_ALTERNATE, SHADOW_REUSE_EPSILON, SHADOW_REUSE_MAX_FRAMES);
+#endif
+
+#ifdef PARTICLE_BUDGET
+/**
+ * Particle draw budget, see particles.h. The draw limit per frame
+ * moves between the two bounds to keep the GPU time of particle
+ * draws below PARTICLE_GPU_BUDGET_MS.
+ */
+constexpr uint32_t  PARTICLE_MAX_DRAWS      = 400U;
+constexpr uint32_t  PARTICLE_MIN_DRAWS      = 50U;
+constexpr double    PARTICLE_GPU_BUDGET_MS  = 3.0;
+
+/* Particle1 and Particle2 vertex shaders */
+constexpr std::array<ShaderTable::Hash, 2> PARTICLE_SHADERS = {{
+    { 0x231fb2e6, 0xc211f72b, 0x1a0b5fbb, 0xe9e36557 },
+    { 0x003ca944, 0x7fb09127, 0xed8e5b6e, 0x4cbdd6e9 },
+}};
+
+ParticleBudget g_particleBudget(PARTICLE_MAX_DRAWS, PARTICLE_MIN_DRAWS, PARTICLE_GPU_BUDGET_MS);
+#endif
+
+#ifdef REDUCED_EFFECTS
+/**
+ * Volume fog and radial blur are rendered at 1/divisor resolution
+ * instead of being removed, see reduced.h.
+ */
+constexpr UINT REDUCED_EFFECTS_DIVISOR = 2U;
+
+ReducedPass   g_reducedPass;
+#endif
+
+#ifdef SPATIAL_UPSCALE
+/**
+ * Render resolution in percent of the output resolution, and the
+ * sharpening strength of the upscaling filter from 0 to 1, see
+ * upscale.h.
+ */
+constexpr uint32_t  UPSCALE_RENDER_PERCENT  = 67U;
+constexpr float     UPSCALE_SHARPNESS       = 0.5f;
+
+Upscaler      g_upscaler(UPSCALE_RENDER_PERCENT, UPSCALE_SHARPNESS);
+#endif
+
+#ifdef QUALITY_GOVERNOR
+/**
+ * Frame time the quality governor holds, see governor.h. The
+ * governor starts at the tier the static replacements amount to.
+ */
+constexpr double    GOVERNOR_TARGET_MS  = 1000.0 / 60.0;
+
+QualityGovernor g_governor(GOVERNOR_TARGET_MS, QualityTier::Skipped);
+#endif
+
+#ifdef RT_DOWNGRADE
+/**
+ * Render targets created with a narrower format, see formats.h.
+ * Alpha is lost, and R11G11B10 cannot hold negative values, so each
+ * entry must name a target known not to need either, by its size.
+ * Every downgraded target is listed in atfix_formats.txt. E.g.
+ *
+ *   { DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_R11G11B10_FLOAT, 1920U, 1080U },
+ */
+constexpr std::array<FormatDowngrade, 0> FORMAT_DOWNGRADES = { };
+
+FormatReport  g_formatReport("atfix_formats.txt");
+#endif
+
+#ifdef MSAA_CAP
+/**
+ * Highest sample count of multisampled render targets, depth
+ * buffers and swap chains. 1 turns MSAA off, which breaks shaders
+ * that read multisampled textures directly.
+ */
+constexpr UINT MSAA_MAX_SAMPLES = 2U;
+#endif
+
+#ifdef IMMUTABLE_DEDUP
+/**
+ * Byte-identical immutable buffers and textures share one resource,
+ * see dedup.h. Every load is summarized in atfix_dedup.txt.
+ */
+ResourceDedup g_dedup("atfix_dedup.txt");
+#endif
+
+#if defined(BC_COMPRESS) || defined(MIP_GENERATION)
+WorkerPool        g_workers;
+#endif
+
+#ifdef BC_COMPRESS
+/**
+ * Immutable RGBA8 textures of at least BC_MIN_SIZE texels per side
+ * are compressed to BC1, or BC3 if they have alpha, see bccache.h.
+ * Every candidate is listed in atfix_bc.txt with its name, but only
+ * those named in BC_TEXTURES are compressed. Normal maps, lookup
+ * tables and UI atlases must stay off the list. Encoded textures are
+ * kept in the atfix_bc directory. E.g.
+ *
+ *   "3f2a9c1e00c4b7d9a1e25f60",
+ */
+constexpr UINT BC_MIN_SIZE = 64U;
+
+constexpr std::array<const char*, 0> BC_TEXTURES = { };
+
+TextureCompressor g_compressor("atfix_bc", "atfix_bc.txt", BC_MIN_SIZE, g_workers);
+#endif
+
+#ifdef MIP_GENERATION
+/**
+ * Immutable RGBA8 textures of at least MIP_MIN_SIZE texels per side
+ * that have a single mip get a full chain, see mips.h. Runs before
+ * block compression, which then encodes every level.
+ */
+constexpr UINT MIP_MIN_SIZE = 64U;
+
+MipGenerator  g_mipGenerator(MIP_MIN_SIZE, g_workers);
+#endif
+
+#ifdef LATENT_READBACK
+/**
+ * Staging resources whose CPU reads may return data a few frames
+ * old, matched at creation. Each must be filled by a single copy
+ * per readback. Read maps that wait for the GPU are logged to
+ * atfix_readback.txt, candidates should be taken from there, e.g.
+ *
+ *   { D3D11_RESOURCE_DIMENSION_TEXTURE2D, 1U, 1U, DXGI_FORMAT_R32_FLOAT },
+ */
+constexpr std::array<ReadbackShape, 0> READBACK_ALLOWLIST = { };
+
+ReadbackReport g_readbackReport("atfix_readback.txt");
+#endif
+
+uint64_t      g_frame = 0U;
+
+#ifdef SAMPLER_LIMITS
+/**
+ * Sampler limits per graphics quality (high, mid, low), see
+ * samplers.h. High leaves the game's samplers untouched.
+ */
+constexpr std::array<SamplerTier, 3> SAMPLER_TIERS = {{
+    { 16U, 0.0f },
+    { 4U,  0.0f },
+    { 1U,  0.5f },
+}};
+#endif
+
+#ifdef SHADOW_DOWNSCALE
+/**
+ * Shadow map size divisor per graphics quality (high, mid, low),
+ * see shadow.h. Viewports are scaled to match.
+ */
+constexpr std::array<UINT, 3> SHADOW_MAP_DIVISORS = { 1U, 1U, 2U };
+#endif
+
+#ifdef SHADOW_CULL
+/**
+ * Indexed shadow draws below this index count are culled, per
+ * graphics quality (high, mid, low). Unless SHADOW_CULL_ALL_SHADERS
+ * is set, only draws using one of SHADOW_CULL_SHADERS are culled.
+ */
+constexpr std::array<UINT, 3> SHADOW_CULL_MIN_INDICES = { 0U, 0U, 192U };
+constexpr bool SHADOW_CULL_ALL_SHADERS = false;
+
+/* Prop shadow vertex shader */
+#ifdef OLD_SHADERS
+constexpr std::array<ShaderTable::Hash, 1> SHADOW_CULL_SHADERS = {{
+    { 0x14aa73c0, 0x9172f259, 0xe9175393, 0x26863db4 },
+}};
+#else
+constexpr std::array<ShaderTable::Hash, 1> SHADOW_CULL_SHADERS = {{
+    { 0xefbe9f94, 0x5c300015, 0x29ab6626, 0xb640836c },
+}};
+#endif
+#endif
+
+#ifdef GRASS_DENSITY
+/**
+ * Grass density in percent per graphics quality (high, mid, low),
+ * for draws with the game's grass VS and PS bound. Instanced draws
+ * drop instances, other draws drop whole blades of
+ * GRASS_BLADE_INDICES indices from the end of the range. Draws
+ * whose index count is not a multiple of it are left alone.
+ */
+constexpr std::array<UINT, 3> GRASS_DENSITY_PERCENT = { 100U, 100U, 50U };
+constexpr UINT GRASS_BLADE_INDICES = 6U;
+
+constexpr ShaderTable::Hash GRASS_VS_HASH = { 0x5272db3c, 0xdc7a397a, 0xb7bf11d5, 0x078d9485 };
+constexpr ShaderTable::Hash GRASS_PS_HASH = { 0xb2f29488, 0x210994ca, 0x07510660, 0x301d1575 };
+#endif
+
+constexpr uint32_t HOOK_DEVICE    = (1u << 0);
+constexpr uint32_t HOOK_IMM_CTX   = (1u << 1);
+constexpr uint32_t HOOK_DEF_CTX   = (1u << 2);
+constexpr uint32_t HOOK_FACTORY   = (1u << 3);
+constexpr uint32_t HOOK_SWAPCHAIN = (1u << 4);
 
 inline const DxgiProcs* getDxgiProcs([[maybe_unused]] IDXGISwapChain* pSwapchain) {
     return &g_dxgiProcs;
@@ -114,19 +598,90 @@ inline const ContextProcs* getContextProcs(ID3D11DeviceContext* pContext) {
         : &g_defContextProcs;
 }
 
+inline ContextState* getContextState(ID3D11DeviceContext* pContext) {
+    if (pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE) {
+        return &g_immContextState;
+    }
+
+    auto* data = PrivateObject::get<DeferredContextState>(pContext, ContextStateGuid);
+
+    if (!data) {
+        data = new DeferredContextState();
+        data->AddRef();
+        PrivateObject::attach(pContext, ContextStateGuid, data);
+    }
+
+    /* The context holds a reference for as long as it lives */
+    data->Release();
+    return &data->state;
+}
+
 inline bool isImmediatecontext(
         ID3D11DeviceContext*      pContext) {
   return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE;
 }
 
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
+/** Graphics quality from the game settings, 0 is high and 2 is low */
+inline uint32_t getQualityVal() {
+    if (atfix::SettingsAddress == nullptr) {
+        return 0U;
+    }
+
+    return *std::bit_cast<uint32_t*>(atfix::SettingsAddress);
+}
+
+/** Quality for draw-time reductions, the governor's lowest tier forces low */
+inline uint32_t getReductionQuality() {
+#ifdef QUALITY_GOVERNOR
+    if (g_governor.atLeast(QualityTier::Reduced)) {
+        return 2U;
+    }
+#endif
+
+    return getQualityVal();
+}
+
+#ifdef QUALITY_GOVERNOR
+/**
+ * Picks the shader to bind on the immediate context. Replacements
+ * are swapped back to the game's original above the simplified
+ * tier, disabled effects above the skipped tier.
+ */
+template<typename T>
+T* governShader(T* pShader, uint32_t tag) {
+    const QualityTier tier = (tag & TAG_DISABLED) ? QualityTier::Skipped : QualityTier::Simplified;
+
+    if (!(tag & TAG_REPLACED) || g_governor.atLeast(tier)) {
+        return pShader;
+    }
+
+    IUnknown* original = nullptr;
+    UINT size = sizeof(original);
+
+    if (FAILED(pShader->GetPrivateData(AbOriginalGuid, &size, &original)) || !original) {
+        return pShader;
+    }
+
+    /* The replacement keeps its original alive */
+    original->Release();
+    return static_cast<T*>(original);
+}
+#endif
+
+HRESULT createVertexShader(
         ID3D11Device*           pDevice,
         const void*             pShaderBytecode,
         SIZE_T                  BytecodeLength,
         ID3D11ClassLinkage*     pClassLinkage,
-        ID3D11VertexShader**    ppVertexShader) {
+        ID3D11VertexShader**    ppVertexShader,
+        uint32_t&               tagFlags) {
     const auto* procs = getDeviceProcs(pDevice);
 
+    const auto replace = [&] (const auto& bytecode) {
+        tagFlags |= TAG_REPLACED;
+        return procs->CreateVertexShader(pDevice, bytecode.data(), bytecode.size(), pClassLinkage, ppVertexShader);
+    };
+
     static uint32_t TextureVal = 0U;
     static uint32_t QualityVal = 0U;
 
@@ -162,7 +717,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             log("Particle found");
         }
         if (isAMD) {
-            return procs->CreateVertexShader(pDevice, FIXED_PARTICLE_SHADER1.data(), FIXED_PARTICLE_SHADER1.size(), pClassLinkage, ppVertexShader);
+            return replace(FIXED_PARTICLE_SHADER1);
         } else {
             return procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
         }
@@ -174,7 +729,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             log("Particle Iterate found");
         }
         if (isAMD) {
-            return procs->CreateVertexShader(pDevice, FIXED_PARTICLE_SHADER2.data(), FIXED_PARTICLE_SHADER2.size(), pClassLinkage, ppVertexShader);
+            return replace(FIXED_PARTICLE_SHADER2);
         } else {
             return procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
         }
@@ -185,7 +740,13 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             VolumeFogB = true;
             log("Volumefog found");
         }
-        return procs->CreateVertexShader(pDevice, NO_VOLUMEFOG_SHADER.data(), NO_VOLUMEFOG_SHADER.size(), pClassLinkage, ppVertexShader);
+#ifdef REDUCED_EFFECTS
+        tagFlags |= TAG_REDUCED;
+        return procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
+#else
+        tagFlags |= TAG_DISABLED;
+        return replace(NO_VOLUMEFOG_SHADER);
+#endif
 
     } else if (simd_equal(GrassShader, hash) && (QualityVal < 2)) {
 
@@ -194,9 +755,9 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             log("Grass found");
         }
 #ifdef NO_GRASS
-        return procs->CreateVertexShader(pDevice, NO_VS_GRASS_SHADER.data(), NO_VS_GRASS_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(NO_VS_GRASS_SHADER);
 #else
-        return procs->CreateVertexShader(pDevice, SIMPLIFIED_VS_GRASS_SHADER.data(), SIMPLIFIED_VS_GRASS_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(SIMPLIFIED_VS_GRASS_SHADER);
 #endif
 
     }/* else if (simd_equal(ShadowPlayerShader, hash) && (QualityVal < 2)) {
@@ -206,9 +767,9 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             log("Shadow Player found");
         }
 #ifdef OLD_SHADERS
-        return procs->CreateVertexShader(pDevice, NO_VS_PLAYER_SHADOW_SHADER.data(), NO_VS_PLAYER_SHADOW_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(NO_VS_PLAYER_SHADOW_SHADER);
 #else
-        return procs->CreateVertexShader(pDevice, FIXED_PLAYER_SHADOW_SHADER.data(), FIXED_PLAYER_SHADOW_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(FIXED_PLAYER_SHADOW_SHADER);
 #endif
 
     } /* else if (simd_equal(ShadowPropShader, hash) && (QualityVal < 2)) {
@@ -218,9 +779,9 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             log("Shadow Prop found");
         }
 #ifdef OLD_SHADERS
-        return procs->CreateVertexShader(pDevice, NO_VS_PROP_SHADOW_SHADER.data(), NO_VS_PROP_SHADOW_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(NO_VS_PROP_SHADOW_SHADER);
 #else
-        return procs->CreateVertexShader(pDevice, FIXED_PROP_SHADOW_SHADER.data(), FIXED_PROP_SHADOW_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(FIXED_PROP_SHADOW_SHADER);
 #endif
 
     } */ else if (simd_equal(TerrainShader, hash) && (QualityVal == 2)) {
@@ -229,7 +790,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             TerrainB = true;
             log("Terrain found");
         }
-        return procs->CreateVertexShader(pDevice, LOW_VS_TERRAIN_SHADER.data(), LOW_VS_TERRAIN_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(LOW_VS_TERRAIN_SHADER);
 
     } /*else if (simd_equal(PlayerShader, hash) && (TextureVal == 0)) {
 
@@ -237,7 +798,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             VSPlayerB = true;
             log("VS Player found");
         }
-        return procs->CreateVertexShader(pDevice, SIMPLIFIED_VS_PLAYER_SHADER.data(), SIMPLIFIED_VS_PLAYER_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(SIMPLIFIED_VS_PLAYER_SHADER);
 
     } */else if (simd_equal(DefaultShader, hash) && (QualityVal == 2)) {
 
@@ -245,7 +806,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             DefaultB = true;
             log("Default found");
         }
-        return procs->CreateVertexShader(pDevice, SIMPLIFIED_VS_DEFAULT_SHADER.data(), SIMPLIFIED_VS_DEFAULT_SHADER.size(), pClassLinkage, ppVertexShader);
+        return replace(SIMPLIFIED_VS_DEFAULT_SHADER);
 
     } else if (simd_equal(SkyBoxShader, hash)) {
 
@@ -253,7 +814,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             SkyBoxB = true;
             log("SkyBox found");
         }
-        return procs->CreateVertexShader(pDevice, VS_SKYBOX.data(), VS_SKYBOX.size(), pClassLinkage, ppVertexShader);
+        return replace(VS_SKYBOX);
 
     } else if (simd_equal(SkyBoxAniShader, hash)) {
 
@@ -261,21 +822,27 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
             SkyBoxAniB = true;
             log("SkyBox Ani found");
         }
-        return procs->CreateVertexShader(pDevice, VS_SKYBOX_ANI.data(), VS_SKYBOX_ANI.size(), pClassLinkage, ppVertexShader);
+        return replace(VS_SKYBOX_ANI);
     }
 
     return procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
 }
 ID3D11PixelShader** TexPS2 = nullptr;
 
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
+HRESULT createPixelShader(
     ID3D11Device* pDevice,
     const void* pShaderBytecode,
     SIZE_T                  BytecodeLength,
     ID3D11ClassLinkage* pClassLinkage,
-    ID3D11PixelShader** ppPixelShader) {
+    ID3D11PixelShader** ppPixelShader,
+    uint32_t& tagFlags) {
     const auto* procs = getDeviceProcs(pDevice);
 
+    const auto replace = [&] (const auto& bytecode) {
+        tagFlags |= TAG_REPLACED;
+        return procs->CreatePixelShader(pDevice, bytecode.data(), bytecode.size(), pClassLinkage, ppPixelShader);
+    };
+
     static uint32_t TextureVal = 0U;
     static uint32_t QualityVal = 0U;
 
@@ -318,9 +885,9 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             log("DiffVolTex found");
         }
 #ifdef OLD_SHADERS
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_TEXOLD_SHADER.data(), SIMPLIFIED_TEXOLD_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_TEXOLD_SHADER);
 #else
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_TEX_SHADER.data(), SIMPLIFIED_TEX_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_TEX_SHADER);
 #endif
     } else if (simd_equal(RadialShader, hash) && (QualityVal < 2)) {
 
@@ -328,13 +895,19 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             RadialBlurB = true;
             log("RadialBlur found");
         }
-        return procs->CreatePixelShader(pDevice, NO_RADIALBLUR_SHADER.data(), NO_RADIALBLUR_SHADER.size(), pClassLinkage, ppPixelShader);
+#ifdef REDUCED_EFFECTS
+        tagFlags |= TAG_REDUCED;
+        return procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
+#else
+        tagFlags |= TAG_DISABLED;
+        return replace(NO_RADIALBLUR_SHADER);
+#endif
 
     } else if (simd_equal(GrassShader, hash) && (QualityVal < 2)) {
 #ifdef NO_GRASS
-        return procs->CreatePixelShader(pDevice, NO_FS_GRASS_SHADER.data(), NO_FS_GRASS_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(NO_FS_GRASS_SHADER);
 #else
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_GRASS_SHADER.data(), SIMPLIFIED_FS_GRASS_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_GRASS_SHADER);
 #endif
     } /* else if (simd_equal(ShadowShader, hash) && (TextureVal == 0)) {
         if (!FragmentShadowB) {
@@ -342,9 +915,9 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             log("Fragment Shadow found");
         }
 #ifdef OLD_SHADERS
-        return procs->CreatePixelShader(pDevice, NO_FS_SHADOW_SHADER.data(), NO_FS_SHADOW_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(NO_FS_SHADOW_SHADER);
 #else
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_SHADOW_SHADER.data(), SIMPLIFIED_FS_SHADOW_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_SHADOW_SHADER);
 #endif
 
     }*/  else if (simd_equal(SphericalShader, hash) && (QualityVal < 2)) {
@@ -353,21 +926,21 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             SphericalB = true;
             log("Spherical Map found");
         }
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_HIGH_SPHERICAL_SHADER.data(), SIMPLIFIED_FS_HIGH_SPHERICAL_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_HIGH_SPHERICAL_SHADER);
 
     } else if (simd_equal(TerrainShader, hash) && (QualityVal == 2)) {
 #ifdef OLD_SHADERS
-        return procs->CreatePixelShader(pDevice, LOW_FS_TERRAIN_SHADER.data(), LOW_FS_TERRAIN_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(LOW_FS_TERRAIN_SHADER);
 #else
-        return procs->CreatePixelShader(pDevice, LOW_FS_TERRAIN_SHADER.data(), LOW_FS_TERRAIN_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(LOW_FS_TERRAIN_SHADER);
 #endif
 
     } else if (simd_equal(DefaultShader, hash) && (QualityVal == 2)) {
 #ifdef OLD_SHADERS
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_DEFAULT_OLD_SHADER.data(), SIMPLIFIED_FS_DEFAULT_OLD_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_DEFAULT_OLD_SHADER);
 #else
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_DEFAULT_SHADER.data(), SIMPLIFIED_FS_DEFAULT_SHADER.size(), pClassLinkage, ppPixelShader);
-        // return procs->CreatePixelShader(pDevice, TEST_FS_DEFAULT_SHADER.data(), TEST_FS_DEFAULT_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_DEFAULT_SHADER);
+        // return replace(TEST_FS_DEFAULT_SHADER);
 #endif
 
     } else if (simd_equal(SphericalShader, hash) && (QualityVal == 2)) {
@@ -376,7 +949,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             SphericalB = true;
             log("Spherical Map found");
         }
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_LOW_SPHERICAL_SHADER.data(), SIMPLIFIED_FS_LOW_SPHERICAL_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_LOW_SPHERICAL_SHADER);
 
     } else if (simd_equal(PlayerHairShader, hash) && (QualityVal == 2)) {
 
@@ -384,7 +957,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             PlayerHairB = true;
             log("Player Hair found");
         }
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_HAIR_PLAYER_SHADER.data(), SIMPLIFIED_FS_HAIR_PLAYER_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_HAIR_PLAYER_SHADER);
 
     } else if (simd_equal(PlayerFaceShader, hash) && (QualityVal == 2)) {
 
@@ -392,7 +965,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             PlayerFaceB = true;
             log("Player Face found");
         }
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_FACE_PLAYER_SHADER.data(), SIMPLIFIED_FS_FACE_PLAYER_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_FACE_PLAYER_SHADER);
 
     } else if (simd_equal(PlayerCostumeShader, hash) && (QualityVal == 2)) {
 
@@ -400,15 +973,15 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             PlayerBodyB = true;
             log("Player Body found");
         }
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_COSTUME_PLAYER_SHADER.data(), SIMPLIFIED_FS_COSTUME_PLAYER_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_COSTUME_PLAYER_SHADER);
 
     } else if (simd_equal(SkyBoxShader, hash)) {
 
-        return procs->CreatePixelShader(pDevice, FS_SKYBOX.data(), FS_SKYBOX.size(), pClassLinkage, ppPixelShader);
+        return replace(FS_SKYBOX);
 
     } /*else if (simd_equal(SkyBoxAniShader, hash)) {
 
-        return procs->CreatePixelShader(pDevice, FS_SKYBOX_ANI.data(), FS_SKYBOX_ANI.size(), pClassLinkage, ppPixelShader);
+        return replace(FS_SKYBOX_ANI);
 
     } */else if (simd_equal(DiffSphericShader, hash) && (QualityVal == 2)) {
 
@@ -416,7 +989,7 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             DiffSphericB = true;
             log("Diff Spheric found");
         }
-        return procs->CreatePixelShader(pDevice, LOW_DIFFSPHERIC_SHADER.data(), LOW_DIFFSPHERIC_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(LOW_DIFFSPHERIC_SHADER);
 
     } else if (simd_equal(DiffSphericShader, hash) && (QualityVal < 2)) {
 
@@ -424,247 +997,2923 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
             DiffSphericB = true;
             log("Diff Spheric found");
         }
-        return procs->CreatePixelShader(pDevice, HIGH_DIFFSPHERIC_SHADER.data(), HIGH_DIFFSPHERIC_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(HIGH_DIFFSPHERIC_SHADER);
     }
 #ifdef OLD_SHADERS
      else if (simd_equal(UnkShader, hash)) {
 
-        return procs->CreatePixelShader(pDevice, SIMPLIFIED_FS_UNK_SHADER.data(), SIMPLIFIED_FS_UNK_SHADER.size(), pClassLinkage, ppPixelShader);
+        return replace(SIMPLIFIED_FS_UNK_SHADER);
 
     }
 #endif
     else  if (simd_equal(SwordTrailShader, hash)) {
 
-        return procs->CreatePixelShader(pDevice, FS_SWORDTRAIL_DNPERF.data(), FS_SWORDTRAIL_DNPERF.size(), pClassLinkage, ppPixelShader);
+        return replace(FS_SWORDTRAIL_DNPERF);
 
     }
     
     return procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_UpdateSubresource(
-        ID3D11DeviceContext*             pContext,
-        ID3D11Resource  *pDstResource,
-        UINT            DstSubresource,
-        const D3D11_BOX *pDstBox,
-        const void      *pSrcData,
-        UINT            SrcRowPitch,
-        UINT            SrcDepthPitch) {
-    auto procs = getContextProcs(pContext);
-
-    procs->UpdateSubresource(pContext, pDstResource, DstSubresource, pDstBox, pSrcData, SrcRowPitch, SrcDepthPitch);
-
+/** Tags created shaders with the shader table index of the game's hash */
+template<typename T>
+void tagShader(const void* pShaderBytecode, T** ppShader, uint32_t tagFlags) {
+    if (ppShader && *ppShader) {
+        const auto* hash = std::bit_cast<const uint32_t*>(std::bit_cast<const uint8_t*>(pShaderBytecode) + 4);
+        setTag(*ppShader, g_shaders.add(hash) | tagFlags);
+    }
 }
 
-HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_Map(ID3D11DeviceContext* pContext, ID3D11Resource* pResource, UINT Subresource, D3D11_MAP MapType, UINT MapFlags, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
-    auto procs = getContextProcs(pContext);
-    HRESULT result = procs->Map(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
-    return result;
-}
+#ifdef KEEP_ORIGINALS
+/** Keeps the game's original shader alive next to its replacement */
+template<typename T, typename Create>
+void attachOriginal(T* pShader, Create&& createProc) {
+    T* original = nullptr;
 
-inline std::uint64_t crc32(const void* data) {
-    const uint8_t* bytes = static_cast<const uint8_t*>(data);
-    std::uint64_t crc = 0;
-    const uint64_t* qwords = reinterpret_cast<const uint64_t*>(bytes);
-    for (size_t i = 0; i < 4; ++i) {
-        crc = __builtin_ia32_crc32di(crc, qwords[i]);
-    }
-    return crc;
-}
-uint32_t hashv = 0;
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreateBuffer(
-        ID3D11Device*             pDevice,
-  const D3D11_BUFFER_DESC*        pDesc,
-  const D3D11_SUBRESOURCE_DATA*   pData,
-        ID3D11Buffer**            ppBuffer) {
-  auto procs = getDeviceProcs(pDevice);
-    if (pDesc->ByteWidth == 136) {
-        log(crc32(pDesc));
-    }
-    if (pDesc->ByteWidth == 576 && pDesc->Usage == D3D11_USAGE_IMMUTABLE && pDesc->BindFlags == D3D11_BIND_INDEX_BUFFER) {
-        log(crc32(pDesc));
+    if (SUCCEEDED(createProc(&original))) {
+        setTag(original, tagIndex(getTag(pShader)));
+        pShader->SetPrivateDataInterface(AbOriginalGuid, original);
+        original->Release();
     }
-  return procs->CreateBuffer(pDevice, pDesc, pData, ppBuffer);
-}
-ID3D11PixelShader* DefPS = nullptr;
-ID3D11VertexShader* DefVS = nullptr;
-void CreateShaderOnStart(ID3D11Device* pDevice) {
-    pDevice->CreatePixelShader(EFFECTS_FS_DEFAULT_SHADER.data(), EFFECTS_FS_DEFAULT_SHADER.size(), nullptr, &DefPS);
-    pDevice->CreateVertexShader(EFFECTS_VS_DEFAULT_SHADER.data(), EFFECTS_VS_DEFAULT_SHADER.size(), nullptr, &DefVS);
 }
+#endif
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
+        ID3D11Device*           pDevice,
+        const void*             pShaderBytecode,
+        SIZE_T                  BytecodeLength,
+        ID3D11ClassLinkage*     pClassLinkage,
+        ID3D11VertexShader**    ppVertexShader) {
+    uint32_t tagFlags = 0U;
+    const HRESULT hr = createVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader, tagFlags);
 
-D3D11_BUFFER_DESC desc = { };
-ID3D11Buffer* buffer = nullptr;
-constexpr std::uint64_t hashwave = 1061255302ull;
-constexpr std::uint64_t hashwave2 = 3340896148ull;
+    if (SUCCEEDED(hr)) {
+        tagShader(pShaderBytecode, ppVertexShader, tagFlags);
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_IASetIndexBuffer(
-        ID3D11DeviceContext* pContext,
-        ID3D11Buffer* pIndexBuffer,
-        DXGI_FORMAT Format,
-        UINT Offset) {
-    const auto* procs = getContextProcs(pContext);
-    if (pIndexBuffer) {
-        pIndexBuffer->GetDesc(&desc);
-        if (crc32(&desc) == hashwave) {
-            pContext->PSSetShader(DefPS, nullptr, 0);
-            pContext->VSSetShader(DefVS, nullptr, 0);
-        }
-        if (crc32(&desc) == hashwave2) {
-            pContext->PSSetShader(DefPS, nullptr, 0);
-            pContext->VSSetShader(DefVS, nullptr, 0);
+#ifdef KEEP_ORIGINALS
+        if (ppVertexShader && (tagFlags & TAG_REPLACED)) {
+            attachOriginal(*ppVertexShader, [&] (ID3D11VertexShader** ppOriginal) {
+                return getDeviceProcs(pDevice)->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppOriginal);
+            });
         }
+#endif
     }
 
-    procs->IASetIndexBuffer(pContext, pIndexBuffer, Format, Offset);
-}
-
-void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetShader(
-        ID3D11DeviceContext* pContext,
-        ID3D11PixelShader* pPixelShader,
-        ID3D11ClassInstance* const* ppClassInstances,
-        UINT NumClassInstances) {
-    auto procs = getContextProcs(pContext);
-    // pContext->IAGetIndexBuffer(&buffer, nullptr, nullptr);
-    // if (buffer) {
-    //     buffer->GetDesc(&desc);
-    //     buffer->Release();
-    //     if (crc32(&desc) == hashwave) {
-    //         // pContext->VSSetShader();
-    //         // pContext->PSSetShader(DefPS, nullptr, 0);
-    //         procs->PSSetShader(pContext, DefPS, ppClassInstances, NumClassInstances);
-    //         return;
-    //     }
-    // }
-
-
-    // if (pPixelShader == DefPS) {
-    //     log("shader was set");
-    // }
-    procs->PSSetShader(pContext, pPixelShader, ppClassInstances, NumClassInstances);
+    return hr;
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexed(
-        ID3D11DeviceContext* pContext,
-        UINT IndexCount,
-        UINT StartIndexLocation,
-        INT BaseVertexLocation) {
-    auto procs = getContextProcs(pContext);
-    pContext->IAGetIndexBuffer(&buffer, nullptr, nullptr);
-    if (buffer) {
-        buffer->GetDesc(&desc);
-        buffer->Release();
-        if (crc32(&desc) == hashwave) {
-            // pContext->VSSetShader();
-            pContext->PSSetShader(DefPS, nullptr, 0);
-            // log("found");
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
+        ID3D11Device*           pDevice,
+        const void*             pShaderBytecode,
+        SIZE_T                  BytecodeLength,
+        ID3D11ClassLinkage*     pClassLinkage,
+        ID3D11PixelShader**     ppPixelShader) {
+    uint32_t tagFlags = 0U;
+    const HRESULT hr = createPixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader, tagFlags);
+
+    if (SUCCEEDED(hr)) {
+        tagShader(pShaderBytecode, ppPixelShader, tagFlags);
+
+#ifdef KEEP_ORIGINALS
+        if (ppPixelShader && (tagFlags & TAG_REPLACED)) {
+            attachOriginal(*ppPixelShader, [&] (ID3D11PixelShader** ppOriginal) {
+                return getDeviceProcs(pDevice)->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppOriginal);
+            });
         }
+#endif
     }
-    procs->DrawIndexed(pContext, IndexCount, StartIndexLocation, BaseVertexLocation);
-}
-void STDMETHODCALLTYPE ID3D11DeviceContext_Draw(
-        ID3D11DeviceContext* pContext,
-        UINT IndexCount,
-        UINT StartIndexLocation) {
-    // static auto lastFlushTime = std::chrono::steady_clock::now();
-    auto procs = getContextProcs(pContext);
-    procs->Draw(pContext, IndexCount, StartIndexLocation);
-    pContext->Flush();
 
-}
-HRESULT STDMETHODCALLTYPE Present(IDXGISwapChain* pSwapChain, UINT SyncInterval, UINT Flags) {
-    // auto procs = 
-    // Allow tearing when SyncInterval is 0 (VSync off)
-    if (SyncInterval == 0) {
-        Flags |= DXGI_PRESENT_ALLOW_TEARING;
-    }
+    return hr;
 }
 
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreateQuery(ID3D11Device* pDevice, const D3D11_QUERY_DESC* pQueryDesc, ID3D11Query** ppQuery)  {
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateInputLayout(
+        ID3D11Device*                     pDevice,
+  const D3D11_INPUT_ELEMENT_DESC*         pInputElementDescs,
+        UINT                              NumElements,
+  const void*                             pShaderBytecodeWithInputSignature,
+        SIZE_T                            BytecodeLength,
+        ID3D11InputLayout**               ppInputLayout) {
     const auto* procs = getDeviceProcs(pDevice);
+    std::string key;
+
+    /* Validation-only calls pass a null output pointer */
+    if (!ppInputLayout || !InputLayoutCache::getKey(pInputElementDescs, NumElements,
+            pShaderBytecodeWithInputSignature, BytecodeLength, key)) {
+        return procs->CreateInputLayout(pDevice, pInputElementDescs, NumElements,
+            pShaderBytecodeWithInputSignature, BytecodeLength, ppInputLayout);
+    }
 
-    if (pQueryDesc->Query == D3D11_QUERY_TIMESTAMP ||
-        /*pQueryDesc->Query == D3D11_QUERY_OCCLUSION ||*/ // dont disable it will cause graphical issue
-        pQueryDesc->Query == D3D11_QUERY_TIMESTAMP_DISJOINT)
-    {
-        *ppQuery = nullptr;
+    if (ID3D11InputLayout* layout = g_inputLayouts.find(pDevice, key)) {
+        *ppInputLayout = layout;
         return S_OK;
     }
 
-    return procs->CreateQuery(pDevice, pQueryDesc, ppQuery);
-}
+    const HRESULT hr = procs->CreateInputLayout(pDevice, pInputElementDescs, NumElements,
+        pShaderBytecodeWithInputSignature, BytecodeLength, ppInputLayout);
 
-#define HOOK_PROC(iface, object, table, index, proc) \
-  hookProc(object, #iface "::" #proc, &table->proc, &iface ## _ ## proc, index)
+    if (SUCCEEDED(hr) && *ppInputLayout) {
+        g_inputLayouts.add(pDevice, key, *ppInputLayout);
+    }
 
+    return hr;
+}
 
-template<typename T>
-void hookProc(void* pObject,[[maybe_unused]] const char* pName, T** ppOrig, T* pHook, uint32_t index) {
-    void** vtbl = *std::bit_cast<void***>(pObject);
+/**
+ * Samplers are adjusted to the quality the game runs at when they
+ * are created. The runtime returns the existing object for identical
+ * descriptions, so samplers that end up identical after the override
+ * share one object.
+ */
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateSamplerState(
+        ID3D11Device*                 pDevice,
+  const D3D11_SAMPLER_DESC*           pSamplerDesc,
+        ID3D11SamplerState**          ppSamplerState) {
+    const auto* procs = getDeviceProcs(pDevice);
 
-    MH_STATUS mh = MH_CreateHook(vtbl[index], std::bit_cast<void*>(pHook), std::bit_cast<void**>(ppOrig));
+#ifdef SAMPLER_LIMITS
+    const uint32_t quality = getQualityVal();
 
-    if (mh) {
-        if (mh != MH_ERROR_ALREADY_CREATED) {
-#ifndef NDEBUG
-            log("Failed to create hook for ", pName, ": ", MH_StatusToString(mh));
-#endif
+    if (pSamplerDesc && quality < SAMPLER_TIERS.size()) {
+        D3D11_SAMPLER_DESC desc = *pSamplerDesc;
+
+        if (applySamplerTier(desc, SAMPLER_TIERS[quality])) {
+            return procs->CreateSamplerState(pDevice, &desc, ppSamplerState);
         }
-        return;
     }
+#endif
 
-    mh = MH_EnableHook(vtbl[index]);
+    return procs->CreateSamplerState(pDevice, pSamplerDesc, ppSamplerState);
+}
 
-    if (mh) {
-#ifndef NDEBUG
-        log("Failed to enable hook for ", pName, ": ", MH_StatusToString(mh));
-#endif
+#ifdef RING_BUFFERS
+void initRings(ID3D11Device* pDevice) {
+    static mutex ringMutex;
+    static bool initialized = false;
+
+    const std::lock_guard lock(ringMutex);
+
+    if (initialized) {
         return;
     }
-#ifndef NDEBUG
-        log("Created hook for ", pName, " @ ", reinterpret_cast<void*>(pHook));
-    #endif
-}
 
-void hookDevice(ID3D11Device* pDevice) {
-    const std::lock_guard lock(g_hookMutex);
+    initialized = true;
 
-    if (g_installedHooks & HOOK_DEVICE) {
+    const auto* procs = getDeviceProcs(pDevice);
+    const auto createRing = [&] (const D3D11_BUFFER_DESC* pDesc, ID3D11Buffer** ppBuffer) {
+        return procs->CreateBuffer(pDevice, pDesc, nullptr, ppBuffer);
+    };
+
+    g_vbRing.init(RING_VB_SIZE, D3D11_BIND_VERTEX_BUFFER, createRing);
+
+    D3D11_FEATURE_DATA_D3D11_OPTIONS options = { };
+
+    if (pDevice->GetFeatureLevel() < D3D_FEATURE_LEVEL_11_1
+     || FAILED(pDevice->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options)))
+     || !options.ConstantBufferOffsetting || !options.MapNoOverwriteOnDynamicConstantBuffer) {
         return;
     }
 
-#ifndef NDEBUG
-    log("Hooking device ", pDevice);
-#endif
+    ID3D11DeviceContext* context = nullptr;
+    pDevice->GetImmediateContext(&context);
 
-    DeviceProcs* procs = &g_deviceProcs;
-    // HOOK_PROC(ID3D11Device, pDevice, procs, 3,  CreateBuffer);
-    HOOK_PROC(ID3D11Device, pDevice, procs, 12,  CreateVertexShader); //crashes on AMD
-    HOOK_PROC(ID3D11Device, pDevice, procs, 15,  CreatePixelShader);
-    HOOK_PROC(ID3D11Device, pDevice, procs, 24,  CreateQuery);
+    /* The immediate context lives as long as the device, don't keep a reference */
+    if (SUCCEEDED(context->QueryInterface(__uuidof(ID3D11DeviceContext1), std::bit_cast<void**>(&g_immContext1)))) {
+        g_immContext1->Release();
+        g_cbRing.init(RING_CB_SIZE, D3D11_BIND_CONSTANT_BUFFER, createRing);
+    }
 
-    g_installedHooks |= HOOK_DEVICE;
+    context->Release();
 }
-void hookContext(ID3D11DeviceContext* pContext) {
-  std::lock_guard lock(g_hookMutex);
 
-  uint32_t flag = HOOK_IMM_CTX;
-  ContextProcs* procs = &g_immContextProcs;
+/** Backs small dynamic vertex and constant buffers with a ring slice */
+bool attachRingSlice(ID3D11Buffer* pBuffer, const D3D11_BUFFER_DESC& desc) {
+    if (desc.Usage != D3D11_USAGE_DYNAMIC || desc.MiscFlags || desc.ByteWidth > RING_MAX_SLICE) {
+        return false;
+    }
 
-  if (!isImmediatecontext(pContext)) {
-    flag = HOOK_DEF_CTX;
-    procs = &g_defContextProcs;
-  }
+    UploadRing* ring = nullptr;
+    UINT align = 16U;
 
-  if (g_installedHooks & flag)
-    return;
+    if (desc.BindFlags == D3D11_BIND_VERTEX_BUFFER) {
+        ring = &g_vbRing;
+    } else if (desc.BindFlags == D3D11_BIND_CONSTANT_BUFFER) {
+        ring = &g_cbRing;
+        align = 256U;
+    }
 
-//   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 9, PSSetShader);
-//   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 12, DrawIndexed);
-//   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 13, Draw);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 19, IASetIndexBuffer);
-  //   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 14, Map);
-    // HOOK_PROC(ID3D11DeviceContext, pContext, procs, 48,  UpdateSubresource);
+    if (!ring || !ring->buffer()) {
+        return false;
+    }
+
+    const UINT size = (desc.ByteWidth + align - 1U) / align * align;
+    PrivateObject::attach(pBuffer, RingSliceGuid, new RingSlice(ring, size, align));
+    return true;
+}
+
+/**
+ * Buffer to bind in place of a game buffer. Returns the ring and
+ * the slice placement if the buffer currently lives in a ring.
+ */
+ID3D11Buffer* getRingBinding(ID3D11Buffer* pBuffer, UINT& offset, UINT& size) {
+    RingSlice* slice = RingSlice::get(pBuffer);
+
+    if (!slice) {
+        return pBuffer;
+    }
+
+    ID3D11Buffer* result = pBuffer;
+
+    if (slice->valid) {
+        result = slice->ring->buffer();
+        offset = slice->offset;
+        size = slice->size;
+    }
+
+    slice->Release();
+    return result;
+}
+
+/** Binds constant buffers to a stage, bypassing the hooks */
+void setStageConstantBuffers(ID3D11DeviceContext* pContext, CbStage stage, UINT StartSlot, UINT NumBuffers, ID3D11Buffer* const* ppBuffers) {
+    const auto* procs = getContextProcs(pContext);
+
+    switch (stage) {
+        case CbStage::VS: procs->VSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::HS: procs->HSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::DS: procs->DSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::GS: procs->GSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::PS: procs->PSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::CS: procs->CSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppBuffers); break;
+        case CbStage::Count: break;
+    }
+}
+
+void bindRingConstantBuffer(ID3D11DeviceContext* pContext, CbStage stage, UINT Slot, ID3D11Buffer* pBuffer) {
+    UINT offset = 0U;
+    UINT size = 0U;
+    ID3D11Buffer* buffer = getRingBinding(pBuffer, offset, size);
+
+    if (buffer == pBuffer) {
+        setStageConstantBuffers(pContext, stage, Slot, 1U, &buffer);
+        return;
+    }
+
+    /* Offsets and sizes are in 16-byte constants */
+    const UINT first = offset / 16U;
+    const UINT count = size / 16U;
+
+    switch (stage) {
+        case CbStage::VS: g_immContext1->VSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::HS: g_immContext1->HSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::DS: g_immContext1->DSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::GS: g_immContext1->GSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::PS: g_immContext1->PSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::CS: g_immContext1->CSSetConstantBuffers1(Slot, 1U, &buffer, &first, &count); break;
+        case CbStage::Count: break;
+    }
+}
+
+/**
+ * Moves a game buffer out of its ring at the next map, for uses the
+ * ring cannot follow such as binds on deferred contexts
+ */
+void pinRingBuffer(ID3D11Resource* pResource) {
+    if (RingSlice* slice = RingSlice::get(pResource)) {
+        slice->pinned = true;
+        slice->Release();
+    }
+}
+
+/** Common body of the constant buffer bind hooks of all stages */
+void setRingConstantBuffers(ID3D11DeviceContext* pContext, CbStage stage, UINT StartSlot, UINT NumBuffers, ID3D11Buffer* const* ppConstantBuffers) {
+    if (!isImmediatecontext(pContext)) {
+        for (UINT i = 0U; ppConstantBuffers && i < NumBuffers; i++) {
+            pinRingBuffer(ppConstantBuffers[i]);
+        }
+
+        setStageConstantBuffers(pContext, stage, StartSlot, NumBuffers, ppConstantBuffers);
+        return;
+    }
+
+    auto& bound = g_immContextState.cbs[static_cast<uint32_t>(stage)];
+    g_immContextState.stateChanges++;
+    setStageConstantBuffers(pContext, stage, StartSlot, NumBuffers, ppConstantBuffers);
+
+    for (UINT i = 0U; i < NumBuffers && StartSlot + i < ContextState::MaxCbs; i++) {
+        ID3D11Buffer* buffer = ppConstantBuffers ? ppConstantBuffers[i] : nullptr;
+        bound[StartSlot + i] = buffer;
+
+        if (buffer && g_cbRing.buffer()) {
+            bindRingConstantBuffer(pContext, stage, StartSlot + i, buffer);
+        }
+    }
+}
+
+/** Re-issues every bind of a game buffer on any stage after its slice moved */
+void rebindRingBuffer(ID3D11DeviceContext* pContext, ID3D11Buffer* pBuffer) {
+    const auto* procs = getContextProcs(pContext);
+    const auto* state = &g_immContextState;
+
+    for (UINT slot = 0U; slot < ContextState::MaxVbs; slot++) {
+        if (state->vbs[slot] == pBuffer) {
+            UINT offset = 0U;
+            UINT size = 0U;
+            ID3D11Buffer* buffer = getRingBinding(pBuffer, offset, size);
+            offset += state->vbOffsets[slot];
+            procs->IASetVertexBuffers(pContext, slot, 1U, &buffer, &state->vbStrides[slot], &offset);
+        }
+    }
+
+    for (uint32_t stage = 0U; stage < static_cast<uint32_t>(CbStage::Count); stage++) {
+        for (UINT slot = 0U; slot < ContextState::MaxCbs; slot++) {
+            if (state->cbs[stage][slot] == pBuffer) {
+                bindRingConstantBuffer(pContext, static_cast<CbStage>(stage), slot, pBuffer);
+            }
+        }
+    }
+}
+
+bool isRingBacked(ID3D11Resource* pResource) {
+    RingSlice* slice = RingSlice::get(pResource);
+
+    if (!slice) {
+        return false;
+    }
+
+    slice->Release();
+    return true;
+}
+
+/**
+ * Redirects a copy from a ring-backed game buffer to its slice.
+ * Returns the ring with the source box inside it, or null if the
+ * copy can read the game buffer.
+ */
+ID3D11Buffer* getRingCopySource(ID3D11DeviceContext* pContext, ID3D11Resource* pSrcResource, const D3D11_BOX* pSrcBox, D3D11_BOX& box) {
+    RingSlice* slice = RingSlice::get(pSrcResource);
+
+    if (!slice) {
+        return nullptr;
+    }
+
+    ID3D11Buffer* ring = nullptr;
+
+    if (!isImmediatecontext(pContext)) {
+        slice->pinned = true;
+    } else if (slice->valid) {
+        D3D11_BUFFER_DESC desc = { };
+        static_cast<ID3D11Buffer*>(pSrcResource)->GetDesc(&desc);
+
+        box = pSrcBox ? *pSrcBox : D3D11_BOX { 0U, 0U, 0U, desc.ByteWidth, 1U, 1U };
+        box.left += slice->offset;
+        box.right += slice->offset;
+        ring = slice->ring->buffer();
+    }
+
+    slice->Release();
+    return ring;
+}
+
+/**
+ * Maps a ring-backed buffer into its ring. WRITE_DISCARD moves the
+ * buffer to a fresh slice, NO_OVERWRITE keeps the current one.
+ * Returns S_FALSE if the caller should map the game buffer instead.
+ */
+HRESULT mapRingSlice(ID3D11DeviceContext* pContext, RingSlice* slice, D3D11_MAP MapType, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    const auto* procs = getContextProcs(pContext);
+    const bool discard = MapType == D3D11_MAP_WRITE_DISCARD;
+
+    if (!pMappedResource || (!discard && MapType != D3D11_MAP_WRITE_NO_OVERWRITE)) {
+        return S_FALSE;
+    }
+
+    if (slice->pinned) {
+        slice->moved |= slice->valid;
+        slice->valid = false;
+        return S_FALSE;
+    }
+
+    if (discard || !slice->valid) {
+        UINT offset = slice->offset;
+        const bool valid = slice->ring->allocate(pContext, slice->size, slice->align, offset);
+
+        slice->moved |= valid != slice->valid || offset != slice->offset;
+        slice->valid = valid;
+        slice->offset = offset;
+
+        if (!valid) {
+            g_counters.add(Counter::RingFallbacks);
+            return S_FALSE;
+        }
+
+        g_counters.add(Counter::RingAllocations);
+    }
+
+    uint8_t* base = slice->ring->map([&] (ID3D11Buffer* pRing, D3D11_MAPPED_SUBRESOURCE* pMapped) {
+        return procs->Map(pContext, pRing, 0U, D3D11_MAP_WRITE_NO_OVERWRITE, 0U, pMapped);
+    });
+
+    if (!base) {
+        slice->valid = false;
+        slice->moved = true;
+        return S_FALSE;
+    }
+
+    slice->mapped = true;
+    pMappedResource->pData = base + slice->offset;
+    pMappedResource->RowPitch = slice->size;
+    pMappedResource->DepthPitch = slice->size;
+    return S_OK;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_IASetVertexBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppVertexBuffers,
+        const UINT* pStrides,
+        const UINT* pOffsets) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (!isImmediatecontext(pContext)) {
+        for (UINT i = 0U; ppVertexBuffers && i < NumBuffers; i++) {
+            pinRingBuffer(ppVertexBuffers[i]);
+        }
+
+        procs->IASetVertexBuffers(pContext, StartSlot, NumBuffers, ppVertexBuffers, pStrides, pOffsets);
+        return;
+    }
+
+    auto* state = &g_immContextState;
+    state->stateChanges++;
+
+    if (!ppVertexBuffers || !pStrides || !pOffsets || StartSlot + NumBuffers > ContextState::MaxVbs) {
+        for (UINT slot = StartSlot; slot < std::min(StartSlot + NumBuffers, ContextState::MaxVbs); slot++) {
+            state->vbs[slot] = nullptr;
+        }
+
+        procs->IASetVertexBuffers(pContext, StartSlot, NumBuffers, ppVertexBuffers, pStrides, pOffsets);
+        return;
+    }
+
+    std::array<ID3D11Buffer*, ContextState::MaxVbs> buffers = { };
+    std::array<UINT, ContextState::MaxVbs> offsets = { };
+
+    for (UINT i = 0U; i < NumBuffers; i++) {
+        state->vbs[StartSlot + i] = ppVertexBuffers[i];
+        state->vbStrides[StartSlot + i] = pStrides[i];
+        state->vbOffsets[StartSlot + i] = pOffsets[i];
+
+        UINT offset = 0U;
+        UINT size = 0U;
+        buffers[i] = ppVertexBuffers[i] ? getRingBinding(ppVertexBuffers[i], offset, size) : nullptr;
+        offsets[i] = pOffsets[i] + offset;
+    }
+
+    procs->IASetVertexBuffers(pContext, StartSlot, NumBuffers, buffers.data(), pStrides, offsets.data());
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_VSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::VS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_HSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::HS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::DS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_GSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::GS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::PS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CSSetConstantBuffers(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumBuffers,
+        ID3D11Buffer* const* ppConstantBuffers) {
+    setRingConstantBuffers(pContext, CbStage::CS, StartSlot, NumBuffers, ppConstantBuffers);
+}
+#endif
+
+#ifdef STAGING_WRITES
+/** Creates a pool resource for StagingPool, bypassing our hooks */
+HRESULT createPoolStaging(ID3D11Device* pDevice, const StagingPool::Key& key, ID3D11Resource** ppResource) {
+    const auto* procs = getDeviceProcs(pDevice);
+    HRESULT hr;
+
+    if (key.dimension == D3D11_RESOURCE_DIMENSION_BUFFER) {
+        D3D11_BUFFER_DESC desc = { };
+        desc.ByteWidth = key.width;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+        ID3D11Buffer* buffer = nullptr;
+        hr = procs->CreateBuffer(pDevice, &desc, nullptr, &buffer);
+        *ppResource = buffer;
+    } else {
+        D3D11_TEXTURE2D_DESC desc = { };
+        desc.Width = key.width;
+        desc.Height = key.height;
+        desc.MipLevels = 1U;
+        desc.ArraySize = 1U;
+        desc.Format = key.format;
+        desc.SampleDesc = { 1U, 0U };
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+        ID3D11Texture2D* texture = nullptr;
+        hr = procs->CreateTexture2D(pDevice, &desc, nullptr, &texture);
+        *ppResource = texture;
+    }
+
+    return hr;
+}
+
+/**
+ * Maps a mirrored staging resource, see staging.h. The first map
+ * seeds the copy, waiting for the GPU if it has to. Returns S_FALSE
+ * if the map is not ours to handle.
+ */
+HRESULT mapStagingMirror(ID3D11DeviceContext* pContext, StagingMirror* mirror, ID3D11Resource* pResource, D3D11_MAP MapType, UINT MapFlags, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (MapType != D3D11_MAP_WRITE || !pMappedResource || mirror->disabled()) {
+        mirror->invalidate();
+        return S_FALSE;
+    }
+
+    if (!mirror->valid()) {
+        D3D11_MAPPED_SUBRESOURCE mapped = { };
+        HRESULT hr = procs->Map(pContext, pResource, 0U, D3D11_MAP_READ_WRITE,
+            MapFlags | static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT), &mapped);
+
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+            if (MapFlags & static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT)) {
+                return hr;
+            }
+
+            g_counters.add(Counter::StagingStalls);
+            hr = procs->Map(pContext, pResource, 0U, D3D11_MAP_READ_WRITE, MapFlags, &mapped);
+        }
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        mirror->seed(mapped);
+    }
+
+    *pMappedResource = mirror->map();
+    return S_OK;
+}
+
+/** Writes a mirrored staging resource back without waiting if possible */
+void unmapStagingMirror(ID3D11DeviceContext* pContext, StagingMirror* mirror, ID3D11Resource* pResource) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (mirror->unmap()) {
+        procs->Unmap(pContext, pResource, 0U);
+        return;
+    }
+
+    D3D11_MAPPED_SUBRESOURCE mapped = { };
+    HRESULT hr = procs->Map(pContext, pResource, 0U, D3D11_MAP_WRITE, static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT), &mapped);
+
+    if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+        StagingPool::Key key;
+        ID3D11Device* device = nullptr;
+        pContext->GetDevice(&device);
+
+        const bool uploaded = StagingPool::getKey(pResource, key) && g_stagingPool.upload(key, g_frame,
+            [device] (const StagingPool::Key& k, ID3D11Resource** ppStaging) {
+                return createPoolStaging(device, k, ppStaging);
+            }, [&] (ID3D11Resource* pStaging, D3D11_MAPPED_SUBRESOURCE* pMapped) {
+                return procs->Map(pContext, pStaging, 0U, D3D11_MAP_WRITE, static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT), pMapped);
+            }, [&] (const D3D11_MAPPED_SUBRESOURCE& poolMapped) {
+                mirror->write(poolMapped);
+            }, [&] (ID3D11Resource* pStaging) {
+                procs->Unmap(pContext, pStaging, 0U);
+            }, [&] (ID3D11Resource* pStaging) {
+                procs->CopySubresourceRegion(pContext, pResource, 0U, 0U, 0U, 0U, pStaging, 0U, nullptr);
+            });
+
+        device->Release();
+
+        if (uploaded) {
+            g_counters.add(Counter::StagingRedirects);
+            return;
+        }
+
+        g_counters.add(Counter::StagingStalls);
+        hr = procs->Map(pContext, pResource, 0U, D3D11_MAP_WRITE, 0U, &mapped);
+    }
+
+    if (FAILED(hr)) {
+        mirror->invalidate();
+        return;
+    }
+
+    mirror->write(mapped);
+    procs->Unmap(pContext, pResource, 0U);
+}
+
+/** Forgets the copy of a staging resource written on the GPU timeline */
+void invalidateStagingMirror(ID3D11DeviceContext* pContext, ID3D11Resource* pResource) {
+    if (StagingMirror* mirror = StagingMirror::get(pResource)) {
+        if (isImmediatecontext(pContext)) {
+            mirror->invalidate();
+        } else {
+            mirror->disable();
+        }
+
+        mirror->Release();
+    }
+}
+#endif
+
+#ifdef LATENT_READBACK
+bool isReadbackAllowed(const ReadbackShape& shape, D3D11_USAGE usage, UINT cpuAccessFlags) {
+    if (usage != D3D11_USAGE_STAGING || !(cpuAccessFlags & D3D11_CPU_ACCESS_READ)) {
+        return false;
+    }
+
+    return std::find(READBACK_ALLOWLIST.begin(), READBACK_ALLOWLIST.end(), shape) != READBACK_ALLOWLIST.end();
+}
+
+/** Attaches the copy ring, see readback.h */
+template<typename Create>
+void attachReadback(ID3D11Device* pDevice, ID3D11Resource* pResource, Create&& createCopy) {
+    const auto* procs = getDeviceProcs(pDevice);
+    const D3D11_QUERY_DESC desc = { D3D11_QUERY_EVENT, 0U };
+
+    std::array<ID3D11Resource*, LatentReadback::Depth> copies = { };
+    std::array<ID3D11Query*, LatentReadback::Depth> events = { };
+
+    for (uint32_t i = 0U; i < LatentReadback::Depth; i++) {
+        if (FAILED(createCopy(&copies[i])) || FAILED(procs->CreateQuery(pDevice, &desc, &events[i]))) {
+            for (uint32_t j = 0U; j <= i; j++) {
+                if (copies[j]) {
+                    copies[j]->Release();
+                }
+                if (events[j]) {
+                    events[j]->Release();
+                }
+            }
+            return;
+        }
+    }
+
+    PrivateObject::attach(pResource, ReadbackGuid, new LatentReadback(copies, events));
+}
+
+/**
+ * Copy ring of a copy destination, if the copy can be redirected.
+ * Deferred copies disable the ring. The caller must release it.
+ */
+LatentReadback* getReadbackCopy(ID3D11DeviceContext* pContext, ID3D11Resource* pDstResource) {
+    LatentReadback* readback = LatentReadback::get(pDstResource);
+
+    if (!readback) {
+        return nullptr;
+    }
+
+    if (!isImmediatecontext(pContext)) {
+        readback->disable();
+    }
+
+    if (readback->disabled()) {
+        readback->Release();
+        return nullptr;
+    }
+
+    return readback;
+}
+
+/** Drops the copies of a staging resource written without redirection */
+void invalidateReadback(ID3D11DeviceContext* pContext, ID3D11Resource* pResource) {
+    if (LatentReadback* readback = LatentReadback::get(pResource)) {
+        if (isImmediatecontext(pContext)) {
+            readback->invalidate();
+        } else {
+            readback->disable();
+        }
+
+        readback->Release();
+    }
+}
+
+HRESULT mapReadback(ID3D11DeviceContext* pContext, LatentReadback* readback, UINT Subresource, UINT MapFlags, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    const auto* procs = getContextProcs(pContext);
+    bool ready = false;
+
+    ID3D11Resource* copy = readback->select([&] (ID3D11Query* pEvent) {
+        return procs->GetData(pContext, pEvent, nullptr, 0U, static_cast<UINT>(D3D11_ASYNC_GETDATA_DONOTFLUSH)) == S_OK;
+    }, ready);
+
+    g_counters.add(Counter::ReadbackRemovedUs, readback->takeRemovedUs());
+
+    if (!copy) {
+        return S_FALSE;
+    }
+
+    g_counters.add(ready ? Counter::ReadbackLatent : Counter::ReadbackBlocked);
+
+    const HRESULT hr = procs->Map(pContext, copy, Subresource, D3D11_MAP_READ, MapFlags, pMappedResource);
+
+    if (FAILED(hr)) {
+        readback->unmap();
+    }
+
+    return hr;
+}
+#endif
+
+/** Forgets the shadow of a constant buffer written on the GPU timeline */
+void invalidateCbShadow(ID3D11DeviceContext* pContext, ID3D11Resource* pResource) {
+    if (CbShadow* shadow = CbShadow::get(pResource)) {
+        if (isImmediatecontext(pContext)) {
+            shadow->invalidate();
+        } else {
+            shadow->disable();
+        }
+
+        shadow->Release();
+    }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopyResource(ID3D11DeviceContext* pContext, ID3D11Resource* pDstResource, ID3D11Resource* pSrcResource) {
+    const auto* procs = getContextProcs(pContext);
+    invalidateCbShadow(pContext, pDstResource);
+
+#ifdef STAGING_WRITES
+    invalidateStagingMirror(pContext, pDstResource);
+#endif
+
+#ifdef FEED_SKIP
+    FeedTracker::readLive(pSrcResource);
+#endif
+
+#ifdef RING_BUFFERS
+    /* The region copy reads ring-backed sources from their slice */
+    if (isRingBacked(pSrcResource)) {
+        pContext->CopySubresourceRegion(pDstResource, 0U, 0U, 0U, 0U, pSrcResource, 0U, nullptr);
+        return;
+    }
+#endif
+
+#ifdef LATENT_READBACK
+    if (LatentReadback* readback = getReadbackCopy(pContext, pDstResource)) {
+        readback->copy(
+            [&] (ID3D11Resource* pCopy) { procs->CopyResource(pContext, pCopy, pSrcResource); },
+            [&] (ID3D11Query* pEvent) { procs->End(pContext, pEvent); });
+        readback->Release();
+        return;
+    }
+#endif
+
+    procs->CopyResource(pContext, pDstResource, pSrcResource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopySubresourceRegion(
+        ID3D11DeviceContext* pContext,
+        ID3D11Resource* pDstResource,
+        UINT DstSubresource,
+        UINT DstX,
+        UINT DstY,
+        UINT DstZ,
+        ID3D11Resource* pSrcResource,
+        UINT SrcSubresource,
+        const D3D11_BOX* pSrcBox) {
+    const auto* procs = getContextProcs(pContext);
+    invalidateCbShadow(pContext, pDstResource);
+
+#ifdef STAGING_WRITES
+    invalidateStagingMirror(pContext, pDstResource);
+#endif
+
+#ifdef FEED_SKIP
+    FeedTracker::readLive(pSrcResource);
+#endif
+
+#ifdef RING_BUFFERS
+    D3D11_BOX ringBox = { };
+
+    if (ID3D11Buffer* ring = getRingCopySource(pContext, pSrcResource, pSrcBox, ringBox)) {
+        pSrcResource = ring;
+        pSrcBox = &ringBox;
+    }
+#endif
+
+#ifdef LATENT_READBACK
+    if (LatentReadback* readback = getReadbackCopy(pContext, pDstResource)) {
+        readback->copy(
+            [&] (ID3D11Resource* pCopy) {
+                procs->CopySubresourceRegion(pContext, pCopy, DstSubresource, DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox);
+            },
+            [&] (ID3D11Query* pEvent) { procs->End(pContext, pEvent); });
+        readback->Release();
+        return;
+    }
+#endif
+
+    procs->CopySubresourceRegion(pContext, pDstResource, DstSubresource, DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox);
+}
+
+/**
+ * Constant buffer uploads on the immediate context are compared
+ * against the shadow copy of small constant buffers, returns true
+ * if nothing changed and the upload can be dropped. See cbcache.h.
+ */
+bool skipCbUpdate(ID3D11DeviceContext* pContext, ID3D11Resource* pDstResource, const D3D11_BOX* pDstBox, const void* pSrcData) {
+    CbShadow* shadow = CbShadow::get(pDstResource);
+
+    if (!shadow) {
+        return false;
+    }
+
+    const bool immediate = isImmediatecontext(pContext);
+    const UINT size = shadow->size();
+    bool skip = false;
+
+    if (!immediate) {
+        shadow->disable();
+    } else if (pDstBox || !pSrcData) {
+        shadow->invalidate();
+    } else {
+        skip = shadow->update(pSrcData);
+    }
+
+    shadow->Release();
+
+    if (immediate) {
+        g_counters.add(Counter::CbUploads);
+    }
+
+    if (skip) {
+        g_counters.add(Counter::CbSkippedUploads);
+        g_counters.add(Counter::CbSkippedBytes, size);
+    }
+
+    return skip;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_UpdateSubresource(
+        ID3D11DeviceContext*             pContext,
+        ID3D11Resource  *pDstResource,
+        UINT            DstSubresource,
+        const D3D11_BOX *pDstBox,
+        const void      *pSrcData,
+        UINT            SrcRowPitch,
+        UINT            SrcDepthPitch) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipCbUpdate(pContext, pDstResource, pDstBox, pSrcData)) {
+        return;
+    }
+
+    procs->UpdateSubresource(pContext, pDstResource, DstSubresource, pDstBox, pSrcData, SrcRowPitch, SrcDepthPitch);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_UpdateSubresource1(
+        ID3D11DeviceContext1*            pContext,
+        ID3D11Resource  *pDstResource,
+        UINT            DstSubresource,
+        const D3D11_BOX *pDstBox,
+        const void      *pSrcData,
+        UINT            SrcRowPitch,
+        UINT            SrcDepthPitch,
+        UINT            CopyFlags) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipCbUpdate(pContext, pDstResource, pDstBox, pSrcData)) {
+        return;
+    }
+
+    procs->UpdateSubresource1(pContext, pDstResource, DstSubresource, pDstBox, pSrcData, SrcRowPitch, SrcDepthPitch, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_CopySubresourceRegion1(
+        ID3D11DeviceContext1* pContext,
+        ID3D11Resource* pDstResource,
+        UINT DstSubresource,
+        UINT DstX,
+        UINT DstY,
+        UINT DstZ,
+        ID3D11Resource* pSrcResource,
+        UINT SrcSubresource,
+        const D3D11_BOX* pSrcBox,
+        UINT CopyFlags) {
+    const auto* procs = getContextProcs(pContext);
+    invalidateCbShadow(pContext, pDstResource);
+
+#ifdef STAGING_WRITES
+    invalidateStagingMirror(pContext, pDstResource);
+#endif
+
+#ifdef FEED_SKIP
+    FeedTracker::readLive(pSrcResource);
+#endif
+
+#ifdef RING_BUFFERS
+    D3D11_BOX ringBox = { };
+
+    if (ID3D11Buffer* ring = getRingCopySource(pContext, pSrcResource, pSrcBox, ringBox)) {
+        pSrcResource = ring;
+        pSrcBox = &ringBox;
+    }
+#endif
+
+#ifdef LATENT_READBACK
+    if (LatentReadback* readback = getReadbackCopy(pContext, pDstResource)) {
+        readback->copy(
+            [&] (ID3D11Resource* pCopy) {
+                procs->CopySubresourceRegion1(pContext, pCopy, DstSubresource, DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+            },
+            [&] (ID3D11Query* pEvent) { procs->End(pContext, pEvent); });
+        readback->Release();
+        return;
+    }
+#endif
+
+    procs->CopySubresourceRegion1(pContext, pDstResource, DstSubresource, DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_DiscardResource(ID3D11DeviceContext1* pContext, ID3D11Resource* pResource) {
+    const auto* procs = getContextProcs(pContext);
+    invalidateCbShadow(pContext, pResource);
+    procs->DiscardResource(pContext, pResource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopyStructureCount(
+        ID3D11DeviceContext* pContext,
+        ID3D11Buffer* pDstBuffer,
+        UINT DstAlignedByteOffset,
+        ID3D11UnorderedAccessView* pSrcView) {
+    const auto* procs = getContextProcs(pContext);
+    invalidateCbShadow(pContext, pDstBuffer);
+
+#ifdef STAGING_WRITES
+    invalidateStagingMirror(pContext, pDstBuffer);
+#endif
+
+#ifdef LATENT_READBACK
+    invalidateReadback(pContext, pDstBuffer);
+#endif
+
+    procs->CopyStructureCount(pContext, pDstBuffer, DstAlignedByteOffset, pSrcView);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_Map(ID3D11DeviceContext* pContext, ID3D11Resource* pResource, UINT Subresource, D3D11_MAP MapType, UINT MapFlags, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    const auto* procs = getContextProcs(pContext);
+
+#ifdef RING_BUFFERS
+    if (isImmediatecontext(pContext)) {
+        if (RingSlice* slice = RingSlice::get(pResource)) {
+            const HRESULT hr = mapRingSlice(pContext, slice, MapType, pMappedResource);
+            slice->Release();
+
+            if (hr != S_FALSE) {
+                return hr;
+            }
+        }
+    }
+#endif
+
+    /* Deferred maps only take effect once the command list runs */
+    if (!isImmediatecontext(pContext)) {
+        invalidateCbShadow(pContext, pResource);
+    } else if (CbShadow* shadow = CbShadow::get(pResource)) {
+        const bool redirect = MapType == D3D11_MAP_WRITE_DISCARD && pMappedResource && !shadow->disabled();
+
+        if (redirect) {
+            pMappedResource->pData = shadow->map();
+            pMappedResource->RowPitch = shadow->size();
+            pMappedResource->DepthPitch = shadow->size();
+        } else {
+            shadow->invalidate();
+        }
+
+        shadow->Release();
+
+        if (redirect) {
+            return S_OK;
+        }
+    }
+
+#ifdef LATENT_READBACK
+    if (MapType != D3D11_MAP_READ) {
+        invalidateReadback(pContext, pResource);
+    } else if (isImmediatecontext(pContext)) {
+        if (LatentReadback* readback = LatentReadback::get(pResource)) {
+            const HRESULT hr = mapReadback(pContext, readback, Subresource, MapFlags, pMappedResource);
+            readback->Release();
+
+            if (hr != S_FALSE) {
+                return hr;
+            }
+        }
+
+        /* Probe first to log the shapes of reads that would block */
+        if (!(MapFlags & static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT))) {
+            const HRESULT hr = procs->Map(pContext, pResource, Subresource, MapType,
+                MapFlags | static_cast<UINT>(D3D11_MAP_FLAG_DO_NOT_WAIT), pMappedResource);
+            ReadbackShape shape;
+
+            if (hr != DXGI_ERROR_WAS_STILL_DRAWING) {
+                return hr;
+            }
+
+            if (ReadbackShape::get(pResource, shape)) {
+                g_readbackReport.add(shape, g_frame);
+            }
+        }
+    }
+#endif
+
+#ifdef STAGING_WRITES
+    if (isImmediatecontext(pContext)) {
+        if (StagingMirror* mirror = StagingMirror::get(pResource)) {
+            const HRESULT hr = mapStagingMirror(pContext, mirror, pResource, MapType, MapFlags, pMappedResource);
+            mirror->Release();
+
+            if (hr != S_FALSE) {
+                return hr;
+            }
+        }
+    }
+#endif
+
+    return procs->Map(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Unmap(ID3D11DeviceContext* pContext, ID3D11Resource* pResource, UINT Subresource) {
+    const auto* procs = getContextProcs(pContext);
+
+#ifdef LATENT_READBACK
+    if (isImmediatecontext(pContext)) {
+        if (LatentReadback* readback = LatentReadback::get(pResource)) {
+            ID3D11Resource* copy = readback->unmap();
+            readback->Release();
+
+            if (copy) {
+                procs->Unmap(pContext, copy, Subresource);
+                return;
+            }
+        }
+    }
+#endif
+
+#ifdef STAGING_WRITES
+    if (isImmediatecontext(pContext)) {
+        if (StagingMirror* mirror = StagingMirror::get(pResource)) {
+            const bool mapped = mirror->mapped();
+
+            if (mapped) {
+                unmapStagingMirror(pContext, mirror, pResource);
+            }
+
+            mirror->Release();
+
+            if (mapped) {
+                return;
+            }
+        }
+    }
+#endif
+
+#ifdef RING_BUFFERS
+    if (isImmediatecontext(pContext)) {
+        if (RingSlice* slice = RingSlice::get(pResource)) {
+            if (slice->mapped) {
+                slice->ring->unmap([&] (ID3D11Buffer* pRing) {
+                    procs->Unmap(pContext, pRing, 0U);
+                });
+                slice->mapped = false;
+            } else {
+                procs->Unmap(pContext, pResource, Subresource);
+            }
+
+            const bool moved = slice->moved;
+            slice->moved = false;
+            slice->Release();
+
+            if (moved) {
+                rebindRingBuffer(pContext, static_cast<ID3D11Buffer*>(pResource));
+            }
+            return;
+        }
+    }
+#endif
+
+    if (isImmediatecontext(pContext)) {
+        if (CbShadow* shadow = CbShadow::get(pResource)) {
+            const void* data = shadow->unmap();
+            const UINT size = shadow->size();
+            bool skip = false;
+
+            if (data) {
+                g_counters.add(Counter::CbUploads);
+                skip = shadow->update(data);
+
+                if (!skip) {
+                    D3D11_MAPPED_SUBRESOURCE mapped = { };
+
+                    if (SUCCEEDED(procs->Map(pContext, pResource, Subresource, D3D11_MAP_WRITE_DISCARD, 0U, &mapped))) {
+                        std::memcpy(mapped.pData, data, size);
+                        procs->Unmap(pContext, pResource, Subresource);
+                    } else {
+                        shadow->invalidate();
+                    }
+                }
+            }
+
+            shadow->Release();
+
+            if (data) {
+                if (skip) {
+                    g_counters.add(Counter::CbSkippedUploads);
+                    g_counters.add(Counter::CbSkippedBytes, size);
+                }
+                return;
+            }
+        }
+    }
+
+    procs->Unmap(pContext, pResource, Subresource);
+}
+
+ID3D11PixelShader* DefPS = nullptr;
+ID3D11VertexShader* DefVS = nullptr;
+void CreateShaderOnStart(ID3D11Device* pDevice) {
+    pDevice->CreatePixelShader(EFFECTS_FS_DEFAULT_SHADER.data(), EFFECTS_FS_DEFAULT_SHADER.size(), nullptr, &DefPS);
+    pDevice->CreateVertexShader(EFFECTS_VS_DEFAULT_SHADER.data(), EFFECTS_VS_DEFAULT_SHADER.size(), nullptr, &DefVS);
+}
+
+/**
+ * Index-buffer-triggered draw rules, see rules.h. Shader
+ * replacements bind DefPS / DefVS.
+ */
+const std::array<DrawRule, 2> g_drawRules = {{
+    /* Wave effect meshes */
+    { 1061255302ull, { }, { }, RULE_REPLACE_PS | RULE_REPLACE_VS, 100U },
+    { 3340896148ull, { }, { }, RULE_REPLACE_PS | RULE_REPLACE_VS, 100U },
+}};
+
+inline const DrawRule* getDrawRule(const ContextState* state) {
+    if (!state->rule) {
+        return nullptr;
+    }
+
+    const DrawRule* rule = &g_drawRules[state->rule - 1U];
+    return rule->matches(g_shaders, state->vs, state->ps) ? rule : nullptr;
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pData,
+        ID3D11Buffer**            ppBuffer) {
+    const auto* procs = getDeviceProcs(pDevice);
+
+#ifdef RING_BUFFERS
+    initRings(pDevice);
+#endif
+
+#ifdef STAGING_WRITES
+    /* Mirrored staging buffers must be readable to seed the copy */
+    if (pDesc && ppBuffer && StagingMirror::isEligible(*pDesc)) {
+        D3D11_BUFFER_DESC desc = *pDesc;
+        desc.CPUAccessFlags |= D3D11_CPU_ACCESS_READ;
+
+        const HRESULT hr = procs->CreateBuffer(pDevice, &desc, pData, ppBuffer);
+
+        if (SUCCEEDED(hr) && *ppBuffer) {
+            StagingMirror::attach(*ppBuffer, desc.ByteWidth, 1U);
+        }
+
+        return hr;
+    }
+#endif
+
+#ifdef IMMUTABLE_DEDUP
+    const HRESULT hr = g_dedup.create(pDesc, pData, ppBuffer, [&] (ID3D11Buffer** ppResource) {
+        return procs->CreateBuffer(pDevice, pDesc, pData, ppResource);
+    });
+#else
+    const HRESULT hr = procs->CreateBuffer(pDevice, pDesc, pData, ppBuffer);
+#endif
+
+    if (FAILED(hr) || !pDesc || !ppBuffer || !*ppBuffer) {
+        return hr;
+    }
+
+    if (pDesc->BindFlags & D3D11_BIND_INDEX_BUFFER) {
+        D3D11_BUFFER_DESC desc = { };
+        (*ppBuffer)->GetDesc(&desc);
+
+        const uint32_t rule = findDrawRule(g_drawRules, bufferFingerprint(desc));
+
+        if (rule) {
+            setTag(*ppBuffer, rule);
+        }
+    }
+
+#ifdef LATENT_READBACK
+    if (isReadbackAllowed({ D3D11_RESOURCE_DIMENSION_BUFFER, pDesc->ByteWidth, 1U, DXGI_FORMAT_UNKNOWN }, pDesc->Usage, pDesc->CPUAccessFlags)) {
+        attachReadback(pDevice, *ppBuffer, [&] (ID3D11Resource** ppCopy) {
+            ID3D11Buffer* copy = nullptr;
+            const HRESULT result = procs->CreateBuffer(pDevice, pDesc, nullptr, &copy);
+            *ppCopy = copy;
+            return result;
+        });
+        return hr;
+    }
+#endif
+
+#ifdef RING_BUFFERS
+    if (attachRingSlice(*ppBuffer, *pDesc)) {
+        return hr;
+    }
+#endif
+
+    /* Only shadow small buffers to keep memory use bounded */
+    if ((pDesc->BindFlags & D3D11_BIND_CONSTANT_BUFFER)
+     && (pDesc->Usage == D3D11_USAGE_DEFAULT || pDesc->Usage == D3D11_USAGE_DYNAMIC)
+     && pDesc->ByteWidth <= CbShadow::MaxSize) {
+        CbShadow::attach(*ppBuffer, pDesc->ByteWidth, pData ? pData->pSysMem : nullptr);
+    }
+
+    return hr;
+}
+
+#ifdef RT_DOWNGRADE
+const FormatDowngrade* getFormatDowngrade(const D3D11_TEXTURE2D_DESC& desc) {
+    if (!(desc.BindFlags & D3D11_BIND_RENDER_TARGET) || desc.Usage != D3D11_USAGE_DEFAULT || desc.CPUAccessFlags) {
+        return nullptr;
+    }
+
+    auto entry = std::find_if(FORMAT_DOWNGRADES.begin(), FORMAT_DOWNGRADES.end(),
+        [&] (const FormatDowngrade& downgrade) { return downgrade.matches(desc); });
+
+    return entry != FORMAT_DOWNGRADES.end() ? &(*entry) : nullptr;
+}
+
+#endif
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture2D(
+        ID3D11Device*                 pDevice,
+  const D3D11_TEXTURE2D_DESC*         pDesc,
+  const D3D11_SUBRESOURCE_DATA*       pInitialData,
+        ID3D11Texture2D**             ppTexture2D) {
+    const auto* procs = getDeviceProcs(pDevice);
+
+    /* Shadow maps are always tagged, only SHADOW_DOWNSCALE shrinks them */
+    if (pDesc && ppTexture2D && isShadowMapDesc(*pDesc)) {
+        UINT divisor = 1U;
+
+#ifdef SHADOW_DOWNSCALE
+        const uint32_t quality = getQualityVal();
+        divisor = quality < SHADOW_MAP_DIVISORS.size() ? SHADOW_MAP_DIVISORS[quality] : 1U;
+#endif
+
+        D3D11_TEXTURE2D_DESC desc = *pDesc;
+        desc.Width /= divisor;
+        desc.Height /= divisor;
+
+        const HRESULT hr = procs->CreateTexture2D(pDevice, &desc, pInitialData, ppTexture2D);
+
+        if (SUCCEEDED(hr) && *ppTexture2D) {
+            setTag(*ppTexture2D, TAG_SHADOW | divisor);
+        }
+
+        return hr;
+    }
+
+#if defined(SPATIAL_UPSCALE) || defined(RT_DOWNGRADE) || defined(MSAA_CAP)
+    if (pDesc && ppTexture2D && !pInitialData) {
+        D3D11_TEXTURE2D_DESC desc = *pDesc;
+        uint32_t tag = 0U;
+        bool changed = false;
+
+#ifdef MSAA_CAP
+        changed = capSampleCount(desc.SampleDesc, MSAA_MAX_SAMPLES);
+#endif
+
+#ifdef SPATIAL_UPSCALE
+        if (g_upscaler.scaleDesc(desc)) {
+            tag |= TAG_SCALED;
+        }
+#endif
+
+#ifdef RT_DOWNGRADE
+        const D3D11_TEXTURE2D_DESC original = desc;
+        const FormatDowngrade* downgrade = getFormatDowngrade(desc);
+
+        if (downgrade) {
+            desc.Format = downgrade->to;
+            tag |= TAG_DOWNGRADED | static_cast<uint32_t>(downgrade->to);
+        }
+#endif
+
+        if (tag || changed) {
+            const HRESULT hr = procs->CreateTexture2D(pDevice, &desc, nullptr, ppTexture2D);
+
+            if (SUCCEEDED(hr) && *ppTexture2D && tag) {
+                setTag(*ppTexture2D, tag);
+
+#ifdef RT_DOWNGRADE
+                if (downgrade) {
+                    g_formatReport.add(original, downgrade->to);
+                }
+#endif
+            }
+
+            return hr;
+        }
+    }
+#endif
+
+#ifdef STAGING_WRITES
+    /* Mirrored staging textures must be readable to seed the copy */
+    if (pDesc && ppTexture2D && StagingMirror::isEligible(*pDesc)) {
+        D3D11_TEXTURE2D_DESC desc = *pDesc;
+        desc.CPUAccessFlags |= D3D11_CPU_ACCESS_READ;
+
+        const HRESULT hr = procs->CreateTexture2D(pDevice, &desc, pInitialData, ppTexture2D);
+        UINT rowBytes = 0U;
+        UINT rows = 0U;
+
+        if (SUCCEEDED(hr) && *ppTexture2D && StagingMirror::getShape(desc, rowBytes, rows)) {
+            StagingMirror::attach(*ppTexture2D, rowBytes, rows);
+        }
+
+        return hr;
+    }
+#endif
+
+    const auto createTexture = [&] (ID3D11Texture2D** ppResource) {
+        const D3D11_TEXTURE2D_DESC* pNewDesc = pDesc;
+        const D3D11_SUBRESOURCE_DATA* pNewData = pInitialData;
+        uint32_t tag = 0U;
+
+#ifdef MIP_GENERATION
+        MipChain chain;
+
+        if (pDesc && pInitialData && g_mipGenerator.isEligible(*pDesc)) {
+            g_mipGenerator.generate(*pDesc, pInitialData, chain);
+            pNewDesc = &chain.desc;
+            pNewData = chain.data.data();
+            tag |= TAG_MIPMAPPED;
+        }
+#endif
+
+#ifdef BC_COMPRESS
+        if (pNewDesc && pNewData && ppResource && g_compressor.isEligible(*pNewDesc)) {
+            DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+
+            const HRESULT hr = g_compressor.create(*pNewDesc, pNewData, ppResource,
+                [] (const char* pName) {
+                    return std::find_if(BC_TEXTURES.begin(), BC_TEXTURES.end(),
+                        [pName] (const char* pEntry) { return !std::strcmp(pEntry, pName); }) != BC_TEXTURES.end();
+                },
+                [&] (const D3D11_TEXTURE2D_DESC* pBcDesc, const D3D11_SUBRESOURCE_DATA* pBcData, ID3D11Texture2D** ppBcTexture) {
+                    return procs->CreateTexture2D(pDevice, pBcDesc, pBcData, ppBcTexture);
+                }, &format);
+
+            if (hr == S_OK && *ppResource) {
+                setTag(*ppResource, tag | TAG_COMPRESSED | static_cast<uint32_t>(format));
+                return hr;
+            }
+        }
+#endif
+
+        const HRESULT hr = procs->CreateTexture2D(pDevice, pNewDesc, pNewData, ppResource);
+
+        if (SUCCEEDED(hr) && ppResource && *ppResource && tag) {
+            setTag(*ppResource, tag);
+        }
+
+        return hr;
+    };
+
+#ifdef IMMUTABLE_DEDUP
+    const HRESULT hr = g_dedup.create(pDesc, pInitialData, ppTexture2D, createTexture);
+#else
+    const HRESULT hr = createTexture(ppTexture2D);
+#endif
+
+    if (FAILED(hr) || !pDesc || !ppTexture2D || !*ppTexture2D) {
+        return hr;
+    }
+
+#ifdef LATENT_READBACK
+    if (isReadbackAllowed({ D3D11_RESOURCE_DIMENSION_TEXTURE2D, pDesc->Width, pDesc->Height, pDesc->Format }, pDesc->Usage, pDesc->CPUAccessFlags)) {
+        attachReadback(pDevice, *ppTexture2D, [&] (ID3D11Resource** ppCopy) {
+            ID3D11Texture2D* copy = nullptr;
+            const HRESULT result = procs->CreateTexture2D(pDevice, pDesc, nullptr, &copy);
+            *ppCopy = copy;
+            return result;
+        });
+    }
+#endif
+
+    return hr;
+}
+
+#if defined(RT_DOWNGRADE) || defined(MSAA_CAP) || defined(BC_COMPRESS) || defined(MIP_GENERATION)
+#if defined(RT_DOWNGRADE) || defined(BC_COMPRESS)
+/** Views of downgraded targets and compressed textures that name a format get the new one */
+template<typename Desc>
+const Desc* downgradeViewDesc(uint32_t tag, const Desc* pDesc, Desc& copy) {
+    if (!pDesc || !(tag & (TAG_DOWNGRADED | TAG_COMPRESSED)) || pDesc->Format == DXGI_FORMAT_UNKNOWN) {
+        return pDesc;
+    }
+
+    copy = *pDesc;
+    copy.Format = static_cast<DXGI_FORMAT>(tagIndex(tag));
+    return &copy;
+}
+#endif
+
+#ifdef MIP_GENERATION
+/** Views of textures with a generated chain see all of its mips */
+const D3D11_SHADER_RESOURCE_VIEW_DESC* expandViewDesc(uint32_t tag, const D3D11_SHADER_RESOURCE_VIEW_DESC* pDesc, D3D11_SHADER_RESOURCE_VIEW_DESC& copy) {
+    if (!pDesc || !(tag & TAG_MIPMAPPED)) {
+        return pDesc;
+    }
+
+    copy = *pDesc;
+    return expandViewMips(copy) ? &copy : pDesc;
+}
+#endif
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateShaderResourceView(
+        ID3D11Device*                           pDevice,
+        ID3D11Resource*                         pResource,
+  const D3D11_SHADER_RESOURCE_VIEW_DESC*        pDesc,
+        ID3D11ShaderResourceView**              ppShaderResourceView) {
+    const auto* procs = getDeviceProcs(pDevice);
+
+#if defined(RT_DOWNGRADE) || defined(BC_COMPRESS) || defined(MIP_GENERATION)
+    const uint32_t tag = getTag(pResource);
+#endif
+
+#if defined(RT_DOWNGRADE) || defined(BC_COMPRESS)
+    D3D11_SHADER_RESOURCE_VIEW_DESC desc;
+    pDesc = downgradeViewDesc(tag, pDesc, desc);
+#endif
+
+#ifdef MIP_GENERATION
+    D3D11_SHADER_RESOURCE_VIEW_DESC mipDesc;
+    pDesc = expandViewDesc(tag, pDesc, mipDesc);
+#endif
+
+#ifdef MSAA_CAP
+    D3D11_SHADER_RESOURCE_VIEW_DESC msaaDesc;
+    pDesc = demoteViewDesc(pResource, pDesc, msaaDesc);
+#endif
+
+    return procs->CreateShaderResourceView(pDevice, pResource, pDesc, ppShaderResourceView);
+}
+#endif
+
+#if defined(SPATIAL_UPSCALE) || defined(RT_DOWNGRADE) || defined(MSAA_CAP)
+/**
+ * Render target views inherit the scaled tag so binds need no
+ * resource lookup, and follow the format and sample count of
+ * downgraded targets.
+ */
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateRenderTargetView(
+        ID3D11Device*                           pDevice,
+        ID3D11Resource*                         pResource,
+  const D3D11_RENDER_TARGET_VIEW_DESC*          pDesc,
+        ID3D11RenderTargetView**                ppRenderTargetView) {
+    const auto* procs = getDeviceProcs(pDevice);
+    const uint32_t tag = getTag(pResource);
+
+#ifdef RT_DOWNGRADE
+    D3D11_RENDER_TARGET_VIEW_DESC desc;
+    pDesc = downgradeViewDesc(tag, pDesc, desc);
+#endif
+
+#ifdef MSAA_CAP
+    D3D11_RENDER_TARGET_VIEW_DESC msaaDesc;
+    pDesc = demoteViewDesc(pResource, pDesc, msaaDesc);
+#endif
+
+    const HRESULT hr = procs->CreateRenderTargetView(pDevice, pResource, pDesc, ppRenderTargetView);
+
+    if (SUCCEEDED(hr) && ppRenderTargetView && *ppRenderTargetView && (tag & TAG_SCALED)) {
+        setTag(*ppRenderTargetView, TAG_SCALED);
+    }
+
+    return hr;
+}
+#endif
+
+/**
+ * Depth views inherit the shadow and scaled tags so binds need no
+ * resource lookup, and follow the sample count of capped buffers.
+ */
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateDepthStencilView(
+        ID3D11Device*                           pDevice,
+        ID3D11Resource*                         pResource,
+  const D3D11_DEPTH_STENCIL_VIEW_DESC*          pDesc,
+        ID3D11DepthStencilView**                ppDepthStencilView) {
+    const auto* procs = getDeviceProcs(pDevice);
+
+#ifdef MSAA_CAP
+    D3D11_DEPTH_STENCIL_VIEW_DESC msaaDesc;
+    pDesc = demoteViewDesc(pResource, pDesc, msaaDesc);
+#endif
+
+    const HRESULT hr = procs->CreateDepthStencilView(pDevice, pResource, pDesc, ppDepthStencilView);
+
+    if (SUCCEEDED(hr) && ppDepthStencilView && *ppDepthStencilView) {
+        const uint32_t tag = getTag(pResource);
+
+        if (tag & (TAG_SHADOW | TAG_SCALED)) {
+            setTag(*ppDepthStencilView, tag);
+        }
+    }
+
+    return hr;
+}
+
+#if defined(MSAA_CAP) || defined(FEED_SKIP)
+/** Sources capped to a single sample are copied instead of resolved */
+void STDMETHODCALLTYPE ID3D11DeviceContext_ResolveSubresource(
+        ID3D11DeviceContext* pContext,
+        ID3D11Resource* pDstResource,
+        UINT DstSubresource,
+        ID3D11Resource* pSrcResource,
+        UINT SrcSubresource,
+        DXGI_FORMAT Format) {
+    const auto* procs = getContextProcs(pContext);
+
+#ifdef FEED_SKIP
+    FeedTracker::readLive(pSrcResource);
+#endif
+
+#ifdef MSAA_CAP
+    if (pSrcResource && getSampleCount(pSrcResource) <= 1U) {
+        pContext->CopySubresourceRegion(pDstResource, DstSubresource, 0U, 0U, 0U, pSrcResource, SrcSubresource, nullptr);
+        return;
+    }
+#endif
+
+    procs->ResolveSubresource(pContext, pDstResource, DstSubresource, pSrcResource, SrcSubresource, Format);
+}
+#endif
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_IASetIndexBuffer(
+        ID3D11DeviceContext* pContext,
+        ID3D11Buffer* pIndexBuffer,
+        DXGI_FORMAT Format,
+        UINT Offset) {
+    const auto* procs = getContextProcs(pContext);
+    auto* state = getContextState(pContext);
+    state->rule = tagIndex(getTag(pIndexBuffer));
+    state->stateChanges++;
+
+    if (const DrawRule* rule = getDrawRule(state)) {
+        if ((rule->actions & RULE_REPLACE_PS) && DefPS) {
+            pContext->PSSetShader(DefPS, nullptr, 0);
+        }
+        if ((rule->actions & RULE_REPLACE_VS) && DefVS) {
+            pContext->VSSetShader(DefVS, nullptr, 0);
+        }
+    }
+
+    procs->IASetIndexBuffer(pContext, pIndexBuffer, Format, Offset);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetShader(
+        ID3D11DeviceContext* pContext,
+        ID3D11PixelShader* pPixelShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+    const uint32_t tag = getTag(pPixelShader);
+    auto* state = getContextState(pContext);
+    state->stateChanges += state->ps != tagIndex(tag);
+    state->ps = tagIndex(tag);
+    state->psDisabled = tag & TAG_DISABLED;
+    state->psReduced = tag & TAG_REDUCED;
+
+#ifdef AB_BENCHMARK
+    if (isImmediatecontext(pContext)) {
+        pPixelShader = g_abBenchmark.bind(g_abBenchmark.ps(), pPixelShader, tag);
+    }
+#elif defined(QUALITY_GOVERNOR)
+    if (isImmediatecontext(pContext)) {
+        pPixelShader = governShader(pPixelShader, tag);
+    }
+#endif
+
+    procs->PSSetShader(pContext, pPixelShader, ppClassInstances, NumClassInstances);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_VSSetShader(
+        ID3D11DeviceContext* pContext,
+        ID3D11VertexShader* pVertexShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+    const uint32_t tag = getTag(pVertexShader);
+    auto* state = getContextState(pContext);
+    state->stateChanges += state->vs != tagIndex(tag);
+    state->vs = tagIndex(tag);
+    state->vsDisabled = tag & TAG_DISABLED;
+    state->vsReduced = tag & TAG_REDUCED;
+
+#ifdef AB_BENCHMARK
+    if (isImmediatecontext(pContext)) {
+        pVertexShader = g_abBenchmark.bind(g_abBenchmark.vs(), pVertexShader, tag);
+    }
+#elif defined(QUALITY_GOVERNOR)
+    if (isImmediatecontext(pContext)) {
+        pVertexShader = governShader(pVertexShader, tag);
+    }
+#endif
+
+    procs->VSSetShader(pContext, pVertexShader, ppClassInstances, NumClassInstances);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    const auto* procs = getContextProcs(pContext);
+    auto* state = getContextState(pContext);
+
+    for (UINT i = 0U; i < NumViews && StartSlot + i < ContextState::MaxSrvs; i++) {
+        state->srvs[StartSlot + i] = ppShaderResourceViews ? ppShaderResourceViews[i] : nullptr;
+    }
+
+    state->srvCount = std::max(state->srvCount, std::min(StartSlot + NumViews, ContextState::MaxSrvs));
+
+    while (state->srvCount && !state->srvs[state->srvCount - 1U]) {
+        state->srvCount--;
+    }
+
+    state->stateChanges++;
+
+#ifdef FEED_SKIP
+    /* Deferred draws are not tracked per frame */
+    if (!isImmediatecontext(pContext)) {
+        FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    }
+#endif
+
+    procs->PSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+#ifdef FEED_SKIP
+/** Only pixel shader reads are tracked per draw, other stages make their resources live */
+void STDMETHODCALLTYPE ID3D11DeviceContext_VSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    getContextProcs(pContext)->VSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_GSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    getContextProcs(pContext)->GSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_HSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    getContextProcs(pContext)->HSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    getContextProcs(pContext)->DSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CSSetShaderResources(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    FeedTracker::readLive(ppShaderResourceViews, NumViews);
+    getContextProcs(pContext)->CSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CSSetUnorderedAccessViews(
+        ID3D11DeviceContext* pContext,
+        UINT StartSlot,
+        UINT NumUAVs,
+        ID3D11UnorderedAccessView* const* ppUnorderedAccessViews,
+        const UINT* pUAVInitialCounts) {
+    FeedTracker::readLive(ppUnorderedAccessViews, NumUAVs);
+    getContextProcs(pContext)->CSSetUnorderedAccessViews(pContext, StartSlot, NumUAVs, ppUnorderedAccessViews, pUAVInitialCounts);
+}
+#endif
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearState(ID3D11DeviceContext* pContext) {
+    const auto* procs = getContextProcs(pContext);
+    *getContextState(pContext) = ContextState();
+
+#ifdef REDUCED_EFFECTS
+    if (isImmediatecontext(pContext)) {
+        g_reducedPass.end(pContext, procs);
+    }
+#endif
+
+#ifdef AB_BENCHMARK
+    if (isImmediatecontext(pContext)) {
+        g_abBenchmark.reset();
+    }
+#endif
+
+    procs->ClearState(pContext);
+}
+
+/** Executing a command list without restoring the state clears it */
+void STDMETHODCALLTYPE ID3D11DeviceContext_ExecuteCommandList(
+        ID3D11DeviceContext* pContext,
+        ID3D11CommandList* pCommandList,
+        BOOL RestoreContextState) {
+    const auto* procs = getContextProcs(pContext);
+
+#ifdef REDUCED_EFFECTS
+    if (!RestoreContextState && isImmediatecontext(pContext)) {
+        g_reducedPass.end(pContext, procs);
+    }
+#endif
+
+    procs->ExecuteCommandList(pContext, pCommandList, RestoreContextState);
+
+    if (!RestoreContextState) {
+        *getContextState(pContext) = ContextState();
+    }
+}
+
+/** Deferred contexts start over with a cleared state unless told to keep it */
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_FinishCommandList(
+        ID3D11DeviceContext* pContext,
+        BOOL RestoreDeferredContextState,
+        ID3D11CommandList** ppCommandList) {
+    const HRESULT hr = getContextProcs(pContext)->FinishCommandList(pContext, RestoreDeferredContextState, ppCommandList);
+
+    if (SUCCEEDED(hr) && !RestoreDeferredContextState) {
+        *getContextState(pContext) = ContextState();
+    }
+
+    return hr;
+}
+
+/** Whether the bound target is scaled at all */
+bool isViewportScaled(const ContextState* state) {
+    return state->shadowDivisor * state->reducedDivisor > 1U || state->renderScale != 1.0f;
+}
+
+/**
+ * Scale of a viewport and the scissor rect of the same index for the
+ * bound target. Render scale only applies if the viewport covers the
+ * output size, scissor rects without a viewport only get the divisor.
+ */
+float getViewportScale(const ContextState* state, UINT index) {
+    const float scale = 1.0f / static_cast<float>(state->shadowDivisor * state->reducedDivisor);
+
+    if (index >= state->viewportCount) {
+        return scale;
+    }
+
+    const D3D11_VIEWPORT& viewport = state->viewports[index];
+    const bool output = viewport.Width == static_cast<FLOAT>(state->outputWidth)
+                     && viewport.Height == static_cast<FLOAT>(state->outputHeight);
+
+    return output ? scale * state->renderScale : scale;
+}
+
+/** Sets the game's viewports, scaled to the bound shadow map, reduced or render size target */
+void setViewports(ID3D11DeviceContext* pContext, const ContextState* state) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (!isViewportScaled(state)) {
+        procs->RSSetViewports(pContext, state->viewportCount, state->viewports.data());
+        return;
+    }
+
+    std::array<D3D11_VIEWPORT, ContextState::MaxViewports> scaled;
+
+    for (UINT i = 0U; i < state->viewportCount; i++) {
+        scaleViewports(&state->viewports[i], 1U, getViewportScale(state, i), &scaled[i]);
+    }
+
+    procs->RSSetViewports(pContext, state->viewportCount, scaled.data());
+}
+
+/** Sets the game's scissor rects, scaled like the viewports */
+void setScissorRects(ID3D11DeviceContext* pContext, const ContextState* state) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (!isViewportScaled(state)) {
+        procs->RSSetScissorRects(pContext, state->scissorCount, state->scissors.data());
+        return;
+    }
+
+    std::array<D3D11_RECT, ContextState::MaxViewports> scaled;
+
+    for (UINT i = 0U; i < state->scissorCount; i++) {
+        scaleScissorRects(&state->scissors[i], 1U, getViewportScale(state, i), &scaled[i]);
+    }
+
+    procs->RSSetScissorRects(pContext, state->scissorCount, scaled.data());
+}
+
+/** Re-applies the game's viewports and scissor rects after the scale changed */
+void rescaleViewports(ID3D11DeviceContext* pContext, const ContextState* state) {
+    if (state->viewportCount) {
+        setViewports(pContext, state);
+    }
+
+    if (state->scissorCount) {
+        setScissorRects(pContext, state);
+    }
+}
+
+#ifdef REDUCED_EFFECTS
+/** Upsamples an active reduced pass and restores the game's viewports */
+void endReducedPass(ID3D11DeviceContext* pContext, ContextState* state) {
+    if (!g_reducedPass.active()) {
+        return;
+    }
+
+    g_reducedPass.end(pContext, getContextProcs(pContext));
+    state->reducedDivisor = 1U;
+    rescaleViewports(pContext, state);
+}
+#endif
+
+#ifdef REDUCED_EFFECTS
+/** Ends a reduced pass when the game switches to a different blend mode */
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetBlendState(
+        ID3D11DeviceContext* pContext,
+        ID3D11BlendState* pBlendState,
+  const FLOAT BlendFactor[4],
+        UINT SampleMask) {
+    auto* state = getContextState(pContext);
+    const ReducedBlend blendClass = ReducedPass::classify(pBlendState);
+
+    if (blendClass != state->blendClass && isImmediatecontext(pContext)) {
+        endReducedPass(pContext, state);
+    }
+
+    state->blendClass = blendClass;
+    getContextProcs(pContext)->OMSetBlendState(pContext, pBlendState, BlendFactor, SampleMask);
+}
+#endif
+
+/**
+ * Tracks a render target change around the original call, which
+ * is made by \c bindProc. Shared by both render target hooks.
+ */
+template<typename Bind>
+void setRenderTargets(
+        ID3D11DeviceContext* pContext,
+        [[maybe_unused]] UINT NumViews,
+        [[maybe_unused]] ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView* pDepthStencilView,
+        Bind&& bindProc) {
+    [[maybe_unused]] const auto* procs = getContextProcs(pContext);
+    auto* state = getContextState(pContext);
+    state->pass++;
+    state->stateChanges++;
+
+#ifdef FEED_SKIP
+    state->feedPass = isImmediatecontext(pContext) && g_feeds.feedsOnly(ppRenderTargetViews, NumViews, pDepthStencilView);
+#endif
+
+#ifdef REDUCED_EFFECTS
+    if (isImmediatecontext(pContext)) {
+        endReducedPass(pContext, state);
+    }
+
+    state->rtvCount = ppRenderTargetViews ? NumViews : 0U;
+    state->rtv = state->rtvCount ? ppRenderTargetViews[0] : nullptr;
+    state->dsv = pDepthStencilView;
+#endif
+
+    bindProc();
+
+    const uint32_t tag = getTag(pDepthStencilView);
+    const bool shadowPass = (tag & TAG_SHADOW) != 0U;
+    const UINT divisor = shadowPass ? tagIndex(tag) : 1U;
+
+#ifdef SHADOW_REUSE
+    /* Shadow pass ended without draws, its clears must not get lost */
+    if (isImmediatecontext(pContext) && state->shadowPass && !shadowPass && !g_shadowReuse.decided()) {
+        g_shadowReuse.flush([&] (ID3D11DepthStencilView* pView, UINT Flags, FLOAT Depth, UINT8 Stencil) {
+            procs->ClearDepthStencilView(pContext, pView, Flags, Depth, Stencil);
+        });
+    }
+#endif
+
+    state->shadowPass = shadowPass;
+
+#ifdef SPATIAL_UPSCALE
+    ID3D11RenderTargetView* rtv = NumViews && ppRenderTargetViews ? ppRenderTargetViews[0] : nullptr;
+    const bool scaled = (tag & TAG_SCALED) || (getTag(rtv) & TAG_SCALED);
+    const float renderScale = scaled ? g_upscaler.scale() : 1.0f;
+    UINT outputWidth = 0U;
+    UINT outputHeight = 0U;
+
+    if (scaled) {
+        g_upscaler.outputSize(outputWidth, outputHeight);
+    }
+#else
+    const float renderScale = 1.0f;
+    const UINT outputWidth = 0U;
+    const UINT outputHeight = 0U;
+#endif
+
+    /* Viewports may be set before the target, re-apply them at the new scale */
+    if (divisor != state->shadowDivisor || renderScale != state->renderScale
+     || outputWidth != state->outputWidth || outputHeight != state->outputHeight) {
+        state->shadowDivisor = divisor;
+        state->renderScale = renderScale;
+        state->outputWidth = outputWidth;
+        state->outputHeight = outputHeight;
+        rescaleViewports(pContext, state);
+    }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargets(
+        ID3D11DeviceContext* pContext,
+        UINT NumViews,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView* pDepthStencilView) {
+    setRenderTargets(pContext, NumViews, ppRenderTargetViews, pDepthStencilView, [&] {
+        getContextProcs(pContext)->OMSetRenderTargets(pContext, NumViews, ppRenderTargetViews, pDepthStencilView);
+    });
+}
+
+/** Passes with UAVs are never feed-only, and their UAVs are live */
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews(
+        ID3D11DeviceContext* pContext,
+        UINT NumRTVs,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView* pDepthStencilView,
+        UINT UAVStartSlot,
+        UINT NumUAVs,
+        ID3D11UnorderedAccessView* const* ppUnorderedAccessViews,
+        const UINT* pUAVInitialCounts) {
+    const auto* procs = getContextProcs(pContext);
+
+#ifdef FEED_SKIP
+    if (NumUAVs != D3D11_KEEP_UNORDERED_ACCESS_VIEWS) {
+        FeedTracker::readLive(ppUnorderedAccessViews, NumUAVs);
+    }
+#endif
+
+    const auto bind = [&] {
+        procs->OMSetRenderTargetsAndUnorderedAccessViews(pContext, NumRTVs, ppRenderTargetViews,
+            pDepthStencilView, UAVStartSlot, NumUAVs, ppUnorderedAccessViews, pUAVInitialCounts);
+    };
+
+    if (NumRTVs == D3D11_KEEP_RENDER_TARGETS_AND_DEPTH_STENCIL) {
+        bind();
+    } else {
+        setRenderTargets(pContext, NumRTVs, ppRenderTargetViews, pDepthStencilView, bind);
+    }
+
+#ifdef FEED_SKIP
+    getContextState(pContext)->feedPass = false;
+#endif
+}
+
+#ifdef SHADOW_REUSE
+/** Shadow map clears wait for the reuse decision of the frame */
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearDepthStencilView(
+        ID3D11DeviceContext* pContext,
+        ID3D11DepthStencilView* pDepthStencilView,
+        UINT ClearFlags,
+        FLOAT Depth,
+        UINT8 Stencil) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (isImmediatecontext(pContext) && (getTag(pDepthStencilView) & TAG_SHADOW)
+     && g_shadowReuse.clear(pDepthStencilView, ClearFlags, Depth, Stencil)) {
+        return;
+    }
+
+    procs->ClearDepthStencilView(pContext, pDepthStencilView, ClearFlags, Depth, Stencil);
+}
+#endif
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSSetViewports(
+        ID3D11DeviceContext* pContext,
+        UINT NumViewports,
+        const D3D11_VIEWPORT* pViewports) {
+    const auto* procs = getContextProcs(pContext);
+    auto* state = getContextState(pContext);
+
+    if (!pViewports || NumViewports > ContextState::MaxViewports) {
+        state->viewportCount = 0U;
+        procs->RSSetViewports(pContext, NumViewports, pViewports);
+        return;
+    }
+
+    std::copy(pViewports, pViewports + NumViewports, state->viewports.begin());
+    state->viewportCount = NumViewports;
+    setViewports(pContext, state);
+
+    /* Render scale of scissor rects follows the viewport of the same index */
+    if (state->scissorCount && state->renderScale != 1.0f) {
+        setScissorRects(pContext, state);
+    }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSSetScissorRects(
+        ID3D11DeviceContext* pContext,
+        UINT NumRects,
+        const D3D11_RECT* pRects) {
+    const auto* procs = getContextProcs(pContext);
+    auto* state = getContextState(pContext);
+
+    if (!pRects || NumRects > ContextState::MaxViewports) {
+        state->scissorCount = 0U;
+        procs->RSSetScissorRects(pContext, NumRects, pRects);
+        return;
+    }
+
+    std::copy(pRects, pRects + NumRects, state->scissors.begin());
+    state->scissorCount = NumRects;
+    setScissorRects(pContext, state);
+}
+
+/** Copies tracked viewports or scissor rects out the way the runtime does */
+template<typename T, typename Get>
+void getTracked(const T* pTracked, UINT trackedCount, UINT* pCount, T* pOut, Get&& getProc) {
+    if (!trackedCount || !pCount) {
+        getProc();
+        return;
+    }
+
+    if (!pOut) {
+        *pCount = trackedCount;
+        return;
+    }
+
+    for (UINT i = 0U; i < *pCount; i++) {
+        pOut[i] = i < trackedCount ? pTracked[i] : T();
+    }
+}
+
+/** Returns the viewports as set by the game, not as scaled for the target */
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSGetViewports(
+        ID3D11DeviceContext* pContext,
+        UINT* pNumViewports,
+        D3D11_VIEWPORT* pViewports) {
+    const auto* state = getContextState(pContext);
+
+    getTracked(state->viewports.data(), state->viewportCount, pNumViewports, pViewports, [&] {
+        getContextProcs(pContext)->RSGetViewports(pContext, pNumViewports, pViewports);
+    });
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSGetScissorRects(
+        ID3D11DeviceContext* pContext,
+        UINT* pNumRects,
+        D3D11_RECT* pRects) {
+    const auto* state = getContextState(pContext);
+
+    getTracked(state->scissors.data(), state->scissorCount, pNumRects, pRects, [&] {
+        getContextProcs(pContext)->RSGetScissorRects(pContext, pNumRects, pRects);
+    });
+}
+
+/**
+ * Drops draws of disabled effects, and on the immediate context
+ * draws of passes that only render inputs for disabled effects.
+ */
+inline bool skipDraw(ID3D11DeviceContext* pContext) {
+    auto* state = getContextState(pContext);
+
+#ifdef QUALITY_GOVERNOR
+    bool skip = (state->vsDisabled || state->psDisabled) && g_governor.atLeast(QualityTier::Skipped);
+#else
+    bool skip = state->vsDisabled || state->psDisabled;
+#endif
+
+    if (!isImmediatecontext(pContext)) {
+        return skip;
+    }
+
+#ifdef FEED_SKIP
+    skip = skip || state->feedPass;
+
+    /* Draws skipped for shadow reuse below still count as live reads */
+    if (skip || g_feeds.active()) {
+        g_feeds.read(state->srvs.data(), state->srvCount, skip);
+    }
+#endif
+
+#ifdef SHADOW_REUSE
+    if (!skip && state->shadowPass) {
+        const auto* procs = getContextProcs(pContext);
+
+        skip = g_shadowReuse.skip(pContext, [&] (ID3D11DepthStencilView* pView, UINT Flags, FLOAT Depth, UINT8 Stencil) {
+            procs->ClearDepthStencilView(pContext, pView, Flags, Depth, Stencil);
+        });
+
+        if (skip) {
+            g_counters.add(Counter::ShadowDrawsSkipped);
+        }
+    }
+#endif
+
+#ifdef DRAW_STATS
+    if (skip) {
+        g_drawStats.skip(state->vs, state->ps);
+    }
+#endif
+
+    return skip;
+}
+
+/** Common bookkeeping for all draw hooks */
+inline void onDraw(ID3D11DeviceContext* pContext, [[maybe_unused]] UINT Count, [[maybe_unused]] UINT InstanceCount) {
+    if (!isImmediatecontext(pContext)) {
+        return;
+    }
+
+#ifdef DRAW_STATS
+    g_drawStats.draw(g_immContextState.vs, g_immContextState.ps, Count, InstanceCount, g_immContextState.stateChanges);
+    g_immContextState.stateChanges = 0U;
+#endif
+
+#ifdef GPU_PROFILER
+    g_profiler.draw(pContext, g_immContextState.ps, g_immContextState.pass);
+#endif
+
+#ifdef QUALITY_GOVERNOR
+    g_governor.draw(pContext);
+#endif
+
+#ifdef AB_BENCHMARK
+    const auto* procs = getContextProcs(pContext);
+    g_abBenchmark.draw(pContext,
+        [&] (ID3D11PixelShader* pShader) { procs->PSSetShader(pContext, pShader, nullptr, 0U); },
+        [&] (ID3D11VertexShader* pShader) { procs->VSSetShader(pContext, pShader, nullptr, 0U); });
+#endif
+
+#ifdef REDUCED_EFFECTS
+    auto* state = &g_immContextState;
+
+    if (!state->vsReduced && !state->psReduced) {
+        endReducedPass(pContext, state);
+        return;
+    }
+
+    if (!g_reducedPass.active()) {
+        if (state->rtvCount != 1U || state->blendClass == ReducedBlend::Incompatible) {
+            return;
+        }
+
+        ID3D11Device* device = nullptr;
+        pContext->GetDevice(&device);
+        const auto* deviceProcs = getDeviceProcs(device);
+
+        /* Created through the original procs, the upsampling pass must not be tagged */
+        const bool started = g_reducedPass.init(
+            [&] (const void* pCode, SIZE_T Length, ID3D11VertexShader** ppShader) {
+                return deviceProcs->CreateVertexShader(device, pCode, Length, nullptr, ppShader);
+            }, [&] (const void* pCode, SIZE_T Length, ID3D11PixelShader** ppShader) {
+                return deviceProcs->CreatePixelShader(device, pCode, Length, nullptr, ppShader);
+            }, [&] (const D3D11_SAMPLER_DESC* pDesc, ID3D11SamplerState** ppSampler) {
+                return deviceProcs->CreateSamplerState(device, pDesc, ppSampler);
+            }, [&] (const D3D11_BLEND_DESC* pDesc, ID3D11BlendState** ppBlend) {
+                return device->CreateBlendState(pDesc, ppBlend);
+            }) && g_reducedPass.begin(pContext, getContextProcs(pContext), device, state->rtv, state->dsv, state->blendClass, REDUCED_EFFECTS_DIVISOR,
+            [&] (const D3D11_TEXTURE2D_DESC* pDesc, ID3D11Texture2D** ppTexture) {
+                return deviceProcs->CreateTexture2D(device, pDesc, nullptr, ppTexture);
+            });
+
+        device->Release();
+
+        if (!started) {
+            return;
+        }
+
+        g_counters.add(Counter::ReducedPasses);
+        state->reducedDivisor = REDUCED_EFFECTS_DIVISOR;
+        rescaleViewports(pContext, state);
+    }
+#endif
+}
+
+/**
+ * Applies the draw actions of the bound index buffer's rule.
+ * Returns false if the draw is to be dropped.
+ */
+inline bool applyDrawRule(ID3D11DeviceContext* pContext, UINT& IndexCount) {
+    const DrawRule* rule = getDrawRule(getContextState(pContext));
+
+    if (!rule) {
+        return true;
+    }
+
+    if (rule->actions & RULE_REDUCE) {
+        IndexCount = rule->reduce(IndexCount);
+    }
+
+    return !(rule->actions & RULE_SKIP_DRAW) && IndexCount;
+}
+
+#ifdef SHADOW_CULL
+/** Drops small shadow casters on the immediate context, see SHADOW_CULL_MIN_INDICES */
+inline bool cullShadowCaster(ID3D11DeviceContext* pContext, UINT IndexCount) {
+    const auto* state = getContextState(pContext);
+
+    if (!state->shadowPass || !isImmediatecontext(pContext)) {
+        return false;
+    }
+
+    const uint32_t quality = getReductionQuality();
+
+    if (quality >= SHADOW_CULL_MIN_INDICES.size() || IndexCount >= SHADOW_CULL_MIN_INDICES[quality]) {
+        return false;
+    }
+
+    if (!SHADOW_CULL_ALL_SHADERS && std::find(SHADOW_CULL_SHADERS.begin(),
+            SHADOW_CULL_SHADERS.end(), g_shaders.hash(state->vs)) == SHADOW_CULL_SHADERS.end()) {
+        return false;
+    }
+
+    g_counters.add(Counter::ShadowCastersCulled);
+    g_counters.add(Counter::ShadowIndicesCulled, IndexCount);
+    return true;
+}
+#else
+inline bool cullShadowCaster(ID3D11DeviceContext*, UINT) {
+    return false;
+}
+#endif
+
+#ifdef PARTICLE_BUDGET
+/**
+ * Applies the particle budget on the immediate context and times
+ * particle draws. Returns false if the draw is dropped.
+ */
+inline bool applyParticleBudget(ID3D11DeviceContext* pContext, UINT* pInstanceCount) {
+    if (!isImmediatecontext(pContext)) {
+        return true;
+    }
+
+    const auto* state = &g_immContextState;
+    const bool particle = std::find(PARTICLE_SHADERS.begin(), PARTICLE_SHADERS.end(),
+        g_shaders.hash(state->vs)) != PARTICLE_SHADERS.end();
+
+    if (particle) {
+        const UINT instances = pInstanceCount ? *pInstanceCount : 1U;
+
+        if (!g_particleBudget.admit(pInstanceCount)) {
+            g_counters.add(Counter::ParticleDrawsSkipped);
+            return false;
+        }
+
+        if (pInstanceCount && *pInstanceCount != instances) {
+            g_counters.add(Counter::ParticleDrawsReduced);
+        }
+    }
+
+    g_particleBudget.draw(pContext, particle, state->pass);
+    return true;
+}
+#else
+inline bool applyParticleBudget(ID3D11DeviceContext*, UINT*) {
+    return true;
+}
+#endif
+
+#ifdef GRASS_DENSITY
+/**
+ * Thins out grass on the immediate context, see GRASS_DENSITY_PERCENT.
+ * Instanced draws drop instances, others drop whole blades. Returns
+ * false if nothing is left to draw.
+ */
+inline bool applyGrassDensity(ID3D11DeviceContext* pContext, UINT& Count, bool instanced) {
+    const auto* state = getContextState(pContext);
+    const uint32_t quality = getReductionQuality();
+
+    if (!isImmediatecontext(pContext) || quality >= GRASS_DENSITY_PERCENT.size()
+     || GRASS_DENSITY_PERCENT[quality] >= 100U
+     || g_shaders.hash(state->vs) != GRASS_VS_HASH || g_shaders.hash(state->ps) != GRASS_PS_HASH) {
+        return true;
+    }
+
+    const UINT unit = instanced ? 1U : GRASS_BLADE_INDICES;
+
+    /* Not made of whole blades, dropping indices could cut one in half */
+    if (Count % unit) {
+        return true;
+    }
+
+    const UINT reduced = static_cast<UINT>(static_cast<uint64_t>(Count) * GRASS_DENSITY_PERCENT[quality] / 100U);
+    const UINT aligned = reduced - reduced % unit;
+
+    g_counters.add(Counter::GrassDrawsThinned);
+    g_counters.add(Counter::GrassUnitsDropped, Count - aligned);
+
+    Count = aligned;
+    return Count != 0U;
+}
+#else
+inline bool applyGrassDensity(ID3D11DeviceContext*, UINT&, bool) {
+    return true;
+}
+#endif
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexed(
+        ID3D11DeviceContext* pContext,
+        UINT IndexCount,
+        UINT StartIndexLocation,
+        INT BaseVertexLocation) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipDraw(pContext) || !applyDrawRule(pContext, IndexCount) || cullShadowCaster(pContext, IndexCount)
+     || !applyGrassDensity(pContext, IndexCount, false) || !applyParticleBudget(pContext, nullptr)) {
+        return;
+    }
+
+    onDraw(pContext, IndexCount, 1U);
+    procs->DrawIndexed(pContext, IndexCount, StartIndexLocation, BaseVertexLocation);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Draw(
+        ID3D11DeviceContext* pContext,
+        UINT VertexCount,
+        UINT StartVertexLocation) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipDraw(pContext) || !applyParticleBudget(pContext, nullptr)) {
+        return;
+    }
+
+    onDraw(pContext, VertexCount, 1U);
+    procs->Draw(pContext, VertexCount, StartVertexLocation);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexedInstanced(
+        ID3D11DeviceContext* pContext,
+        UINT IndexCountPerInstance,
+        UINT InstanceCount,
+        UINT StartIndexLocation,
+        INT BaseVertexLocation,
+        UINT StartInstanceLocation) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipDraw(pContext) || !applyDrawRule(pContext, IndexCountPerInstance)
+     || !applyGrassDensity(pContext, InstanceCount, true) || !applyParticleBudget(pContext, &InstanceCount)) {
+        return;
+    }
+
+    onDraw(pContext, IndexCountPerInstance, InstanceCount);
+    procs->DrawIndexedInstanced(pContext, IndexCountPerInstance, InstanceCount, StartIndexLocation, BaseVertexLocation, StartInstanceLocation);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawInstanced(
+        ID3D11DeviceContext* pContext,
+        UINT VertexCountPerInstance,
+        UINT InstanceCount,
+        UINT StartVertexLocation,
+        UINT StartInstanceLocation) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (skipDraw(pContext) || !applyParticleBudget(pContext, &InstanceCount)) {
+        return;
+    }
+
+    onDraw(pContext, VertexCountPerInstance, InstanceCount);
+    procs->DrawInstanced(pContext, VertexCountPerInstance, InstanceCount, StartVertexLocation, StartInstanceLocation);
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_Present(IDXGISwapChain* pSwapChain, UINT SyncInterval, UINT Flags) {
+    const auto* procs = getDxgiProcs(pSwapChain);
+
+    if (!(Flags & DXGI_PRESENT_TEST)) {
+        ID3D11Device* device = nullptr;
+
+        if (SUCCEEDED(pSwapChain->GetDevice(__uuidof(ID3D11Device), std::bit_cast<void**>(&device)))) {
+            ID3D11DeviceContext* context = nullptr;
+            device->GetImmediateContext(&context);
+
+#ifdef DRIVER_QUERIES
+            const auto createDriverQuery = [device] (const D3D11_QUERY_DESC* pDesc, ID3D11Query** ppQuery) {
+                return getDeviceProcs(device)->CreateQuery(device, pDesc, ppQuery);
+            };
+#endif
+
+#ifdef RING_BUFFERS
+            g_vbRing.present(context, createDriverQuery);
+            g_cbRing.present(context, createDriverQuery);
+#endif
+
+#ifdef STAGING_WRITES
+            g_stagingPool.present(g_frame);
+#endif
+
+#ifdef GPU_PROFILER
+            g_profiler.present(context, g_shaders, createDriverQuery);
+#endif
+
+#ifdef AB_BENCHMARK
+            g_abBenchmark.present(context, g_shaders, createDriverQuery);
+#endif
+
+#ifdef PARTICLE_BUDGET
+            g_particleBudget.present(context, createDriverQuery);
+            g_counters.add(Counter::ParticleGpuUs, static_cast<uint64_t>(g_particleBudget.lastMs() * 1000.0));
+#endif
+
+#ifdef QUALITY_GOVERNOR
+            if (g_governor.present(context, createDriverQuery)) {
+                const auto& change = g_governor.lastSwitch();
+                log("Quality tier ", QualityGovernor::tierName(change.from), " -> ", QualityGovernor::tierName(change.to),
+                    ": frame ", change.frameMs, " ms, cpu ", change.cpuMs, " ms, gpu ", change.gpuMs, " ms, target ", g_governor.targetMs(), " ms");
+            }
+
+            g_counters.set(Counter::QualityTier, static_cast<uint64_t>(g_governor.tier()));
+#endif
+
+            bool snapshot = false;
+
+#ifdef DRAW_STATS
+            static bool keyDown = false;
+            static uint64_t lastSnapshot = 0U;
+            const bool keyPressed = GetAsyncKeyState(DRAW_STATS_KEY) & 0x8000;
+            snapshot = (keyPressed && !keyDown)
+                || (DRAW_STATS_INTERVAL && g_frame - lastSnapshot >= DRAW_STATS_INTERVAL);
+            keyDown = keyPressed;
+
+            if (snapshot) {
+                lastSnapshot = g_frame;
+            }
+
+            g_drawStats.present(g_frame, snapshot, g_shaders);
+#endif
+
+#ifdef SHADOW_REUSE
+            if (g_shadowReuse.reused()) {
+                g_counters.add(Counter::ShadowFramesReused);
+            }
+
+            g_shadowReuse.present([&] (ID3D11DepthStencilView* pView, UINT ClearFlags, FLOAT Depth, UINT8 Stencil) {
+                getContextProcs(context)->ClearDepthStencilView(context, pView, ClearFlags, Depth, Stencil);
+            });
+#endif
+
+#ifdef REDUCED_EFFECTS
+            endReducedPass(context, &g_immContextState);
+#endif
+
+#ifdef SPATIAL_UPSCALE
+            const auto* deviceProcs = getDeviceProcs(device);
+
+            g_upscaler.present(context, getContextProcs(context), device,
+                [&] (const void* pCode, SIZE_T Length, ID3D11VertexShader** ppShader) {
+                    return deviceProcs->CreateVertexShader(device, pCode, Length, nullptr, ppShader);
+                }, [&] (const void* pCode, SIZE_T Length, ID3D11PixelShader** ppShader) {
+                    return deviceProcs->CreatePixelShader(device, pCode, Length, nullptr, ppShader);
+                }, [&] (const D3D11_SAMPLER_DESC* pDesc, ID3D11SamplerState** ppSampler) {
+                    return deviceProcs->CreateSamplerState(device, pDesc, ppSampler);
+                }, [&] {
+                    ID3D11Texture2D* backBuffer = nullptr;
+                    procs->GetBuffer(pSwapChain, 0U, __uuidof(ID3D11Texture2D), std::bit_cast<void**>(&backBuffer));
+                    return backBuffer;
+                });
+#endif
+
+#ifdef IMMUTABLE_DEDUP
+            g_dedup.present(g_frame);
+#endif
+
+            g_counters.present(g_frame, snapshot);
+
+#ifdef FEED_SKIP
+            g_feeds.present();
+#endif
+            g_immContextState.pass = 0U;
+            g_frame++;
+
+            context->Release();
+            device->Release();
+        }
+    }
+
+    const HRESULT hr = procs->Present(pSwapChain, SyncInterval, Flags);
+
+#ifdef QUALITY_GOVERNOR
+    if (!(Flags & DXGI_PRESENT_TEST)) {
+        g_governor.presented();
+    }
+#endif
+
+    return hr;
+}
+
+#ifdef SPATIAL_UPSCALE
+/** The game renders to a proxy back buffer at render size, see upscale.h */
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_GetBuffer(IDXGISwapChain* pSwapChain, UINT Buffer, REFIID riid, void** ppSurface) {
+    const auto* procs = getDxgiProcs(pSwapChain);
+
+    ID3D11Texture2D* backBuffer = nullptr;
+
+    if (Buffer || !ppSurface
+     || FAILED(procs->GetBuffer(pSwapChain, Buffer, __uuidof(ID3D11Texture2D), std::bit_cast<void**>(&backBuffer)))) {
+        return procs->GetBuffer(pSwapChain, Buffer, riid, ppSurface);
+    }
+
+    ID3D11Device* device = nullptr;
+    backBuffer->GetDevice(&device);
+
+    ID3D11Texture2D* proxy = g_upscaler.getProxy(backBuffer, [&] (const D3D11_TEXTURE2D_DESC* pDesc, ID3D11Texture2D** ppTexture) {
+        return getDeviceProcs(device)->CreateTexture2D(device, pDesc, nullptr, ppTexture);
+    });
+
+    device->Release();
+    backBuffer->Release();
+
+    if (!proxy) {
+        return procs->GetBuffer(pSwapChain, Buffer, riid, ppSurface);
+    }
+
+    setTag(proxy, TAG_SCALED);
+
+    const HRESULT hr = proxy->QueryInterface(riid, ppSurface);
+    proxy->Release();
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_ResizeBuffers(IDXGISwapChain* pSwapChain, UINT BufferCount,
+        UINT Width, UINT Height, DXGI_FORMAT NewFormat, UINT SwapChainFlags) {
+    const auto* procs = getDxgiProcs(pSwapChain);
+
+    /* Our references to the back buffer would make the resize fail */
+    g_upscaler.resize();
+    return procs->ResizeBuffers(pSwapChain, BufferCount, Width, Height, NewFormat, SwapChainFlags);
+}
+#endif
+
+void adjustSwapChainDesc([[maybe_unused]] DXGI_SWAP_CHAIN_DESC* pDesc) {
+#ifdef MSAA_CAP
+    capSampleCount(pDesc->SampleDesc, MSAA_MAX_SAMPLES);
+#endif
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory_CreateSwapChain(IDXGIFactory* pFactory, IUnknown* pDevice, DXGI_SWAP_CHAIN_DESC* pDesc, IDXGISwapChain** ppSwapChain) {
+    const auto* procs = getDxgiProcs(nullptr);
+    DXGI_SWAP_CHAIN_DESC desc;
+
+    if (pDesc) {
+        desc = *pDesc;
+        adjustSwapChainDesc(&desc);
+        pDesc = &desc;
+    }
+
+    const HRESULT hr = procs->CreateSwapChain(pFactory, pDevice, pDesc, ppSwapChain);
+
+    if (SUCCEEDED(hr) && ppSwapChain && *ppSwapChain) {
+        hookSwapChain(*ppSwapChain);
+    }
+
+    return hr;
+}
+
+/**
+ * Timestamp queries get stub objects, occlusion queries and
+ * predicates get a ring of driver queries so that GetData
+ * never has to stall on the GPU. See query.h.
+ */
+template<typename T, typename Create>
+HRESULT createQuery(ID3D11Device* pDevice, const D3D11_QUERY_DESC* pQueryDesc, T** ppQuery, Create&& createProc) {
+    if (!ppQuery || !pQueryDesc) {
+        return createProc(pQueryDesc, ppQuery);
+    }
+
+    *ppQuery = nullptr;
+
+    if (Query::isStubType(pQueryDesc->Query)) {
+        *ppQuery = new Query(pDevice, *pQueryDesc);
+        return S_OK;
+    }
+
+    if (!Query::isLatencyType(pQueryDesc->Query)) {
+        return createProc(pQueryDesc, ppQuery);
+    }
+
+    auto* query = new Query(pDevice, *pQueryDesc);
+
+    for (uint32_t i = 0U; i < Query::LatencyDepth; i++) {
+        T* slot = nullptr;
+        const HRESULT hr = createProc(pQueryDesc, &slot);
+
+        if (FAILED(hr)) {
+            query->Release();
+            return hr;
+        }
+
+        query->setSlot(i, slot);
+    }
+
+    *ppQuery = query;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateQuery(ID3D11Device* pDevice, const D3D11_QUERY_DESC* pQueryDesc, ID3D11Query** ppQuery)  {
+    const auto* procs = getDeviceProcs(pDevice);
+
+    return createQuery(pDevice, pQueryDesc, ppQuery, [&](const D3D11_QUERY_DESC* pDesc, ID3D11Query** ppResult) {
+        return procs->CreateQuery(pDevice, pDesc, ppResult);
+    });
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePredicate(ID3D11Device* pDevice, const D3D11_QUERY_DESC* pPredicateDesc, ID3D11Predicate** ppPredicate)  {
+    const auto* procs = getDeviceProcs(pDevice);
+
+    return createQuery(pDevice, pPredicateDesc, ppPredicate, [&](const D3D11_QUERY_DESC* pDesc, ID3D11Predicate** ppResult) {
+        return procs->CreatePredicate(pDevice, pDesc, ppResult);
+    });
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Begin(ID3D11DeviceContext* pContext, ID3D11Asynchronous* pAsync) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (Query::is(pAsync)) {
+        static_cast<Query*>(pAsync)->begin([&](ID3D11Query* pQuery) {
+            procs->Begin(pContext, pQuery);
+        });
+        return;
+    }
+
+    procs->Begin(pContext, pAsync);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_End(ID3D11DeviceContext* pContext, ID3D11Asynchronous* pAsync) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (Query::is(pAsync)) {
+        static_cast<Query*>(pAsync)->end([&](ID3D11Query* pQuery) {
+            procs->End(pContext, pQuery);
+        });
+        return;
+    }
+
+    procs->End(pContext, pAsync);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_GetData(ID3D11DeviceContext* pContext, ID3D11Asynchronous* pAsync, void* pData, UINT DataSize, UINT GetDataFlags) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (Query::is(pAsync)) {
+        return static_cast<Query*>(pAsync)->getData(pData, DataSize, GetDataFlags,
+            [&](ID3D11Query* pQuery, void* pResult, UINT ResultSize, UINT Flags) {
+                return procs->GetData(pContext, pQuery, pResult, ResultSize, Flags);
+            });
+    }
+
+    return procs->GetData(pContext, pAsync, pData, DataSize, GetDataFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_SetPredication(ID3D11DeviceContext* pContext, ID3D11Predicate* pPredicate, BOOL PredicateValue) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (Query::is(pPredicate)) {
+        pPredicate = static_cast<Query*>(static_cast<ID3D11Asynchronous*>(pPredicate))->getPredicate();
+    }
+
+    procs->SetPredication(pContext, pPredicate, PredicateValue);
+}
+
+#define HOOK_PROC(iface, object, table, index, proc) \
+  hookProc(object, #iface "::" #proc, &table->proc, &iface ## _ ## proc, index)
+
+
+template<typename T>
+void hookProc(void* pObject,[[maybe_unused]] const char* pName, T** ppOrig, T* pHook, uint32_t index) {
+    void** vtbl = *std::bit_cast<void***>(pObject);
+
+    MH_STATUS mh = MH_CreateHook(vtbl[index], std::bit_cast<void*>(pHook), std::bit_cast<void**>(ppOrig));
+
+    if (mh) {
+        if (mh != MH_ERROR_ALREADY_CREATED) {
+#ifndef NDEBUG
+            log("Failed to create hook for ", pName, ": ", MH_StatusToString(mh));
+#endif
+        }
+        return;
+    }
+
+    mh = MH_EnableHook(vtbl[index]);
+
+    if (mh) {
+#ifndef NDEBUG
+        log("Failed to enable hook for ", pName, ": ", MH_StatusToString(mh));
+#endif
+        return;
+    }
+#ifndef NDEBUG
+        log("Created hook for ", pName, " @ ", reinterpret_cast<void*>(pHook));
+    #endif
+}
+
+void hookDevice(ID3D11Device* pDevice) {
+    const std::lock_guard lock(g_hookMutex);
+
+    if (g_installedHooks & HOOK_DEVICE) {
+        return;
+    }
+
+#ifndef NDEBUG
+    log("Hooking device ", pDevice);
+#endif
+
+    DeviceProcs* procs = &g_deviceProcs;
+    HOOK_PROC(ID3D11Device, pDevice, procs, 3,  CreateBuffer);
+    HOOK_PROC(ID3D11Device, pDevice, procs, 5,  CreateTexture2D);
+#if defined(RT_DOWNGRADE) || defined(MSAA_CAP) || defined(BC_COMPRESS) || defined(MIP_GENERATION)
+    HOOK_PROC(ID3D11Device, pDevice, procs, 7,  CreateShaderResourceView);
+#endif
+#if defined(SPATIAL_UPSCALE) || defined(RT_DOWNGRADE) || defined(MSAA_CAP)
+    HOOK_PROC(ID3D11Device, pDevice, procs, 9,  CreateRenderTargetView);
+#endif
+    HOOK_PROC(ID3D11Device, pDevice, procs, 10,  CreateDepthStencilView);
+    HOOK_PROC(ID3D11Device, pDevice, procs, 11,  CreateInputLayout);
+    HOOK_PROC(ID3D11Device, pDevice, procs, 12,  CreateVertexShader); //crashes on AMD
+    HOOK_PROC(ID3D11Device, pDevice, procs, 15,  CreatePixelShader);
+#if defined(SAMPLER_LIMITS) || defined(REDUCED_EFFECTS) || defined(SPATIAL_UPSCALE)
+    HOOK_PROC(ID3D11Device, pDevice, procs, 23,  CreateSamplerState);
+#endif
+    HOOK_PROC(ID3D11Device, pDevice, procs, 24,  CreateQuery);
+    HOOK_PROC(ID3D11Device, pDevice, procs, 25,  CreatePredicate);
+
+    g_installedHooks |= HOOK_DEVICE;
+
+    /* The game may create its swap chain through the factory */
+    IDXGIDevice* dxgiDevice = nullptr;
+
+    if (SUCCEEDED(pDevice->QueryInterface(__uuidof(IDXGIDevice), std::bit_cast<void**>(&dxgiDevice)))) {
+        IDXGIAdapter* adapter = nullptr;
+
+        if (SUCCEEDED(dxgiDevice->GetAdapter(&adapter))) {
+            IDXGIFactory* factory = nullptr;
+
+            if (SUCCEEDED(adapter->GetParent(__uuidof(IDXGIFactory), std::bit_cast<void**>(&factory)))) {
+                DxgiProcs* dxgiProcs = &g_dxgiProcs;
+                HOOK_PROC(IDXGIFactory, factory, dxgiProcs, 10, CreateSwapChain);
+                g_installedHooks |= HOOK_FACTORY;
+                factory->Release();
+            }
+
+            adapter->Release();
+        }
+
+        dxgiDevice->Release();
+    }
+}
+
+void hookSwapChain(IDXGISwapChain* pSwapChain) {
+    const std::lock_guard lock(g_hookMutex);
+
+    if (g_installedHooks & HOOK_SWAPCHAIN) {
+        return;
+    }
+
+    DxgiProcs* procs = &g_dxgiProcs;
+    HOOK_PROC(IDXGISwapChain, pSwapChain, procs, 8, Present);
+
+#ifdef SPATIAL_UPSCALE
+    HOOK_PROC(IDXGISwapChain, pSwapChain, procs, 9, GetBuffer);
+    HOOK_PROC(IDXGISwapChain, pSwapChain, procs, 13, ResizeBuffers);
+#endif
+
+    g_installedHooks |= HOOK_SWAPCHAIN;
+}
+void hookContext(ID3D11DeviceContext* pContext) {
+  std::lock_guard lock(g_hookMutex);
+
+  uint32_t flag = HOOK_IMM_CTX;
+  ContextProcs* procs = &g_immContextProcs;
+
+  if (!isImmediatecontext(pContext)) {
+    flag = HOOK_DEF_CTX;
+    procs = &g_defContextProcs;
+  }
+
+  if (g_installedHooks & flag)
+    return;
+
+#ifdef RING_BUFFERS
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 7, VSSetConstantBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 16, PSSetConstantBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 18, IASetVertexBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 22, GSSetConstantBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 62, HSSetConstantBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 66, DSSetConstantBuffers);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 71, CSSetConstantBuffers);
+#endif
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 8, PSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 9, PSSetShader);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 11, VSSetShader);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 12, DrawIndexed);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 13, Draw);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 20, DrawIndexedInstanced);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 21, DrawInstanced);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 33, OMSetRenderTargets);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 34, OMSetRenderTargetsAndUnorderedAccessViews);
+#ifdef REDUCED_EFFECTS
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 35, OMSetBlendState);
+#endif
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 44, RSSetViewports);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 45, RSSetScissorRects);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 95, RSGetViewports);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 96, RSGetScissorRects);
+#ifdef SHADOW_REUSE
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 53, ClearDepthStencilView);
+#endif
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 110, ClearState);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 58, ExecuteCommandList);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 114, FinishCommandList);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 19, IASetIndexBuffer);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 27, Begin);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 28, End);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 29, GetData);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 30, SetPredication);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 14, Map);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 15, Unmap);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 48, UpdateSubresource);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 46, CopySubresourceRegion);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 47, CopyResource);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 49, CopyStructureCount);
+#if defined(MSAA_CAP) || defined(FEED_SKIP)
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 57, ResolveSubresource);
+#endif
+#ifdef FEED_SKIP
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 25, VSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 31, GSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 59, HSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 63, DSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 67, CSSetShaderResources);
+  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 68, CSSetUnorderedAccessViews);
+#endif
+
+  /* Writes through the 11.1 interface must reach the constant buffer shadows */
+  ID3D11DeviceContext1* context1 = nullptr;
+
+  if (SUCCEEDED(pContext->QueryInterface(__uuidof(ID3D11DeviceContext1), std::bit_cast<void**>(&context1)))) {
+    HOOK_PROC(ID3D11DeviceContext1, context1, procs, 115, CopySubresourceRegion1);
+    HOOK_PROC(ID3D11DeviceContext1, context1, procs, 116, UpdateSubresource1);
+    HOOK_PROC(ID3D11DeviceContext1, context1, procs, 117, DiscardResource);
+    context1->Release();
+  }
 
   g_installedHooks |= flag;
 
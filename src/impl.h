@@ -9,6 +9,8 @@ namespace atfix {
 
 void hookDevice(ID3D11Device* pDevice);
 void hookContext(ID3D11DeviceContext* pContext);
+void hookSwapChain(IDXGISwapChain* pSwapChain);
+void adjustSwapChainDesc(DXGI_SWAP_CHAIN_DESC* pDesc);
 void CreateShaderOnStart(ID3D11Device* pDevice);
 // NOLINTBEGIN (cppcoreguidelines-avoid-non-const-global-variables)
 inline void* SettingsAddress = nullptr;
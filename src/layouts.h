@@ -0,0 +1,180 @@
+#ifndef LAYOUTS_H
+#define LAYOUTS_H
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <d3d11.h>
+
+#include "cbcache.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Finds a chunk in a DXBC container
+ *
+ * \returns Pointer to the chunk payload, or null if the container
+ *    is malformed or has no such chunk
+ */
+inline const uint8_t* findDxbcChunk(const void* pBytecode, SIZE_T length, const char* fourcc, uint32_t& size) {
+  const auto* bytes = static_cast<const uint8_t*>(pBytecode);
+  constexpr SIZE_T HeaderSize = 32U;
+
+  if (!bytes || length < HeaderSize || std::memcmp(bytes, "DXBC", 4U)) {
+    return nullptr;
+  }
+
+  uint32_t chunkCount = 0U;
+  std::memcpy(&chunkCount, bytes + 28U, sizeof(chunkCount));
+
+  if (chunkCount > (length - HeaderSize) / sizeof(uint32_t)) {
+    return nullptr;
+  }
+
+  for (uint32_t i = 0U; i < chunkCount; i++) {
+    uint32_t offset = 0U;
+    std::memcpy(&offset, bytes + HeaderSize + i * sizeof(uint32_t), sizeof(offset));
+
+    if (offset > length - 8U) {
+      return nullptr;
+    }
+
+    std::memcpy(&size, bytes + offset + 4U, sizeof(size));
+
+    if (size > length - offset - 8U) {
+      return nullptr;
+    }
+
+    if (!std::memcmp(bytes + offset, fourcc, 4U)) {
+      return bytes + offset + 8U;
+    }
+  }
+
+  return nullptr;
+}
+
+
+/**
+ * \brief Input layout cache
+ *
+ * D3D11 does not deduplicate input layouts the way it does state
+ * objects. Layouts are keyed by their device, element descriptions
+ * and the input signature of the vertex shader, since that is all
+ * creation validates against. The full key is kept to rule out
+ * collisions.
+ *
+ * The cache holds a reference to each layout, and layouts keep their
+ * device alive. Layouts nobody else references any more are released
+ * whenever a new one is added, so a device the game is done with can
+ * be destroyed once the game creates layouts on another one.
+ */
+class InputLayoutCache {
+
+public:
+
+  static constexpr uint32_t MaxLayouts = 1024U;
+
+  /**
+   * \brief Builds the cache key of a layout
+   *
+   * \returns \c false if the shader has no input signature
+   */
+  static bool getKey(const D3D11_INPUT_ELEMENT_DESC* pDescs, UINT count,
+          const void* pBytecode, SIZE_T length, std::string& key) {
+    uint32_t isgnSize = 0U;
+    const uint8_t* isgn = findDxbcChunk(pBytecode, length, "ISGN", isgnSize);
+
+    if (!isgn) {
+      isgn = findDxbcChunk(pBytecode, length, "ISG1", isgnSize);
+    }
+
+    if (!isgn) {
+      return false;
+    }
+
+    key.assign(reinterpret_cast<const char*>(isgn), isgnSize);
+
+    for (UINT i = 0U; i < count; i++) {
+      const D3D11_INPUT_ELEMENT_DESC& desc = pDescs[i];
+      const UINT fields[] = { desc.SemanticIndex, static_cast<UINT>(desc.Format), desc.InputSlot,
+        desc.AlignedByteOffset, static_cast<UINT>(desc.InputSlotClass), desc.InstanceDataStepRate };
+
+      key.append(desc.SemanticName ? desc.SemanticName : "");
+      key.push_back('\0');
+      key.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    }
+
+    return true;
+  }
+
+  /** Cached layout of a device for a key, AddRef'd, or null */
+  ID3D11InputLayout* find(ID3D11Device* pDevice, const std::string& key) {
+    const std::lock_guard lock(m_mutex);
+
+    auto entry = m_entries.find(getHash(pDevice, key));
+
+    if (entry == m_entries.end() || entry->second.device != pDevice || entry->second.key != key) {
+      return nullptr;
+    }
+
+    entry->second.layout->AddRef();
+    return entry->second.layout;
+  }
+
+  /** Adds a new layout, the cache takes its own reference */
+  void add(ID3D11Device* pDevice, const std::string& key, ID3D11InputLayout* pLayout) {
+    const std::lock_guard lock(m_mutex);
+
+    releaseUnused();
+
+    if (m_entries.size() >= MaxLayouts) {
+      return;
+    }
+
+    if (m_entries.emplace(getHash(pDevice, key), Entry { pDevice, key, pLayout }).second) {
+      pLayout->AddRef();
+    }
+  }
+
+private:
+
+  struct Entry {
+    ID3D11Device*       device;
+    std::string         key;
+    ID3D11InputLayout*  layout;
+  };
+
+  static uint64_t getHash(ID3D11Device* pDevice, const std::string& key) {
+    return hashBytes(key.data(), key.size(), hashBytes(&pDevice, sizeof(pDevice)));
+  }
+
+  /**
+   * Releases layouts only the cache references. Nobody else can take
+   * a new reference to those, since find runs under the same lock.
+   */
+  void releaseUnused() {
+    for (auto entry = m_entries.begin(); entry != m_entries.end(); ) {
+      ID3D11InputLayout* layout = entry->second.layout;
+      layout->AddRef();
+
+      if (layout->Release() == 1U) {
+        layout->Release();
+        entry = m_entries.erase(entry);
+      } else {
+        ++entry;
+      }
+    }
+  }
+
+  mutex                                   m_mutex;
+  std::unordered_map<uint64_t, Entry>     m_entries;
+
+};
+
+}
+
+#endif
@@ -257,6 +257,14 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
       return E_FAIL;
   }
 
+  DXGI_SWAP_CHAIN_DESC swapChainDesc;
+
+  if (pSwapChainDesc) {
+    swapChainDesc = *pSwapChainDesc;
+    atfix::adjustSwapChainDesc(&swapChainDesc);
+    pSwapChainDesc = &swapChainDesc;
+  }
+
   ID3D11Device* device = nullptr;
   ID3D11DeviceContext* context = nullptr;
 
@@ -270,6 +278,10 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
 
   atfix::hookDevice(device);
   atfix::hookContext(context);
+
+  if (ppSwapChain && *ppSwapChain) {
+    atfix::hookSwapChain(*ppSwapChain);
+  }
   
   if (ppDevice) {
     device->AddRef();
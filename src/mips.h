@@ -0,0 +1,266 @@
+#ifndef MIPS_H
+#define MIPS_H
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <emmintrin.h>
+
+#include <d3d11.h>
+
+#include "formats.h"
+#include "pool.h"
+
+namespace atfix {
+
+/**
+ * \brief Halves one row of an RGBA8 image with a 2x2 box filter
+ *
+ * Takes the two source rows that make up the destination row. Odd
+ * source sizes drop the last column, a source width of 1 repeats it.
+ */
+inline void downsampleRowUnorm(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t srcWidth, uint8_t* pDst, uint32_t dstWidth) {
+  uint32_t x = 0U;
+
+  if (srcWidth > 1U) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+
+    for (; x + 2U <= dstWidth; x += 2U) {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRow0 + x * 8U));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRow1 + x * 8U));
+
+      /* Texels 0 and 1, and 2 and 3, of both rows in 16-bit lanes */
+      const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+      const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+      const __m128i sum = _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)), _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+
+      const __m128i avg = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(pDst + x * 4U), _mm_packus_epi16(avg, zero));
+    }
+  }
+
+  for (; x < dstWidth; x++) {
+    const uint32_t x0 = std::min(2U * x, srcWidth - 1U) * 4U;
+    const uint32_t x1 = std::min(2U * x + 1U, srcWidth - 1U) * 4U;
+
+    for (uint32_t c = 0U; c < 4U; c++) {
+      pDst[x * 4U + c] = static_cast<uint8_t>((pRow0[x0 + c] + pRow0[x1 + c] + pRow1[x0 + c] + pRow1[x1 + c] + 2) / 4);
+    }
+  }
+}
+
+/** Conversion tables between sRGB and linear, built once */
+struct SrgbTables {
+  static constexpr uint32_t LinearSteps = 4096U;
+
+  std::array<float, 256>          toLinear;
+  std::array<uint8_t, LinearSteps> toSrgb;
+
+  SrgbTables() {
+    for (uint32_t i = 0U; i < toLinear.size(); i++) {
+      const float v = static_cast<float>(i) / 255.0f;
+      toLinear[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+    }
+
+    for (uint32_t i = 0U; i < LinearSteps; i++) {
+      const float v = static_cast<float>(i) / static_cast<float>(LinearSteps - 1U);
+      const float s = v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+      toSrgb[i] = static_cast<uint8_t>(std::clamp(s, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+  }
+
+  static const SrgbTables& get() {
+    static const SrgbTables tables;
+    return tables;
+  }
+};
+
+/** Same as downsampleRowUnorm, but averages color in linear space */
+inline void downsampleRowSrgb(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t srcWidth, uint8_t* pDst, uint32_t dstWidth) {
+  const SrgbTables& tables = SrgbTables::get();
+  constexpr float Scale = static_cast<float>(SrgbTables::LinearSteps - 1U) / 4.0f;
+
+  for (uint32_t x = 0U; x < dstWidth; x++) {
+    const uint32_t x0 = std::min(2U * x, srcWidth - 1U) * 4U;
+    const uint32_t x1 = std::min(2U * x + 1U, srcWidth - 1U) * 4U;
+
+    for (uint32_t c = 0U; c < 3U; c++) {
+      const float sum = tables.toLinear[pRow0[x0 + c]] + tables.toLinear[pRow0[x1 + c]]
+                      + tables.toLinear[pRow1[x0 + c]] + tables.toLinear[pRow1[x1 + c]];
+      pDst[x * 4U + c] = tables.toSrgb[static_cast<uint32_t>(sum * Scale + 0.5f)];
+    }
+
+    pDst[x * 4U + 3U] = static_cast<uint8_t>((pRow0[x0 + 3U] + pRow0[x1 + 3U] + pRow1[x0 + 3U] + pRow1[x1 + 3U] + 2) / 4);
+  }
+}
+
+/** Texture description and initial data with a generated mip chain */
+struct MipChain {
+  D3D11_TEXTURE2D_DESC                  desc;
+  std::vector<uint8_t>                  storage;
+  std::vector<D3D11_SUBRESOURCE_DATA>   data;
+};
+
+/**
+ * \brief Generates mip chains for single-level textures
+ *
+ * Immutable RGBA8 shader resources of at least MinSize texels per
+ * side that were created with one mip get the full chain, computed
+ * with a 2x2 box filter on the worker pool, level by level. SRGB
+ * textures are filtered in linear space. The game's shader resource
+ * views are widened to all mips with expandViewMips.
+ *
+ * Arrays and cube maps are left alone. Added mips renumber their
+ * subresources, which would break the game's copies from them.
+ */
+class MipGenerator {
+
+public:
+
+  /** Destination rows per work item */
+  static constexpr uint32_t RowsPerItem = 16U;
+
+  MipGenerator(UINT minSize, WorkerPool& pool)
+  : m_minSize(minSize), m_pool(pool) { }
+
+  bool isEligible(const D3D11_TEXTURE2D_DESC& desc) const {
+    return desc.Usage == D3D11_USAGE_IMMUTABLE
+        && desc.MipLevels == 1U
+        && desc.ArraySize == 1U
+        && desc.BindFlags == D3D11_BIND_SHADER_RESOURCE
+        && !desc.CPUAccessFlags
+        && !desc.MiscFlags
+        && desc.SampleDesc.Count == 1U
+        && isRgba8(desc.Format)
+        && std::min(desc.Width, desc.Height) >= m_minSize;
+  }
+
+  /** Fills \c chain from the top level of an eligible texture */
+  void generate(const D3D11_TEXTURE2D_DESC& desc, const D3D11_SUBRESOURCE_DATA* pData, MipChain& chain) {
+    chain.desc = desc;
+    chain.desc.MipLevels = 0U;
+    chain.desc.MipLevels = mipCount(chain.desc);
+
+    const UINT mips = chain.desc.MipLevels;
+    const UINT layers = desc.ArraySize;
+    size_t layerSize = 0U;
+
+    for (UINT mip = 1U; mip < mips; mip++) {
+      layerSize += static_cast<size_t>(mipWidth(desc, mip)) * mipHeight(desc, mip) * 4U;
+    }
+
+    chain.storage.resize(layerSize * layers);
+    chain.data.resize(static_cast<size_t>(mips) * layers);
+
+    /* Writable view of the generated levels, indexed like chain.data */
+    std::vector<uint8_t*> levels(chain.data.size());
+
+    for (UINT layer = 0U; layer < layers; layer++) {
+      size_t offset = layerSize * layer;
+      chain.data[layer * mips] = pData[layer];
+
+      for (UINT mip = 1U; mip < mips; mip++) {
+        const UINT pitch = mipWidth(desc, mip) * 4U;
+        levels[layer * mips + mip] = &chain.storage[offset];
+        chain.data[layer * mips + mip] = { levels[layer * mips + mip], pitch, pitch * mipHeight(desc, mip) };
+        offset += chain.data[layer * mips + mip].SysMemSlicePitch;
+      }
+    }
+
+    const bool srgb = desc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+                   || desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+
+    for (UINT mip = 1U; mip < mips; mip++) {
+      const UINT srcWidth = mipWidth(desc, mip - 1U);
+      const UINT srcHeight = mipHeight(desc, mip - 1U);
+      const UINT dstWidth = mipWidth(desc, mip);
+      const UINT dstHeight = mipHeight(desc, mip);
+      const UINT items = (dstHeight + RowsPerItem - 1U) / RowsPerItem;
+
+      m_pool.run(items * layers, [&] (uint32_t item) {
+        const UINT level = (item / items) * mips + mip;
+        const D3D11_SUBRESOURCE_DATA& src = chain.data[level - 1U];
+        const D3D11_SUBRESOURCE_DATA& dst = chain.data[level];
+        const UINT firstRow = (item % items) * RowsPerItem;
+
+        for (UINT y = firstRow; y < std::min(firstRow + RowsPerItem, dstHeight); y++) {
+          const auto* pRow0 = static_cast<const uint8_t*>(src.pSysMem) + static_cast<size_t>(std::min(2U * y, srcHeight - 1U)) * src.SysMemPitch;
+          const auto* pRow1 = static_cast<const uint8_t*>(src.pSysMem) + static_cast<size_t>(std::min(2U * y + 1U, srcHeight - 1U)) * src.SysMemPitch;
+          auto* pDst = levels[level] + static_cast<size_t>(y) * dst.SysMemPitch;
+
+          if (srgb) {
+            downsampleRowSrgb(pRow0, pRow1, srcWidth, pDst, dstWidth);
+          } else {
+            downsampleRowUnorm(pRow0, pRow1, srcWidth, pDst, dstWidth);
+          }
+        }
+      });
+    }
+  }
+
+private:
+
+  static bool isRgba8(DXGI_FORMAT format) {
+    return format == DXGI_FORMAT_R8G8B8A8_UNORM
+        || format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+        || format == DXGI_FORMAT_B8G8R8A8_UNORM
+        || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+  }
+
+  static UINT mipWidth(const D3D11_TEXTURE2D_DESC& desc, UINT mip) {
+    return std::max(desc.Width >> mip, 1U);
+  }
+
+  static UINT mipHeight(const D3D11_TEXTURE2D_DESC& desc, UINT mip) {
+    return std::max(desc.Height >> mip, 1U);
+  }
+
+  UINT          m_minSize;
+  WorkerPool&   m_pool;
+
+};
+
+/**
+ * \brief Widens a view of a texture with a generated chain
+ *
+ * Views the game created for its single mip see the whole chain,
+ * views of other mip ranges are left alone.
+ *
+ * \returns \c true if the description was changed
+ */
+inline bool expandViewMips(D3D11_SHADER_RESOURCE_VIEW_DESC& desc) {
+  const auto expand = [] (UINT mostDetailed, UINT& levels) {
+    if (mostDetailed || levels != 1U) {
+      return false;
+    }
+
+    levels = UINT_MAX;
+    return true;
+  };
+
+  switch (desc.ViewDimension) {
+    case D3D11_SRV_DIMENSION_TEXTURE2D:
+      return expand(desc.Texture2D.MostDetailedMip, desc.Texture2D.MipLevels);
+
+    case D3D11_SRV_DIMENSION_TEXTURE2DARRAY:
+      return expand(desc.Texture2DArray.MostDetailedMip, desc.Texture2DArray.MipLevels);
+
+    case D3D11_SRV_DIMENSION_TEXTURECUBE:
+      return expand(desc.TextureCube.MostDetailedMip, desc.TextureCube.MipLevels);
+
+    case D3D11_SRV_DIMENSION_TEXTURECUBEARRAY:
+      return expand(desc.TextureCubeArray.MostDetailedMip, desc.TextureCubeArray.MipLevels);
+
+    default:
+      return false;
+  }
+}
+
+}
+
+#endif
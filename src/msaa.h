@@ -0,0 +1,120 @@
+#ifndef MSAA_H
+#define MSAA_H
+
+#include <cstdint>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Caps a sample count
+ *
+ * The quality level is reset, 0 is valid for every supported count.
+ *
+ * \returns \c true if the description was changed
+ */
+inline bool capSampleCount(DXGI_SAMPLE_DESC& desc, UINT maxSamples) {
+  if (desc.Count <= maxSamples) {
+    return false;
+  }
+
+  desc.Count = maxSamples;
+  desc.Quality = 0U;
+  return true;
+}
+
+/** Sample count of a 2D texture, 1 for anything else */
+inline UINT getSampleCount(ID3D11Resource* pResource) {
+  D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+  pResource->GetType(&dimension);
+
+  if (dimension != D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+    return 1U;
+  }
+
+  D3D11_TEXTURE2D_DESC desc = { };
+  static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+  return desc.SampleDesc.Count;
+}
+
+/**
+ * \brief Turns a multisampled view into a single-sampled one
+ *
+ * For textures whose sample count was capped to 1. Returns \c false
+ * if the view is not multisampled.
+ */
+inline bool demoteView(D3D11_RENDER_TARGET_VIEW_DESC& desc) {
+  if (desc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2DMS) {
+    desc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+    desc.Texture2D.MipSlice = 0U;
+    return true;
+  }
+
+  if (desc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2DMSARRAY) {
+    const D3D11_TEX2DMS_ARRAY_RTV array = desc.Texture2DMSArray;
+    desc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2DARRAY;
+    desc.Texture2DArray = { 0U, array.FirstArraySlice, array.ArraySize };
+    return true;
+  }
+
+  return false;
+}
+
+inline bool demoteView(D3D11_DEPTH_STENCIL_VIEW_DESC& desc) {
+  if (desc.ViewDimension == D3D11_DSV_DIMENSION_TEXTURE2DMS) {
+    desc.ViewDimension = D3D11_DSV_DIMENSION_TEXTURE2D;
+    desc.Texture2D.MipSlice = 0U;
+    return true;
+  }
+
+  if (desc.ViewDimension == D3D11_DSV_DIMENSION_TEXTURE2DMSARRAY) {
+    const D3D11_TEX2DMS_ARRAY_DSV array = desc.Texture2DMSArray;
+    desc.ViewDimension = D3D11_DSV_DIMENSION_TEXTURE2DARRAY;
+    desc.Texture2DArray = { 0U, array.FirstArraySlice, array.ArraySize };
+    return true;
+  }
+
+  return false;
+}
+
+inline bool demoteView(D3D11_SHADER_RESOURCE_VIEW_DESC& desc) {
+  if (desc.ViewDimension == D3D11_SRV_DIMENSION_TEXTURE2DMS) {
+    desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    desc.Texture2D = { 0U, 1U };
+    return true;
+  }
+
+  if (desc.ViewDimension == D3D11_SRV_DIMENSION_TEXTURE2DMSARRAY) {
+    const D3D11_TEX2DMS_ARRAY_SRV array = desc.Texture2DMSArray;
+    desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+    desc.Texture2DArray = { 0U, 1U, array.FirstArraySlice, array.ArraySize };
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * \brief Matches a view description to a capped resource
+ *
+ * \returns \c pDesc, or \c copy if the view had to be demoted
+ */
+template<typename Desc>
+const Desc* demoteViewDesc(ID3D11Resource* pResource, const Desc* pDesc, Desc& copy) {
+  if (!pDesc || !pResource) {
+    return pDesc;
+  }
+
+  copy = *pDesc;
+
+  if (!demoteView(copy) || getSampleCount(pResource) > 1U) {
+    return pDesc;
+  }
+
+  return &copy;
+}
+
+}
+
+#endif
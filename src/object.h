@@ -0,0 +1,83 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <atomic>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Refcounted object attached to D3D11 objects
+ *
+ * Set as private data interface, so that it is destroyed together
+ * with the object it describes. Only exposes IUnknown.
+ */
+class PrivateObject : public IUnknown {
+
+public:
+
+  PrivateObject() = default;
+  virtual ~PrivateObject() = default;
+
+  PrivateObject(const PrivateObject&) = delete;
+  PrivateObject& operator = (const PrivateObject&) = delete;
+
+  /** Attaches a new object and drops our own reference to it */
+  static void attach(ID3D11DeviceChild* pObject, REFGUID guid, PrivateObject* pData) {
+    pObject->SetPrivateDataInterface(guid, pData);
+    pData->Release();
+  }
+
+  /** Object attached under \c guid, if any. The caller must release it. */
+  template<typename T>
+  static T* get(ID3D11DeviceChild* pObject, REFGUID guid) {
+    IUnknown* data = nullptr;
+    UINT size = sizeof(data);
+
+    if (!pObject || FAILED(pObject->GetPrivateData(guid, &size, &data))) {
+      return nullptr;
+    }
+
+    return static_cast<T*>(data);
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override {
+    if (!ppvObject) {
+      return E_INVALIDARG;
+    }
+
+    *ppvObject = nullptr;
+
+    if (riid == __uuidof(IUnknown)) {
+      AddRef();
+      *ppvObject = this;
+      return S_OK;
+    }
+
+    return E_NOINTERFACE;
+  }
+
+  ULONG STDMETHODCALLTYPE AddRef() override {
+    return ++m_refCount;
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override {
+    const ULONG refCount = --m_refCount;
+
+    if (!refCount) {
+      delete this;
+    }
+
+    return refCount;
+  }
+
+private:
+
+  std::atomic<ULONG> m_refCount = { 1U };
+
+};
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include <d3d11.h>
+
+#include "profiler.h"
+
+namespace atfix {
+
+/**
+ * \brief Per-frame budget for particle draws
+ *
+ * Particle draws beyond the current limit are dropped, instanced
+ * ones keep OverBudgetPercent of their instances instead. The limit
+ * starts at the maximum and follows the GPU time of particle draws,
+ * measured with a GpuTimer: it shrinks by a quarter while a resolved
+ * frame is over the time budget and grows back slowly while it is
+ * well below. Results lag GpuTimer FrameCount frames behind.
+ */
+class ParticleBudget {
+
+public:
+
+  static constexpr UINT OverBudgetPercent = 25U;
+
+  ParticleBudget(uint32_t maxDraws, uint32_t minDraws, double budgetMs)
+  : m_maxDraws(maxDraws), m_minDraws(minDraws), m_budgetMs(budgetMs), m_limit(maxDraws) { }
+
+  /**
+   * \brief Admits a particle draw
+   *
+   * \param [in,out] pInstanceCount Instance count of instanced draws, or null
+   * \returns \c false if the draw is dropped
+   */
+  bool admit(UINT* pInstanceCount) {
+    if (m_draws++ < m_limit) {
+      return true;
+    }
+
+    if (!pInstanceCount || *pInstanceCount <= 1U) {
+      return false;
+    }
+
+    *pInstanceCount = std::max(*pInstanceCount * OverBudgetPercent / 100U, 1U);
+    return true;
+  }
+
+  /** Times runs of particle draws, call before every immediate draw */
+  void draw(ID3D11DeviceContext* pContext, bool particle, uint32_t pass) {
+    m_timer.draw(pContext, particle ? 1U : 0U, pass);
+  }
+
+  /** \param [in] createProc Creates driver queries, see GpuTimer */
+  template<typename Create>
+  void present(ID3D11DeviceContext* pContext, Create&& createProc) {
+    m_timer.present(pContext, 0U, createProc, *this);
+    m_draws = 0U;
+  }
+
+  /** GPU time of particle draws in the last resolved frame */
+  double lastMs() const { return m_lastMs; }
+
+  void addSample(uint32_t key, uint32_t, double ms) {
+    if (key) {
+      m_frameMs += ms;
+    }
+  }
+
+  void addFrame(uint32_t) {
+    m_lastMs = m_frameMs;
+    m_frameMs = 0.0;
+
+    if (m_lastMs > m_budgetMs) {
+      m_limit = std::max(m_limit - m_limit / 4U, m_minDraws);
+    } else if (m_lastMs < m_budgetMs * 0.75) {
+      m_limit = std::min(m_limit + std::max(m_maxDraws / 32U, 1U), m_maxDraws);
+    }
+  }
+
+  void dropFrame() {
+    m_frameMs = 0.0;
+  }
+
+private:
+
+  uint32_t        m_maxDraws;
+  uint32_t        m_minDraws;
+  double          m_budgetMs;
+
+  GpuTimer<256U>  m_timer;
+  uint32_t        m_limit;
+  uint32_t        m_draws = 0U;
+  double          m_frameMs = 0.0;
+  double          m_lastMs = 0.0;
+
+};
+
+}
+
+#endif
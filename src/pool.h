@@ -0,0 +1,129 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Worker threads for load-time processing
+ *
+ * Runs the items of one job in parallel and returns once all of
+ * them are done. The calling thread works on the job as well. Jobs
+ * from different threads run one after another. Threads are started
+ * on the first job with more than one item and detached, since
+ * joining them while the DLL unloads would deadlock.
+ */
+class WorkerPool {
+
+public:
+
+  WorkerPool() = default;
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator = (const WorkerPool&) = delete;
+
+  /** Calls \c fn for every index from 0 to \c count - 1 */
+  void run(uint32_t count, const std::function<void (uint32_t)>& fn) {
+    if (count <= 1U) {
+      for (uint32_t i = 0U; i < count; i++) {
+        fn(i);
+      }
+
+      return;
+    }
+
+    const std::lock_guard runLock(m_runMutex);
+    start();
+
+    {
+      std::unique_lock lock(m_mutex);
+      m_idle.wait(lock, [&] { return !m_busy; });
+
+      m_job = &fn;
+      m_count = count;
+      m_next = 0U;
+      m_generation++;
+    }
+
+    m_wake.notify_all();
+    drain(fn, count);
+
+    std::unique_lock lock(m_mutex);
+    m_idle.wait(lock, [&] { return !m_busy; });
+    m_job = nullptr;
+  }
+
+private:
+
+  void start() {
+    if (m_started) {
+      return;
+    }
+
+    m_started = true;
+
+    const uint32_t threads = std::max(std::thread::hardware_concurrency(), 2U) - 1U;
+
+    for (uint32_t i = 0U; i < threads; i++) {
+      std::thread([this] { work(); }).detach();
+    }
+  }
+
+  void drain(const std::function<void (uint32_t)>& fn, uint32_t count) {
+    for (uint32_t i = m_next++; i < count; i = m_next++) {
+      fn(i);
+    }
+  }
+
+  void work() {
+    uint64_t generation = 0U;
+
+    while (true) {
+      std::unique_lock lock(m_mutex);
+      m_wake.wait(lock, [&] { return m_generation != generation; });
+      generation = m_generation;
+
+      if (!m_job) {
+        continue;
+      }
+
+      const auto* job = m_job;
+      const uint32_t count = m_count;
+      m_busy++;
+      lock.unlock();
+
+      drain(*job, count);
+
+      lock.lock();
+
+      if (!--m_busy) {
+        m_idle.notify_all();
+      }
+    }
+  }
+
+  mutex                                     m_runMutex;
+  mutex                                     m_mutex;
+  condition_variable                        m_wake;
+  condition_variable                        m_idle;
+  bool                                      m_started = false;
+
+  const std::function<void (uint32_t)>*     m_job = nullptr;
+  uint32_t                                  m_count = 0U;
+  std::atomic<uint32_t>                     m_next = { 0U };
+  uint32_t                                  m_busy = 0U;
+  uint64_t                                  m_generation = 0U;
+
+};
+
+}
+
+#endif
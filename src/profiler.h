@@ -0,0 +1,282 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+
+#include <d3d11.h>
+
+#include "tag.h"
+
+namespace atfix {
+
+/**
+ * \brief Pooled GPU timestamp queries
+ *
+ * Brackets runs of draws that share a key and pass with timestamp
+ * queries. Each sample covers the time between its own timestamp
+ * and the next one.
+ *
+ * Query sets are kept for FrameCount frames and resolved right
+ * before reuse without flushing. Frames whose results are not
+ * ready by then, or that report a disjoint interval, are dropped.
+ * Resolved samples are handed to a sink that provides
+ * \c addSample(key, pass, ms), \c addFrame(tag) and \c dropFrame().
+ *
+ * \tparam MaxSamples Timestamps per frame, sized for the user since
+ *    all of them are created up front. Further samples are dropped.
+ */
+template<uint32_t MaxSamples>
+class GpuTimer {
+
+public:
+
+  static constexpr uint32_t FrameCount = 3U;
+
+  /** Starts a new sample if the key or pass changed */
+  void draw(ID3D11DeviceContext* pContext, uint32_t key, uint32_t pass) {
+    Frame& frame = m_frames[m_frame];
+
+    if (!frame.active || (key == m_key && pass == m_pass)) {
+      return;
+    }
+
+    if (frame.count + 1U < MaxSamples) {
+      mark(pContext, frame, key, pass);
+    }
+  }
+
+  /**
+   * \brief Ends the current frame and starts the next one
+   *
+   * \param [in] tag Value passed back to the sink with the frame
+   * \param [in] createProc Creates driver queries, must bypass the
+   *    CreateQuery hook since that one stubs out timestamp queries
+   */
+  template<typename Create, typename Sink>
+  void present(ID3D11DeviceContext* pContext, uint32_t tag, Create&& createProc, Sink& sink) {
+    Frame& frame = m_frames[m_frame];
+
+    if (frame.active) {
+      mark(pContext, frame, 0U, 0U);
+      pContext->End(frame.disjoint);
+    }
+
+    m_frame = (m_frame + 1U) % FrameCount;
+    Frame& next = m_frames[m_frame];
+
+    if (next.active) {
+      resolve(pContext, next, sink);
+      next.active = false;
+    }
+
+    if (!next.disjoint && !createQueries(next, createProc)) {
+      return;
+    }
+
+    next.count = 0U;
+    next.tag = tag;
+    next.active = true;
+    m_key = ~0U;
+    m_pass = ~0U;
+
+    pContext->Begin(next.disjoint);
+  }
+
+private:
+
+  struct Sample {
+    uint32_t key;
+    uint32_t pass;
+  };
+
+  struct Frame {
+    ID3D11Query*                            disjoint = nullptr;
+    std::array<ID3D11Query*, MaxSamples>    timestamps = { };
+    std::array<Sample, MaxSamples>          samples = { };
+    uint32_t                                count = 0U;
+    uint32_t                                tag = 0U;
+    bool                                    active = false;
+  };
+
+  /** Creates all queries of a frame, or none so that the next use tries again */
+  template<typename Create>
+  bool createQueries(Frame& frame, Create&& createProc) {
+    D3D11_QUERY_DESC desc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0U };
+
+    if (FAILED(createProc(&desc, &frame.disjoint))) {
+      frame.disjoint = nullptr;
+      return false;
+    }
+
+    desc.Query = D3D11_QUERY_TIMESTAMP;
+
+    for (auto& timestamp : frame.timestamps) {
+      if (FAILED(createProc(&desc, &timestamp))) {
+        timestamp = nullptr;
+        releaseQueries(frame);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static void releaseQueries(Frame& frame) {
+    for (auto& timestamp : frame.timestamps) {
+      if (timestamp) {
+        timestamp->Release();
+        timestamp = nullptr;
+      }
+    }
+
+    frame.disjoint->Release();
+    frame.disjoint = nullptr;
+  }
+
+  void mark(ID3D11DeviceContext* pContext, Frame& frame, uint32_t key, uint32_t pass) {
+    pContext->End(frame.timestamps[frame.count]);
+    frame.samples[frame.count] = { key, pass };
+    frame.count++;
+
+    m_key = key;
+    m_pass = pass;
+  }
+
+  template<typename Sink>
+  void resolve(ID3D11DeviceContext* pContext, const Frame& frame, Sink& sink) {
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint = { };
+
+    if (pContext->GetData(frame.disjoint, &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK
+     || disjoint.Disjoint || !disjoint.Frequency) {
+      sink.dropFrame();
+      return;
+    }
+
+    std::array<uint64_t, MaxSamples> ticks = { };
+
+    for (uint32_t i = 0U; i < frame.count; i++) {
+      if (pContext->GetData(frame.timestamps[i], &ticks[i], sizeof(uint64_t), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK) {
+        sink.dropFrame();
+        return;
+      }
+    }
+
+    const double scale = 1000.0 / static_cast<double>(disjoint.Frequency);
+
+    for (uint32_t i = 0U; i + 1U < frame.count; i++) {
+      const double ms = static_cast<double>(ticks[i + 1U] - ticks[i]) * scale;
+      sink.addSample(frame.samples[i].key, frame.samples[i].pass, ms);
+    }
+
+    sink.addFrame(frame.tag);
+  }
+
+  std::array<Frame, FrameCount> m_frames = { };
+  uint32_t                      m_frame = 0U;
+  uint32_t                      m_key = ~0U;
+  uint32_t                      m_pass = ~0U;
+
+};
+
+
+/**
+ * \brief GPU time per pixel shader hash and per pass
+ *
+ * Aggregates timer samples over ReportInterval frames and
+ * writes the average milliseconds per frame to a report.
+ */
+class GpuProfiler {
+
+public:
+
+  static constexpr uint32_t MaxPasses       = 256U;
+  static constexpr uint32_t ReportInterval  = 600U;
+
+  GpuProfiler(const char* filename)
+  : m_filename(filename) { }
+
+  void draw(ID3D11DeviceContext* pContext, uint32_t shader, uint32_t pass) {
+    m_timer.draw(pContext, shader, std::min(pass, MaxPasses - 1U));
+  }
+
+  template<typename Create>
+  void present(ID3D11DeviceContext* pContext, const ShaderTable& shaders, Create&& createProc) {
+    m_timer.present(pContext, 0U, createProc, *this);
+
+    if (m_resolved + m_dropped >= ReportInterval) {
+      report(shaders);
+    }
+  }
+
+  void addSample(uint32_t shader, uint32_t pass, double ms) {
+    m_shaderTime[shader] += ms;
+    m_passTime[pass] += ms;
+  }
+
+  void addFrame(uint32_t) {
+    m_resolved++;
+  }
+
+  void dropFrame() {
+    m_dropped++;
+  }
+
+private:
+
+  void report(const ShaderTable& shaders) {
+    std::ofstream file(m_filename, std::ios::out | std::ios::trunc);
+
+    file << "GPU time over " << m_resolved << " frames (" << m_dropped << " dropped)" << std::endl;
+
+    if (m_resolved) {
+      const double frames = static_cast<double>(m_resolved);
+
+      std::array<uint32_t, ShaderTable::MaxShaders> order = { };
+      std::iota(order.begin(), order.end(), 0U);
+      std::sort(order.begin(), order.end(), [this] (uint32_t a, uint32_t b) {
+        return m_shaderTime[a] > m_shaderTime[b];
+      });
+
+      file << std::endl << "ms/frame  pixel shader" << std::endl;
+
+      for (uint32_t index : order) {
+        if (m_shaderTime[index] <= 0.0) {
+          break;
+        }
+
+        file << std::fixed << std::setprecision(3) << std::setw(8) << m_shaderTime[index] / frames << "  "
+             << shaders.name(index) << std::endl;
+      }
+
+      file << std::endl << "ms/frame  pass" << std::endl;
+
+      for (uint32_t pass = 0U; pass < MaxPasses; pass++) {
+        if (m_passTime[pass] > 0.0) {
+          file << std::fixed << std::setprecision(3) << std::setw(8) << m_passTime[pass] / frames << "  " << pass << std::endl;
+        }
+      }
+    }
+
+    m_shaderTime = { };
+    m_passTime = { };
+    m_resolved = 0U;
+    m_dropped = 0U;
+  }
+
+  const char*                                   m_filename;
+  GpuTimer<1024U>                               m_timer;
+  uint32_t                                      m_resolved = 0U;
+  uint32_t                                      m_dropped = 0U;
+  std::array<double, ShaderTable::MaxShaders>   m_shaderTime = { };
+  std::array<double, MaxPasses>                 m_passTime = { };
+
+};
+
+}
+
+#endif
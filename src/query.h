@@ -0,0 +1,253 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Query wrapper handed out by the CreateQuery hook
+ *
+ * Timestamp and disjoint queries are never backed by a driver
+ * object, Begin/End are no-ops and GetData reports a disjoint
+ * interval so the game throws its measurement away.
+ *
+ * Occlusion queries and predicates own a small ring of driver
+ * queries. Every Begin/End pair goes to the next slot, and GetData
+ * hands out the newest result that is already available instead
+ * of waiting for the GPU to catch up with the current frame.
+ */
+class Query final : public ID3D11Predicate {
+
+public:
+
+  static constexpr uint32_t LatencyDepth = 3U;
+
+  Query(ID3D11Device* pDevice, const D3D11_QUERY_DESC& desc)
+  : m_device(pDevice), m_desc(desc) {
+    if (m_device) {
+      m_device->AddRef();
+    }
+  }
+
+  ~Query() {
+    for (auto* query : m_queries) {
+      if (query) {
+        query->Release();
+      }
+    }
+
+    if (m_device) {
+      m_device->Release();
+    }
+  }
+
+  Query(const Query&) = delete;
+  Query& operator = (const Query&) = delete;
+
+  static bool isStubType(D3D11_QUERY type) {
+    return type == D3D11_QUERY_TIMESTAMP
+        || type == D3D11_QUERY_TIMESTAMP_DISJOINT;
+  }
+
+  static bool isLatencyType(D3D11_QUERY type) {
+    return type == D3D11_QUERY_OCCLUSION
+        || type == D3D11_QUERY_OCCLUSION_PREDICATE;
+  }
+
+  /** Checks whether an async object was created by us */
+  static bool is(ID3D11Asynchronous* pAsync) {
+    static Query reference(nullptr, { D3D11_QUERY_TIMESTAMP, 0U });
+    return pAsync && *std::bit_cast<void* const*>(pAsync) == *std::bit_cast<void* const*>(&reference);
+  }
+
+  /** Sets the driver query backing ring slot \c index */
+  void setSlot(uint32_t index, ID3D11Query* pQuery) {
+    m_queries[index] = pQuery;
+  }
+
+  /** Driver predicate that was ended most recently */
+  ID3D11Predicate* getPredicate() const {
+    const uint32_t last = (m_next + LatencyDepth - 1U) % LatencyDepth;
+    return static_cast<ID3D11Predicate*>(m_queries[last]);
+  }
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override {
+    if (!ppvObject) {
+      return E_INVALIDARG;
+    }
+
+    *ppvObject = nullptr;
+
+    if (riid == __uuidof(IUnknown)
+     || riid == __uuidof(ID3D11DeviceChild)
+     || riid == __uuidof(ID3D11Asynchronous)
+     || riid == __uuidof(ID3D11Query)
+     || (riid == __uuidof(ID3D11Predicate) && m_desc.Query == D3D11_QUERY_OCCLUSION_PREDICATE)) {
+      AddRef();
+      *ppvObject = this;
+      return S_OK;
+    }
+
+    return E_NOINTERFACE;
+  }
+
+  ULONG STDMETHODCALLTYPE AddRef() override {
+    return ++m_refCount;
+  }
+
+  ULONG STDMETHODCALLTYPE Release() override {
+    const ULONG refCount = --m_refCount;
+
+    if (!refCount) {
+      delete this;
+    }
+
+    return refCount;
+  }
+
+  void STDMETHODCALLTYPE GetDevice(ID3D11Device** ppDevice) override {
+    if (m_device) {
+      m_device->AddRef();
+    }
+
+    *ppDevice = m_device;
+  }
+
+  HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID guid, UINT* pDataSize, void* pData) override {
+    return m_queries[0] ? m_queries[0]->GetPrivateData(guid, pDataSize, pData) : DXGI_ERROR_NOT_FOUND;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID guid, UINT DataSize, const void* pData) override {
+    return m_queries[0] ? m_queries[0]->SetPrivateData(guid, DataSize, pData) : S_OK;
+  }
+
+  HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID guid, const IUnknown* pData) override {
+    return m_queries[0] ? m_queries[0]->SetPrivateDataInterface(guid, pData) : S_OK;
+  }
+
+  UINT STDMETHODCALLTYPE GetDataSize() override {
+    switch (m_desc.Query) {
+      case D3D11_QUERY_TIMESTAMP:           return sizeof(UINT64);
+      case D3D11_QUERY_TIMESTAMP_DISJOINT:  return sizeof(D3D11_QUERY_DATA_TIMESTAMP_DISJOINT);
+      case D3D11_QUERY_OCCLUSION:           return sizeof(UINT64);
+      case D3D11_QUERY_OCCLUSION_PREDICATE: return sizeof(BOOL);
+      default:                              return 0U;
+    }
+  }
+
+  void STDMETHODCALLTYPE GetDesc(D3D11_QUERY_DESC* pDesc) override {
+    *pDesc = m_desc;
+  }
+
+  template<typename Begin>
+  void begin(Begin&& beginProc) {
+    if (m_queries[m_next]) {
+      beginProc(m_queries[m_next]);
+    }
+  }
+
+  template<typename End>
+  void end(End&& endProc) {
+    if (!m_queries[m_next]) {
+      return;
+    }
+
+    endProc(m_queries[m_next]);
+    m_pending |= 1U << m_next;
+    m_next = (m_next + 1U) % LatencyDepth;
+  }
+
+  /**
+   * \brief Returns query data without waiting on the GPU
+   *
+   * Polls all outstanding ring slots from oldest to newest and
+   * keeps the newest result. Only blocks (by forwarding the caller's
+   * flags) until the very first result for this query is available.
+   */
+  template<typename GetData>
+  HRESULT getData(void* pData, UINT DataSize, UINT GetDataFlags, GetData&& getDataProc) {
+    if (isStubType(m_desc.Query)) {
+      return getStubData(pData, DataSize);
+    }
+
+    for (uint32_t i = 0U; i < LatencyDepth; i++) {
+      const uint32_t slot = (m_next + i) % LatencyDepth;
+
+      if (!(m_pending & (1U << slot))) {
+        continue;
+      }
+
+      const bool newest = i + 1U == LatencyDepth;
+      const UINT flags = (m_hasResult || !newest) ? static_cast<UINT>(D3D11_ASYNC_GETDATA_DONOTFLUSH) : GetDataFlags;
+
+      uint64_t result = 0U;
+      const HRESULT hr = getDataProc(m_queries[slot], &result, GetDataSize(), flags);
+
+      if (hr == S_OK) {
+        m_result = result;
+        m_hasResult = true;
+        m_pending &= ~(1U << slot);
+      } else if (!m_hasResult && newest) {
+        return hr;
+      }
+    }
+
+    if (!m_hasResult) {
+      return S_FALSE;
+    }
+
+    if (pData && DataSize) {
+      if (DataSize != GetDataSize()) {
+        return E_INVALIDARG;
+      }
+
+      std::memcpy(pData, &m_result, DataSize);
+    }
+
+    return S_OK;
+  }
+
+private:
+
+  HRESULT getStubData(void* pData, UINT DataSize) {
+    if (!pData || !DataSize) {
+      return S_OK;
+    }
+
+    if (DataSize != GetDataSize()) {
+      return E_INVALIDARG;
+    }
+
+    if (m_desc.Query == D3D11_QUERY_TIMESTAMP_DISJOINT) {
+      D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint = { };
+      disjoint.Frequency = 1000000000U;
+      disjoint.Disjoint = TRUE;
+      std::memcpy(pData, &disjoint, sizeof(disjoint));
+    } else {
+      std::memset(pData, 0, DataSize);
+    }
+
+    return S_OK;
+  }
+
+  std::atomic<ULONG>                      m_refCount = { 1U };
+  ID3D11Device*                           m_device = nullptr;
+  D3D11_QUERY_DESC                        m_desc = { };
+  std::array<ID3D11Query*, LatencyDepth>  m_queries = { };
+  uint32_t                                m_next = 0U;
+  uint32_t                                m_pending = 0U;
+  uint64_t                                m_result = 0U;
+  bool                                    m_hasResult = false;
+
+};
+
+}
+
+#endif
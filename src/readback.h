@@ -0,0 +1,263 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include <d3d11.h>
+
+#include "formats.h"
+#include "object.h"
+
+namespace atfix {
+
+/** Private data GUID of the readback copies attached to staging resources */
+inline constexpr GUID ReadbackGuid = { 0x4e9a7c30, 0x6b15, 0x4f8d, { 0x92, 0x3a, 0xc5, 0x10, 0x6f, 0xe2, 0x74, 0xb8 } };
+
+/** Shape of a staging resource, buffers use width for the byte size */
+struct ReadbackShape {
+  D3D11_RESOURCE_DIMENSION  dimension;
+  UINT                      width;
+  UINT                      height;
+  DXGI_FORMAT               format;
+
+  bool operator == (const ReadbackShape&) const = default;
+
+  /** Shape of a buffer or 2D texture, \c false for other resources */
+  static bool get(ID3D11Resource* pResource, ReadbackShape& shape) {
+    shape = { };
+    pResource->GetType(&shape.dimension);
+
+    if (shape.dimension == D3D11_RESOURCE_DIMENSION_BUFFER) {
+      D3D11_BUFFER_DESC desc = { };
+      static_cast<ID3D11Buffer*>(pResource)->GetDesc(&desc);
+      shape.width = desc.ByteWidth;
+      shape.height = 1U;
+      return true;
+    }
+
+    if (shape.dimension == D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+      D3D11_TEXTURE2D_DESC desc = { };
+      static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+      shape.width = desc.Width;
+      shape.height = desc.Height;
+      shape.format = desc.Format;
+      return true;
+    }
+
+    return false;
+  }
+};
+
+
+/**
+ * \brief Log of read maps that had to wait for the GPU
+ *
+ * Writes each shape once, when it first blocks, in the form of a
+ * READBACK_ALLOWLIST entry. Only to be used on the immediate context.
+ */
+class ReadbackReport {
+
+public:
+
+  ReadbackReport(const char* filename)
+  : m_filename(filename) { }
+
+  void add(const ReadbackShape& shape, uint64_t frame) {
+    for (const auto& seen : m_shapes) {
+      if (seen == shape) {
+        return;
+      }
+    }
+
+    std::ofstream file(m_filename, std::ios::out | (m_shapes.empty() ? std::ios::trunc : std::ios::app));
+
+    if (m_shapes.empty()) {
+      file << "frame  dimension  width  height  format" << std::endl;
+    }
+
+    m_shapes.push_back(shape);
+
+    file << frame << "  " << (shape.dimension == D3D11_RESOURCE_DIMENSION_BUFFER ? "BUFFER" : "TEXTURE2D")
+         << "  " << shape.width << "  " << shape.height
+         << "  " << static_cast<uint32_t>(shape.format) << " (" << formatName(shape.format) << ")" << std::endl;
+  }
+
+private:
+
+  const char*                 m_filename;
+  std::vector<ReadbackShape>  m_shapes;
+
+};
+
+
+/**
+ * \brief Latency-shifted readback for a staging resource
+ *
+ * Copies into the game's staging resource are redirected to a ring
+ * of Depth private staging resources, each followed by an event
+ * query. A read map of the game's resource maps the newest copy
+ * that the GPU has already finished, so the game reads data that is
+ * one or two frames old instead of waiting for the GPU to drain.
+ *
+ * Writes to the game's resource that are not redirected make the
+ * copies stale until the next redirected copy. Copies recorded on
+ * deferred contexts take effect whenever the command list runs, so
+ * they disable the redirection for good.
+ *
+ * Only blocks if no copy has finished yet at all. Whenever the newest
+ * copy is not ready, the time until it becomes ready is accumulated
+ * as blocking time removed. It is measured at poll granularity, so
+ * it is an upper bound.
+ */
+class LatentReadback final : public PrivateObject {
+
+public:
+
+  static constexpr uint32_t Depth = 3U;
+
+  using Clock = std::chrono::steady_clock;
+
+  LatentReadback(const std::array<ID3D11Resource*, Depth>& copies, const std::array<ID3D11Query*, Depth>& events) {
+    for (uint32_t i = 0U; i < Depth; i++) {
+      m_slots[i].copy = copies[i];
+      m_slots[i].event = events[i];
+    }
+  }
+
+  ~LatentReadback() {
+    for (const auto& slot : m_slots) {
+      slot.copy->Release();
+      slot.event->Release();
+    }
+  }
+
+  static LatentReadback* get(ID3D11Resource* pResource) {
+    return PrivateObject::get<LatentReadback>(pResource, ReadbackGuid);
+  }
+
+  /**
+   * \brief Redirects a copy into the next slot
+   *
+   * \param [in] copyProc Records the copy into the given resource
+   * \param [in] endProc Ends the given event query
+   */
+  template<typename Copy, typename End>
+  void copy(Copy&& copyProc, End&& endProc) {
+    Slot& slot = m_slots[m_next];
+    copyProc(slot.copy);
+    endProc(slot.event);
+
+    slot.serial = ++m_serial;
+    slot.waitingSince = Clock::time_point();
+    m_next = (m_next + 1U) % Depth;
+  }
+
+  bool disabled() const {
+    return m_disabled;
+  }
+
+  /** Forgets all copies after a write to the game's resource */
+  void invalidate() {
+    for (auto& slot : m_slots) {
+      slot.serial = 0U;
+      slot.waitingSince = Clock::time_point();
+    }
+  }
+
+  /** Stops redirecting for good, may be called from any thread */
+  void disable() {
+    m_disabled = true;
+  }
+
+  /**
+   * \brief Picks the resource to map for a read
+   *
+   * \param [in] readyProc Polls an event query without flushing
+   * \param [out] ready Whether the returned copy has finished
+   * \returns Newest finished copy, the newest copy if none has
+   *    finished yet, or null if nothing was copied since the
+   *    last invalidation or the redirection is disabled
+   */
+  template<typename Ready>
+  ID3D11Resource* select(Ready&& readyProc, bool& ready) {
+    Slot* newest = nullptr;
+    Slot* finished = nullptr;
+
+    if (disabled()) {
+      return nullptr;
+    }
+
+    for (auto& slot : m_slots) {
+      if (!slot.serial) {
+        continue;
+      }
+
+      const bool done = readyProc(slot.event);
+
+      if (done && slot.waitingSince != Clock::time_point()) {
+        m_removed += Clock::now() - slot.waitingSince;
+        slot.waitingSince = Clock::time_point();
+      }
+
+      if (!newest || slot.serial > newest->serial) {
+        newest = &slot;
+      }
+
+      if (done && (!finished || slot.serial > finished->serial)) {
+        finished = &slot;
+      }
+    }
+
+    if (!newest) {
+      return nullptr;
+    }
+
+    if (finished != newest && newest->waitingSince == Clock::time_point()) {
+      newest->waitingSince = Clock::now();
+    }
+
+    ready = finished != nullptr;
+    m_mapped = finished ? finished : newest;
+    return m_mapped->copy;
+  }
+
+  /** Resource mapped by the last select, cleared on unmap */
+  ID3D11Resource* unmap() {
+    ID3D11Resource* resource = m_mapped ? m_mapped->copy : nullptr;
+    m_mapped = nullptr;
+    return resource;
+  }
+
+  /** Returns and resets the blocking time removed so far, in microseconds */
+  uint64_t takeRemovedUs() {
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(m_removed).count();
+    m_removed = Clock::duration::zero();
+    return static_cast<uint64_t>(us);
+  }
+
+private:
+
+  struct Slot {
+    ID3D11Resource*     copy = nullptr;
+    ID3D11Query*        event = nullptr;
+    uint64_t            serial = 0U;
+    Clock::time_point   waitingSince = { };
+  };
+
+  std::array<Slot, Depth>   m_slots = { };
+  Slot*                     m_mapped = nullptr;
+  uint32_t                  m_next = 0U;
+  uint64_t                  m_serial = 0U;
+  Clock::duration           m_removed = Clock::duration::zero();
+  std::atomic<bool>         m_disabled = { false };
+
+};
+
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef REDUCED_H
+#define REDUCED_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include <d3d11.h>
+
+#include "blit.h"
+
+namespace atfix {
+
+/** Samples the reduced target with bilinear filtering */
+inline constexpr char ReducedUpsampleHlsl[] = R"(
+Texture2D<float4> src : register(t0);
+SamplerState linearClamp : register(s0);
+
+float4 ps_main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+  return src.SampleLevel(linearClamp, uv, 0.0f);
+}
+)";
+
+/**
+ * \brief Blend modes a reduced pass can reproduce
+ *
+ * Draws into a target cleared to zero and composited once give the
+ * same result as drawing into the game's target directly only for
+ * additive blending, and for blending over the target with alpha
+ * accumulated as premultiplied coverage.
+ */
+enum class ReducedBlend : uint32_t {
+  Incompatible,
+  Additive,
+  Over,
+};
+
+/**
+ * \brief Renders selected passes at reduced resolution
+ *
+ * While active, draws go to an intermediate target that is 1/divisor
+ * the size of the game's render target, without depth buffer and
+ * with the game's blend state. When the pass ends, the intermediate
+ * target is upsampled onto the game's target with a blend state that
+ * applies the accumulated result, see ReducedBlend. Passes whose
+ * blend mode does not allow this stay at full resolution, and the
+ * caller ends the pass when the blend mode changes.
+ *
+ * The upsampling shaders are compiled from embedded HLSL at first
+ * use, see compileHlsl.
+ */
+class ReducedPass {
+
+public:
+
+  static constexpr uint32_t MaxTargets = 4U;
+
+  ReducedPass() = default;
+
+  ~ReducedPass() {
+    for (auto& target : m_targets) {
+      releaseRef(target.srv);
+      releaseRef(target.rtv);
+      releaseRef(target.texture);
+    }
+
+    releaseRef(m_overBlend);
+    releaseRef(m_sampler);
+    releaseRef(m_ps);
+    releaseRef(m_vs);
+  }
+
+  ReducedPass(const ReducedPass&) = delete;
+  ReducedPass& operator = (const ReducedPass&) = delete;
+
+  bool active() const {
+    return m_active != nullptr;
+  }
+
+  /** Classifies the game's blend state for render target 0 */
+  static ReducedBlend classify(ID3D11BlendState* pBlendState) {
+    if (!pBlendState) {
+      return ReducedBlend::Incompatible;
+    }
+
+    D3D11_BLEND_DESC desc = { };
+    pBlendState->GetDesc(&desc);
+
+    const D3D11_RENDER_TARGET_BLEND_DESC& rt = desc.RenderTarget[0];
+
+    if (desc.AlphaToCoverageEnable || !rt.BlendEnable
+     || rt.BlendOp != D3D11_BLEND_OP_ADD || rt.BlendOpAlpha != D3D11_BLEND_OP_ADD) {
+      return ReducedBlend::Incompatible;
+    }
+
+    /* Alpha either accumulates too or is left alone */
+    if (rt.SrcBlend == D3D11_BLEND_ONE && rt.DestBlend == D3D11_BLEND_ONE
+     && (rt.SrcBlendAlpha == D3D11_BLEND_ONE || rt.SrcBlendAlpha == D3D11_BLEND_ZERO)
+     && rt.DestBlendAlpha == D3D11_BLEND_ONE) {
+      return ReducedBlend::Additive;
+    }
+
+    /* Color may be premultiplied or not, alpha must be coverage */
+    if ((rt.SrcBlend == D3D11_BLEND_ONE || rt.SrcBlend == D3D11_BLEND_SRC_ALPHA)
+     && rt.DestBlend == D3D11_BLEND_INV_SRC_ALPHA
+     && rt.SrcBlendAlpha == D3D11_BLEND_ONE && rt.DestBlendAlpha == D3D11_BLEND_INV_SRC_ALPHA
+     && rt.RenderTargetWriteMask == D3D11_COLOR_WRITE_ENABLE_ALL) {
+      return ReducedBlend::Over;
+    }
+
+    return ReducedBlend::Incompatible;
+  }
+
+  /**
+   * \brief Compiles the upsampling shaders, once
+   *
+   * \param [in] createVs Creates a vertex shader from bytecode and length
+   * \param [in] createPs Creates a pixel shader from bytecode and length
+   * \param [in] createSampler Creates a sampler state from a description
+   * \param [in] createBlend Creates a blend state from a description
+   */
+  template<typename CreateVs, typename CreatePs, typename CreateSampler, typename CreateBlend>
+  bool init(CreateVs&& createVs, CreatePs&& createPs, CreateSampler&& createSampler, CreateBlend&& createBlend) {
+    if (m_initDone) {
+      return m_vs != nullptr;
+    }
+
+    m_initDone = true;
+
+    ID3DBlob* vsBlob = compileHlsl(FullscreenVsHlsl, "vs_main", "vs_4_0");
+    ID3DBlob* psBlob = compileHlsl(ReducedUpsampleHlsl, "ps_main", "ps_4_0");
+
+    if (vsBlob && psBlob) {
+      const D3D11_SAMPLER_DESC desc = linearClampSamplerDesc();
+
+      /* Premultiplied over, applies what ReducedBlend::Over accumulated */
+      D3D11_BLEND_DESC blendDesc = { };
+      blendDesc.RenderTarget[0].BlendEnable = TRUE;
+      blendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND_ONE;
+      blendDesc.RenderTarget[0].DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
+      blendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
+      blendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ONE;
+      blendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND_INV_SRC_ALPHA;
+      blendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP_ADD;
+      blendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+
+      if (FAILED(createVs(vsBlob->GetBufferPointer(), vsBlob->GetBufferSize(), &m_vs))
+       || FAILED(createPs(psBlob->GetBufferPointer(), psBlob->GetBufferSize(), &m_ps))
+       || FAILED(createSampler(&desc, &m_sampler))
+       || FAILED(createBlend(&blendDesc, &m_overBlend))) {
+        releaseRef(m_overBlend);
+        releaseRef(m_sampler);
+        releaseRef(m_ps);
+        releaseRef(m_vs);
+      }
+    }
+
+    releaseRef(psBlob);
+    releaseRef(vsBlob);
+    return m_vs != nullptr;
+  }
+
+  /**
+   * \brief Redirects the game's render target to a reduced target
+   *
+   * Only passes with a single, single-sampled 2D render target and
+   * a compatible blend mode are redirected. The game's render targets
+   * and blend state are kept alive until end.
+   *
+   * \param [in] createTexture Creates a 2D texture from a description
+   * \returns \c false if the pass stays at full resolution
+   */
+  template<typename Procs, typename Create>
+  bool begin(ID3D11DeviceContext* pContext, const Procs* procs, ID3D11Device* pDevice,
+          ID3D11RenderTargetView* pRtv, ID3D11DepthStencilView* pDsv, ReducedBlend blend, UINT divisor, Create&& createTexture) {
+    if (!m_vs || !pRtv || blend == ReducedBlend::Incompatible) {
+      return false;
+    }
+
+    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = { };
+    pRtv->GetDesc(&rtvDesc);
+
+    if (rtvDesc.ViewDimension != D3D11_RTV_DIMENSION_TEXTURE2D) {
+      return false;
+    }
+
+    ID3D11Resource* resource = nullptr;
+    pRtv->GetResource(&resource);
+
+    D3D11_TEXTURE2D_DESC desc = { };
+    static_cast<ID3D11Texture2D*>(resource)->GetDesc(&desc);
+    resource->Release();
+
+    const UINT mip = rtvDesc.Texture2D.MipSlice;
+    m_width = std::max(desc.Width >> mip, 1U);
+    m_height = std::max(desc.Height >> mip, 1U);
+
+    Target* target = getTarget(pDevice, std::max(m_width / divisor, 1U), std::max(m_height / divisor, 1U), rtvDesc.Format, createTexture);
+
+    if (!target) {
+      return false;
+    }
+
+    pRtv->AddRef();
+    m_gameRtv = pRtv;
+
+    if (pDsv) {
+      pDsv->AddRef();
+    }
+
+    m_gameDsv = pDsv;
+    m_active = target;
+    m_blendClass = blend;
+    pContext->OMGetBlendState(&m_blend, m_blendFactor.data(), &m_sampleMask);
+
+    static constexpr std::array<FLOAT, 4> Black = { };
+    pContext->ClearRenderTargetView(target->rtv, Black.data());
+    procs->OMSetRenderTargets(pContext, 1U, &target->rtv, nullptr);
+    return true;
+  }
+
+  /**
+   * \brief Upsamples the reduced target onto the game's target
+   *
+   * Additive passes are composited with the game's blend state as
+   * it was at begin, others with premultiplied over. Restores all
+   * state it touches, except for viewports, which the caller
+   * re-applies. The composite blend state is set through the
+   * original proc so that it is not tracked as the game's.
+   */
+  template<typename Procs>
+  void end(ID3D11DeviceContext* pContext, const Procs* procs) {
+    if (!m_active) {
+      return;
+    }
+
+    BlitState saved(pContext);
+
+    const D3D11_VIEWPORT viewport = { 0.0f, 0.0f, static_cast<FLOAT>(m_width), static_cast<FLOAT>(m_height), 0.0f, 1.0f };
+
+    procs->OMSetRenderTargets(pContext, 1U, &m_gameRtv, nullptr);
+    procs->RSSetViewports(pContext, 1U, &viewport);
+
+    if (m_blendClass == ReducedBlend::Additive) {
+      procs->OMSetBlendState(pContext, m_blend, m_blendFactor.data(), m_sampleMask);
+    } else {
+      procs->OMSetBlendState(pContext, m_overBlend, nullptr, 0xFFFFFFFFU);
+    }
+
+    BlitState::draw(pContext, procs, m_vs, m_ps, m_active->srv, m_sampler);
+
+    procs->OMSetRenderTargets(pContext, 1U, &m_gameRtv, m_gameDsv);
+    saved.restore(pContext, procs);
+
+    releaseRef(m_blend);
+    m_blendClass = ReducedBlend::Incompatible;
+    releaseRef(m_gameRtv);
+    releaseRef(m_gameDsv);
+    m_active = nullptr;
+  }
+
+private:
+
+  struct Target {
+    ID3D11Texture2D*            texture = nullptr;
+    ID3D11RenderTargetView*     rtv = nullptr;
+    ID3D11ShaderResourceView*   srv = nullptr;
+    UINT                        width = 0U;
+    UINT                        height = 0U;
+    DXGI_FORMAT                 format = DXGI_FORMAT_UNKNOWN;
+  };
+
+  template<typename Create>
+  Target* getTarget(ID3D11Device* pDevice, UINT width, UINT height, DXGI_FORMAT format, Create&& createTexture) {
+    for (auto& target : m_targets) {
+      if (target.texture && target.width == width && target.height == height && target.format == format) {
+        return &target;
+      }
+    }
+
+    /* Evict round-robin, targets only change on resize */
+    Target& target = m_targets[m_nextTarget];
+    m_nextTarget = (m_nextTarget + 1U) % MaxTargets;
+
+    releaseRef(target.srv);
+    releaseRef(target.rtv);
+    releaseRef(target.texture);
+
+    D3D11_TEXTURE2D_DESC desc = { };
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1U;
+    desc.ArraySize = 1U;
+    desc.Format = format;
+    desc.SampleDesc.Count = 1U;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+
+    if (FAILED(createTexture(&desc, &target.texture))
+     || FAILED(pDevice->CreateRenderTargetView(target.texture, nullptr, &target.rtv))
+     || FAILED(pDevice->CreateShaderResourceView(target.texture, nullptr, &target.srv))) {
+      releaseRef(target.srv);
+      releaseRef(target.rtv);
+      releaseRef(target.texture);
+      return nullptr;
+    }
+
+    target.width = width;
+    target.height = height;
+    target.format = format;
+    return &target;
+  }
+
+  bool                                  m_initDone = false;
+  ID3D11VertexShader*                   m_vs = nullptr;
+  ID3D11PixelShader*                    m_ps = nullptr;
+  ID3D11SamplerState*                   m_sampler = nullptr;
+  ID3D11BlendState*                     m_overBlend = nullptr;
+
+  std::array<Target, MaxTargets>        m_targets = { };
+  uint32_t                              m_nextTarget = 0U;
+
+  Target*                               m_active = nullptr;
+  ID3D11RenderTargetView*               m_gameRtv = nullptr;
+  ID3D11DepthStencilView*               m_gameDsv = nullptr;
+  UINT                                  m_width = 0U;
+  UINT                                  m_height = 0U;
+
+  ReducedBlend                          m_blendClass = ReducedBlend::Incompatible;
+  ID3D11BlendState*                     m_blend = nullptr;
+  std::array<FLOAT, 4>                  m_blendFactor = { };
+  UINT                                  m_sampleMask = 0xFFFFFFFFU;
+
+};
+
+}
+
+#endif
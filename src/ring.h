@@ -0,0 +1,221 @@
+#ifndef RING_H
+#define RING_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <d3d11.h>
+
+#include "object.h"
+
+namespace atfix {
+
+/** Private data GUID of the ring slice attached to dynamic buffers */
+inline constexpr GUID RingSliceGuid = { 0x8f4d2b61, 0x93a0, 0x4e57, { 0xb1, 0x6c, 0x02, 0x7e, 0xd9, 0x45, 0xa8, 0x3c } };
+
+/**
+ * \brief Dynamic buffer sub-allocated with NO_OVERWRITE maps
+ *
+ * Positions are monotonic byte counts, the offset into the buffer
+ * is the position modulo the ring size. Allocations never straddle
+ * the end of the buffer.
+ *
+ * At the end of every frame an event query fences the current head.
+ * Space behind a fence is reused once the query signals, an
+ * allocation that would overwrite data the GPU may still read fails
+ * instead of waiting.
+ */
+class UploadRing {
+
+public:
+
+  static constexpr uint32_t MaxFences = 8U;
+
+  template<typename Create>
+  bool init(UINT size, UINT bindFlags, Create&& createProc) {
+    D3D11_BUFFER_DESC desc = { };
+    desc.ByteWidth = size;
+    desc.Usage = D3D11_USAGE_DYNAMIC;
+    desc.BindFlags = bindFlags;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+    if (FAILED(createProc(&desc, &m_buffer))) {
+      m_buffer = nullptr;
+      return false;
+    }
+
+    m_size = size;
+    return true;
+  }
+
+  ID3D11Buffer* buffer() const {
+    return m_buffer;
+  }
+
+  /**
+   * \brief Reserves space in the ring
+   *
+   * \param [in] size Allocation size, already aligned
+   * \param [in] align Offset alignment
+   * \param [out] offset Byte offset into the ring buffer
+   * \returns \c false if the ring is full
+   */
+  bool allocate(ID3D11DeviceContext* pContext, UINT size, UINT align, UINT& offset) {
+    if (!m_buffer || size > m_size / 4U) {
+      return false;
+    }
+
+    for (uint32_t attempt = 0U; attempt < 2U; attempt++) {
+      uint64_t head = (m_head + align - 1U) / align * align;
+      uint64_t phys = head % m_size;
+
+      if (phys + size > m_size) {
+        head += m_size - phys;
+        phys = 0U;
+      }
+
+      if (head + size - m_tail <= m_size) {
+        offset = static_cast<UINT>(phys);
+        m_head = head + size;
+        return true;
+      }
+
+      retire(pContext);
+    }
+
+    return false;
+  }
+
+  /** Maps the ring without overwriting data in flight, nests */
+  template<typename Map>
+  uint8_t* map(Map&& mapProc) {
+    if (!m_mapCount) {
+      D3D11_MAPPED_SUBRESOURCE mapped = { };
+
+      if (FAILED(mapProc(m_buffer, &mapped))) {
+        return nullptr;
+      }
+
+      m_mapped = static_cast<uint8_t*>(mapped.pData);
+    }
+
+    m_mapCount++;
+    return m_mapped;
+  }
+
+  template<typename Unmap>
+  void unmap(Unmap&& unmapProc) {
+    if (m_mapCount && !--m_mapCount) {
+      unmapProc(m_buffer);
+      m_mapped = nullptr;
+    }
+  }
+
+  /**
+   * \brief Fences everything allocated during the frame
+   *
+   * \param [in] createProc Creates event queries
+   */
+  template<typename Create>
+  void present(ID3D11DeviceContext* pContext, Create&& createProc) {
+    if (!m_buffer || m_head == m_fenced) {
+      return;
+    }
+
+    retire(pContext);
+
+    if (m_count == MaxFences) {
+      /* Re-ending the newest query moves its fence forward */
+      Fence& newest = m_fences[(m_first + m_count - 1U) % MaxFences];
+      pContext->End(newest.query);
+      newest.end = m_head;
+    } else {
+      Fence& fence = m_fences[(m_first + m_count) % MaxFences];
+      D3D11_QUERY_DESC desc = { D3D11_QUERY_EVENT, 0U };
+
+      if (!fence.query && FAILED(createProc(&desc, &fence.query))) {
+        fence.query = nullptr;
+        return;
+      }
+
+      pContext->End(fence.query);
+      fence.end = m_head;
+      m_count++;
+    }
+
+    m_fenced = m_head;
+  }
+
+private:
+
+  struct Fence {
+    ID3D11Query*  query = nullptr;
+    uint64_t      end = 0U;
+  };
+
+  void retire(ID3D11DeviceContext* pContext) {
+    while (m_count) {
+      const Fence& oldest = m_fences[m_first];
+
+      if (pContext->GetData(oldest.query, nullptr, 0U, D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK) {
+        break;
+      }
+
+      m_tail = oldest.end;
+      m_first = (m_first + 1U) % MaxFences;
+      m_count--;
+    }
+  }
+
+  ID3D11Buffer*                   m_buffer = nullptr;
+  uint64_t                        m_size = 0U;
+  uint64_t                        m_head = 0U;
+  uint64_t                        m_tail = 0U;
+  uint64_t                        m_fenced = 0U;
+  std::array<Fence, MaxFences>    m_fences = { };
+  uint32_t                        m_first = 0U;
+  uint32_t                        m_count = 0U;
+  uint8_t*                        m_mapped = nullptr;
+  uint32_t                        m_mapCount = 0U;
+
+};
+
+
+/**
+ * \brief Ring placement of a game buffer
+ *
+ * Attached to dynamic buffers that are backed by an upload ring.
+ * While valid, binds of the game buffer on every stage and copies
+ * from it are redirected to the ring at \c offset. Invalid slices
+ * fall back to the game buffer.
+ *
+ * Uses on deferred contexts cannot follow the slice, since their
+ * command lists run later. They pin the buffer, which then leaves
+ * the ring at its next map and stays out of it.
+ */
+class RingSlice final : public PrivateObject {
+
+public:
+
+  RingSlice(UploadRing* pRing, UINT sliceSize, UINT sliceAlign)
+  : ring(pRing), size(sliceSize), align(sliceAlign) { }
+
+  static RingSlice* get(ID3D11Resource* pResource) {
+    return PrivateObject::get<RingSlice>(pResource, RingSliceGuid);
+  }
+
+  UploadRing* ring;
+  UINT        size;
+  UINT        align;
+  UINT        offset = 0U;
+  bool        valid = false;
+  bool        mapped = false;
+  bool        moved = false;
+  std::atomic<bool> pinned = { false };
+
+};
+
+}
+
+#endif
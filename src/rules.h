@@ -0,0 +1,96 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include <d3d11.h>
+
+#include "tag.h"
+
+namespace atfix {
+
+/** Draw rule actions */
+constexpr uint32_t RULE_REPLACE_PS  = (1U << 0);
+constexpr uint32_t RULE_REPLACE_VS  = (1U << 1);
+constexpr uint32_t RULE_SKIP_DRAW   = (1U << 2);
+constexpr uint32_t RULE_REDUCE      = (1U << 3);
+
+/**
+ * \brief Index-buffer-triggered draw rule
+ *
+ * Matches index buffers by the fingerprint of their description.
+ * The optional shader hashes restrict the rule to draws with that
+ * VS or PS bound, an all-zero hash matches any shader.
+ *
+ * Shader replacements are applied when the index buffer is bound,
+ * skips and index count reductions to every indexed draw while the
+ * buffer stays bound. Reductions keep \c indexPercent of the indices,
+ * rounded down to whole triangles.
+ */
+struct DrawRule {
+  uint64_t            fingerprint;
+  ShaderTable::Hash   vs;
+  ShaderTable::Hash   ps;
+  uint32_t            actions;
+  uint32_t            indexPercent;
+
+  bool matches(const ShaderTable& shaders, uint32_t vsIndex, uint32_t psIndex) const {
+    return matchesHash(vs, shaders.hash(vsIndex))
+        && matchesHash(ps, shaders.hash(psIndex));
+  }
+
+  UINT reduce(UINT count) const {
+    const UINT reduced = static_cast<UINT>(static_cast<uint64_t>(count) * indexPercent / 100U);
+    return reduced - reduced % 3U;
+  }
+
+private:
+
+  static bool matchesHash(const ShaderTable::Hash& expected, const ShaderTable::Hash& bound) {
+    return expected == ShaderTable::Hash() || expected == bound;
+  }
+
+};
+
+/**
+ * \brief CRC of a buffer description
+ *
+ * The description is zero-padded to four qwords, which is what the
+ * fingerprints in the rule table were taken from.
+ */
+inline uint64_t bufferFingerprint(const D3D11_BUFFER_DESC& desc) {
+  std::array<uint64_t, 4> qwords = { };
+  std::memcpy(qwords.data(), &desc, sizeof(desc));
+
+  uint64_t crc = 0U;
+
+  for (uint64_t qword : qwords) {
+    crc = __builtin_ia32_crc32di(crc, qword);
+  }
+
+  return crc;
+}
+
+/**
+ * \brief Looks up the rule for a buffer fingerprint
+ *
+ * Only runs at buffer creation, the result is stored in the
+ * buffer's tag. At most one rule per fingerprint is supported.
+ * \returns One-based rule index, or 0 if no rule matches
+ */
+template<size_t N>
+uint32_t findDrawRule(const std::array<DrawRule, N>& rules, uint64_t fingerprint) {
+  for (uint32_t i = 0U; i < N; i++) {
+    if (rules[i].fingerprint == fingerprint) {
+      return i + 1U;
+    }
+  }
+
+  return 0U;
+}
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SAMPLERS_H
+#define SAMPLERS_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Sampler limits of a quality tier
+ *
+ * Anisotropy above \c maxAnisotropy is clamped, a limit of 1 turns
+ * anisotropic filtering into trilinear. The LOD bias is added to
+ * samplers with a linear or anisotropic minification filter only,
+ * point samplers are usually data lookups.
+ */
+struct SamplerTier {
+  UINT    maxAnisotropy;
+  FLOAT   lodBias;
+};
+
+/** D3D11_FILTER encoding bits */
+constexpr UINT FILTER_MIN_LINEAR  = 0x10U;
+constexpr UINT FILTER_ANISOTROPIC = 0x40U;
+
+/**
+ * \brief Applies a tier to a sampler description
+ *
+ * Comparison and reduction bits are preserved.
+ *
+ * \returns \c true if the description was changed
+ */
+inline bool applySamplerTier(D3D11_SAMPLER_DESC& desc, const SamplerTier& tier) {
+  UINT filter = static_cast<UINT>(desc.Filter);
+  bool changed = false;
+
+  if (filter & FILTER_ANISOTROPIC) {
+    if (tier.maxAnisotropy <= 1U) {
+      filter &= ~FILTER_ANISOTROPIC;
+      desc.Filter = static_cast<D3D11_FILTER>(filter);
+      desc.MaxAnisotropy = 1U;
+      changed = true;
+    } else if (desc.MaxAnisotropy > tier.maxAnisotropy) {
+      desc.MaxAnisotropy = tier.maxAnisotropy;
+      changed = true;
+    }
+  }
+
+  if (tier.lodBias != 0.0f && (filter & (FILTER_MIN_LINEAR | FILTER_ANISOTROPIC))) {
+    desc.MipLODBias = std::min(desc.MipLODBias + tier.lodBias, 15.99f);
+    changed = true;
+  }
+
+  return changed;
+}
+
+}
+
+#endif
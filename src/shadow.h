@@ -0,0 +1,294 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <d3d11.h>
+
+#include "cbcache.h"
+
+namespace atfix {
+
+/**
+ * \brief Checks whether a texture looks like a shadow map
+ *
+ * Shadow maps are square power-of-two depth textures that are also
+ * sampled, with a single mip, layer and sample. Scene depth buffers
+ * follow the window size and do not match in practice.
+ */
+inline bool isShadowMapDesc(const D3D11_TEXTURE2D_DESC& desc) {
+  constexpr UINT BindFlags = D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_SHADER_RESOURCE;
+
+  if ((desc.BindFlags & BindFlags) != BindFlags
+   || desc.Width != desc.Height || desc.Width < 512U || !std::has_single_bit(desc.Width)
+   || desc.MipLevels != 1U || desc.ArraySize != 1U || desc.SampleDesc.Count != 1U) {
+    return false;
+  }
+
+  return desc.Format == DXGI_FORMAT_R32_TYPELESS
+      || desc.Format == DXGI_FORMAT_R24G8_TYPELESS
+      || desc.Format == DXGI_FORMAT_R16_TYPELESS;
+}
+
+/** Scales viewports to a target created at a fraction of the size the game expects */
+inline void scaleViewports(const D3D11_VIEWPORT* pSrc, UINT count, float scale, D3D11_VIEWPORT* pDst) {
+  for (UINT i = 0U; i < count; i++) {
+    pDst[i] = pSrc[i];
+    pDst[i].TopLeftX *= scale;
+    pDst[i].TopLeftY *= scale;
+    pDst[i].Width *= scale;
+    pDst[i].Height *= scale;
+  }
+}
+
+/** Scales scissor rects like viewports, rounding outwards */
+inline void scaleScissorRects(const D3D11_RECT* pSrc, UINT count, float scale, D3D11_RECT* pDst) {
+  for (UINT i = 0U; i < count; i++) {
+    pDst[i].left = static_cast<LONG>(std::floor(static_cast<float>(pSrc[i].left) * scale));
+    pDst[i].top = static_cast<LONG>(std::floor(static_cast<float>(pSrc[i].top) * scale));
+    pDst[i].right = static_cast<LONG>(std::ceil(static_cast<float>(pSrc[i].right) * scale));
+    pDst[i].bottom = static_cast<LONG>(std::ceil(static_cast<float>(pSrc[i].bottom) * scale));
+  }
+}
+
+
+/**
+ * \brief Reuses the previous shadow maps on static frames
+ *
+ * Decides once per frame, at the first draw into a shadow map,
+ * whether all shadow draws of the frame are skipped. In alternate
+ * mode every other frame is skipped. Otherwise the frame is skipped
+ * if the vertex shader constant buffers bound at that draw differ
+ * from the last rendered frame by less than a relative epsilon per
+ * float. Buffers without a known CbShadow copy count as changed.
+ *
+ * Clears of shadow maps are deferred until the decision is made, so
+ * that reused shadow maps keep their contents.
+ */
+class ShadowReuse {
+
+public:
+
+  static constexpr UINT MaxCbs = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+  static constexpr uint32_t MaxClears = 8U;
+
+  ShadowReuse(bool alternate, float epsilon, uint32_t maxReused)
+  : m_alternate(alternate), m_epsilon(epsilon), m_maxReused(alternate ? 1U : maxReused) { }
+
+  ~ShadowReuse() {
+    drop();
+  }
+
+  ShadowReuse(const ShadowReuse&) = delete;
+  ShadowReuse& operator = (const ShadowReuse&) = delete;
+
+  bool decided() const {
+    return m_decided;
+  }
+
+  /** Whether the current frame reuses the previous shadow maps */
+  bool reused() const {
+    return m_decided && m_skip;
+  }
+
+  /**
+   * \brief Checks whether a shadow draw is skipped
+   *
+   * \param [in] clearProc Issues a deferred clear
+   * \returns \c true if the frame reuses the previous shadow maps
+   */
+  template<typename Clear>
+  bool skip(ID3D11DeviceContext* pContext, Clear&& clearProc) {
+    if (!m_decided) {
+      decide(pContext);
+
+      if (m_skip) {
+        drop();
+      } else {
+        flush(clearProc);
+      }
+    }
+
+    return m_skip;
+  }
+
+  /**
+   * \brief Defers or drops a shadow map clear
+   *
+   * \returns \c false if the caller must issue the clear
+   */
+  bool clear(ID3D11DepthStencilView* pView, UINT flags, FLOAT depth, UINT8 stencil) {
+    if (m_decided) {
+      return m_skip;
+    }
+
+    if (m_clearCount == MaxClears) {
+      return false;
+    }
+
+    pView->AddRef();
+    m_clears[m_clearCount++] = { pView, flags, depth, stencil };
+    return true;
+  }
+
+  /** Issues deferred clears, e.g. when a shadow pass ends without draws */
+  template<typename Clear>
+  void flush(Clear&& clearProc) {
+    for (uint32_t i = 0U; i < m_clearCount; i++) {
+      const PendingClear& pending = m_clears[i];
+      clearProc(pending.view, pending.flags, pending.depth, pending.stencil);
+      pending.view->Release();
+    }
+
+    m_clearCount = 0U;
+  }
+
+  template<typename Clear>
+  void present(Clear&& clearProc) {
+    flush(clearProc);
+    m_decided = false;
+    m_skip = false;
+  }
+
+private:
+
+  struct PendingClear {
+    ID3D11DepthStencilView* view = nullptr;
+    UINT                    flags = 0U;
+    FLOAT                   depth = 0.0f;
+    UINT8                   stencil = 0U;
+  };
+
+  struct Snapshot {
+    std::unique_ptr<uint8_t[]>  data;
+    UINT                        size = 0U;
+  };
+
+  void decide(ID3D11DeviceContext* pContext) {
+    m_decided = true;
+
+    if (m_alternate) {
+      m_skip = m_valid && m_reused < m_maxReused;
+      m_reused = m_skip ? m_reused + 1U : 0U;
+      m_valid = true;
+      return;
+    }
+
+    std::array<ID3D11Buffer*, MaxCbs> buffers = { };
+    std::array<CbShadow*, MaxCbs> shadows = { };
+    pContext->VSGetConstantBuffers(0U, MaxCbs, buffers.data());
+
+    bool same = m_valid && m_reused < m_maxReused;
+
+    for (UINT i = 0U; i < MaxCbs; i++) {
+      shadows[i] = buffers[i] ? CbShadow::get(buffers[i]) : nullptr;
+
+      if (same) {
+        same = matches(m_snapshots[i], buffers[i], shadows[i]);
+      }
+    }
+
+    m_skip = same;
+
+    if (m_skip) {
+      m_reused++;
+    } else {
+      m_valid = true;
+      m_reused = 0U;
+
+      for (UINT i = 0U; i < MaxCbs; i++) {
+        m_valid &= capture(m_snapshots[i], buffers[i], shadows[i]);
+      }
+    }
+
+    for (UINT i = 0U; i < MaxCbs; i++) {
+      if (shadows[i]) {
+        shadows[i]->Release();
+      }
+
+      if (buffers[i]) {
+        buffers[i]->Release();
+      }
+    }
+  }
+
+  bool matches(const Snapshot& snapshot, ID3D11Buffer* pBuffer, const CbShadow* pShadow) const {
+    if (!pBuffer) {
+      return !snapshot.size;
+    }
+
+    const void* data = pShadow ? pShadow->data() : nullptr;
+
+    if (!data || pShadow->size() != snapshot.size) {
+      return false;
+    }
+
+    for (UINT offset = 0U; offset + sizeof(float) <= snapshot.size; offset += sizeof(float)) {
+      float a;
+      float b;
+      std::memcpy(&a, snapshot.data.get() + offset, sizeof(a));
+      std::memcpy(&b, static_cast<const uint8_t*>(data) + offset, sizeof(b));
+
+      if (!(std::abs(a - b) <= m_epsilon * std::max(std::abs(a), 1.0f))) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /** Records a bound buffer, returns \c false if its contents are unknown */
+  static bool capture(Snapshot& snapshot, ID3D11Buffer* pBuffer, const CbShadow* pShadow) {
+    snapshot.size = 0U;
+
+    if (!pBuffer) {
+      return true;
+    }
+
+    const void* data = pShadow ? pShadow->data() : nullptr;
+
+    if (!data) {
+      return false;
+    }
+
+    if (!snapshot.data) {
+      snapshot.data = std::make_unique<uint8_t[]>(CbShadow::MaxSize);
+    }
+
+    snapshot.size = pShadow->size();
+    std::memcpy(snapshot.data.get(), data, snapshot.size);
+    return true;
+  }
+
+  void drop() {
+    for (uint32_t i = 0U; i < m_clearCount; i++) {
+      m_clears[i].view->Release();
+    }
+
+    m_clearCount = 0U;
+  }
+
+  bool                                m_alternate;
+  float                               m_epsilon;
+  uint32_t                            m_maxReused;
+
+  bool                                m_decided = false;
+  bool                                m_skip = false;
+  bool                                m_valid = false;
+  uint32_t                            m_reused = 0U;
+
+  std::array<Snapshot, MaxCbs>        m_snapshots = { };
+  std::array<PendingClear, MaxClears> m_clears = { };
+  uint32_t                            m_clearCount = 0U;
+
+};
+
+}
+
+#endif
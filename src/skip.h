@@ -0,0 +1,183 @@
+#ifndef SKIP_H
+#define SKIP_H
+
+#include <array>
+#include <cstdint>
+
+#include <d3d11.h>
+
+#include "tag.h"
+
+namespace atfix {
+
+/**
+ * \brief Finds render targets that only feed disabled effects
+ *
+ * Remembers every resource that a disabled draw reads through a
+ * pixel shader SRV, and whether any other draw read it in the same
+ * frame. Resources that were only read by disabled draws for a whole
+ * frame are marked as feed-only at its end, and a pass rendering
+ * exclusively to feed-only targets, without a depth buffer, can be
+ * dropped in the next frame.
+ *
+ * Only pixel shader reads of immediate context draws are tracked per
+ * frame. Every other read path, i.e. other shader stages, UAVs,
+ * copies, resolves and deferred contexts, marks the resource as live
+ * for good with \c TAG_LIVE. Once a live draw reads a feed-only
+ * target again, it stops being feed-only at the next frame boundary.
+ */
+class FeedTracker {
+
+public:
+
+  static constexpr uint32_t MaxFeeds = 16U;
+
+  /** Whether reads need to be recorded at all */
+  bool active() const {
+    return m_count != 0U;
+  }
+
+  /**
+   * \brief Records the pixel shader resources read by a draw
+   *
+   * \param [in] disabled Whether the draw is being dropped
+   */
+  void read(ID3D11ShaderResourceView* const* ppViews, uint32_t count, bool disabled) {
+    for (uint32_t i = 0U; i < count; i++) {
+      if (!ppViews[i]) {
+        continue;
+      }
+
+      ID3D11Resource* resource = nullptr;
+      ppViews[i]->GetResource(&resource);
+
+      Feed* feed = find(resource);
+
+      if (!feed && disabled && m_count < MaxFeeds && !(getTag(resource) & TAG_LIVE)) {
+        feed = &m_feeds[m_count++];
+        *feed = Feed();
+        feed->resource = resource;
+        resource->AddRef();
+      }
+
+      if (feed) {
+        (disabled ? feed->disabledRead : feed->liveRead) = true;
+      }
+
+      resource->Release();
+    }
+  }
+
+  /**
+   * \brief Marks the resources of views as live for good
+   *
+   * Call for every read that is not a pixel shader read of an
+   * immediate context draw. Works with SRVs and UAVs.
+   */
+  template<typename T>
+  static void readLive(T* const* ppViews, uint32_t count) {
+    for (uint32_t i = 0U; ppViews && i < count; i++) {
+      if (!ppViews[i]) {
+        continue;
+      }
+
+      ID3D11Resource* resource = nullptr;
+      ppViews[i]->GetResource(&resource);
+      readLive(resource);
+      resource->Release();
+    }
+  }
+
+  /** Marks a resource as live for good, e.g. the source of a copy */
+  static void readLive(ID3D11Resource* pResource) {
+    const uint32_t tag = getTag(pResource);
+
+    if (pResource && !(tag & TAG_LIVE)) {
+      setTag(pResource, tag | TAG_LIVE);
+    }
+  }
+
+  /** Checks whether all bound render targets are feed-only and no depth buffer is bound */
+  bool feedsOnly(ID3D11RenderTargetView* const* ppViews, uint32_t count, ID3D11DepthStencilView* pDepthStencilView) {
+    if (!m_feedOnly || !ppViews || pDepthStencilView) {
+      return false;
+    }
+
+    bool any = false;
+
+    for (uint32_t i = 0U; i < count; i++) {
+      if (!ppViews[i]) {
+        continue;
+      }
+
+      ID3D11Resource* resource = nullptr;
+      ppViews[i]->GetResource(&resource);
+
+      const Feed* feed = find(resource);
+      resource->Release();
+
+      if (!feed || !feed->feedOnly) {
+        return false;
+      }
+
+      any = true;
+    }
+
+    return any;
+  }
+
+  /** Evaluates the finished frame and forgets unused resources */
+  void present() {
+    uint32_t kept = 0U;
+    m_feedOnly = 0U;
+
+    for (uint32_t i = 0U; i < m_count; i++) {
+      Feed feed = m_feeds[i];
+
+      if (!feed.disabledRead || (getTag(feed.resource) & TAG_LIVE)) {
+        feed.resource->Release();
+        continue;
+      }
+
+      /* Live reads before the first disabled read went unseen */
+      feed.feedOnly = feed.observed && !feed.liveRead;
+      feed.observed = true;
+      feed.disabledRead = false;
+      feed.liveRead = false;
+
+      m_feedOnly += feed.feedOnly ? 1U : 0U;
+      m_feeds[kept++] = feed;
+    }
+
+    m_count = kept;
+  }
+
+private:
+
+  struct Feed {
+    ID3D11Resource* resource = nullptr;
+    bool            disabledRead = false;
+    bool            liveRead = false;
+    bool            feedOnly = false;
+    bool            observed = false;
+  };
+
+  Feed* find(ID3D11Resource* pResource) {
+    for (uint32_t i = 0U; i < m_count; i++) {
+      if (m_feeds[i].resource == pResource) {
+        return &m_feeds[i];
+      }
+    }
+
+    return nullptr;
+  }
+
+  std::array<Feed, MaxFeeds>  m_feeds = { };
+  uint32_t                    m_count = 0U;
+  uint32_t                    m_feedOnly = 0U;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <d3d11.h>
+
+#include "formats.h"
+#include "object.h"
+
+namespace atfix {
+
+/** Private data GUID of the CPU copy attached to staging resources */
+inline constexpr GUID StagingMirrorGuid = { 0x5b0e7c92, 0x4d1a, 0x4f38, { 0x8e, 0x63, 0x19, 0xa7, 0xc4, 0x2d, 0xf0, 0x5b } };
+
+/**
+ * \brief CPU copy of a staging resource the game writes to
+ *
+ * Attached at creation to single-subresource staging resources with
+ * write-only CPU access, which are created with read access added.
+ * The copy stays empty until the first Map(WRITE) that would stall.
+ * That map waits once and reads the current contents back. From then
+ * on every Map(WRITE) hands out the copy, so partial writes land on
+ * top of the real contents, and Unmap uploads the whole copy.
+ *
+ * GPU writes to the resource make the copy stale until the next
+ * stalling map seeds it again. Writes recorded on deferred contexts
+ * take effect whenever the command list runs, so they disable the
+ * copy for good.
+ */
+class StagingMirror final : public PrivateObject {
+
+public:
+
+  static constexpr size_t MaxSize = 16U << 20;
+
+  StagingMirror(UINT rowBytes, UINT rows)
+  : m_rowBytes(rowBytes), m_rows(rows) { }
+
+  static bool isEligible(const D3D11_BUFFER_DESC& desc) {
+    return desc.Usage == D3D11_USAGE_STAGING && desc.CPUAccessFlags == D3D11_CPU_ACCESS_WRITE
+        && desc.ByteWidth <= MaxSize;
+  }
+
+  static bool isEligible(const D3D11_TEXTURE2D_DESC& desc) {
+    UINT rowBytes = 0U;
+    UINT rows = 0U;
+
+    return desc.Usage == D3D11_USAGE_STAGING && desc.CPUAccessFlags == D3D11_CPU_ACCESS_WRITE
+        && desc.MipLevels == 1U && desc.ArraySize == 1U && desc.SampleDesc.Count == 1U
+        && getShape(desc, rowBytes, rows) && size_t(rowBytes) * rows <= MaxSize;
+  }
+
+  /** Bytes per row of blocks and number of block rows of a texture */
+  static bool getShape(const D3D11_TEXTURE2D_DESC& desc, UINT& rowBytes, UINT& rows) {
+    const FormatBlock block = getFormatBlock(desc.Format);
+
+    if (!block.bytes) {
+      return false;
+    }
+
+    rowBytes = (desc.Width + block.extent - 1U) / block.extent * block.bytes;
+    rows = (desc.Height + block.extent - 1U) / block.extent;
+    return true;
+  }
+
+  static void attach(ID3D11Resource* pResource, UINT rowBytes, UINT rows) {
+    PrivateObject::attach(pResource, StagingMirrorGuid, new StagingMirror(rowBytes, rows));
+  }
+
+  /** Copy of a resource, if any. The caller must release it. */
+  static StagingMirror* get(ID3D11Resource* pResource) {
+    return PrivateObject::get<StagingMirror>(pResource, StagingMirrorGuid);
+  }
+
+  /** Whether the copy matches the resource */
+  bool valid() const {
+    return m_valid && !disabled();
+  }
+
+  bool disabled() const {
+    return m_disabled;
+  }
+
+  bool mapped() const {
+    return m_mapped;
+  }
+
+  /** Forgets the contents after a write we could not follow */
+  void invalidate() {
+    m_valid = false;
+  }
+
+  /** Stops mirroring for good, may be called from any thread */
+  void disable() {
+    m_disabled = true;
+  }
+
+  /**
+   * \brief Seeds the copy from a blocking map of the resource
+   *
+   * The resource stays mapped until the game's Unmap, which
+   * writes the copy back through that mapping.
+   */
+  void seed(const D3D11_MAPPED_SUBRESOURCE& mapped) {
+    if (!m_data) {
+      m_data = std::make_unique<uint8_t[]>(size_t(m_rowBytes) * m_rows);
+    }
+
+    copyRows(m_data.get(), m_rowBytes, static_cast<const uint8_t*>(mapped.pData), mapped.RowPitch);
+    m_held = mapped;
+    m_valid = true;
+  }
+
+  /** Mapping of the copy handed to the game */
+  D3D11_MAPPED_SUBRESOURCE map() {
+    m_mapped = true;
+    return { m_data.get(), m_rowBytes, m_rowBytes * m_rows };
+  }
+
+  /**
+   * \brief Ends a map of the copy
+   *
+   * \returns The mapping of the resource held since seeding, if any,
+   *    in which case the copy was already written back
+   */
+  const D3D11_MAPPED_SUBRESOURCE* unmap() {
+    m_mapped = false;
+
+    if (!m_held.pData) {
+      return nullptr;
+    }
+
+    write(m_held);
+    m_heldResult = m_held;
+    m_held = { };
+    return &m_heldResult;
+  }
+
+  /** Writes the copy to a mapping of the resource or a pool resource */
+  void write(const D3D11_MAPPED_SUBRESOURCE& mapped) const {
+    copyRows(static_cast<uint8_t*>(mapped.pData), mapped.RowPitch, m_data.get(), m_rowBytes);
+  }
+
+private:
+
+  void copyRows(uint8_t* pDst, UINT dstPitch, const uint8_t* pSrc, UINT srcPitch) const {
+    for (UINT row = 0U; row < m_rows; row++) {
+      std::memcpy(pDst + size_t(row) * dstPitch, pSrc + size_t(row) * srcPitch, m_rowBytes);
+    }
+  }
+
+  UINT                        m_rowBytes;
+  UINT                        m_rows;
+  std::unique_ptr<uint8_t[]>  m_data;
+  D3D11_MAPPED_SUBRESOURCE    m_held = { };
+  D3D11_MAPPED_SUBRESOURCE    m_heldResult = { };
+  bool                        m_valid = false;
+  bool                        m_mapped = false;
+  std::atomic<bool>           m_disabled = { false };
+
+};
+
+
+/**
+ * \brief Staging resources for uploads that would stall
+ *
+ * When the game's staging resource is still in use by the GPU, the
+ * contents of its StagingMirror are written to a pooled staging
+ * resource with the same dimensions instead, which is then copied
+ * into the game's resource on the GPU timeline. The CPU never waits
+ * for the GPU to release the game's resource.
+ *
+ * Pool resources are reused FrameLatency frames after their last
+ * use, and only if they can be mapped without waiting. Resources
+ * unused for ReleaseFrames frames are released.
+ */
+class StagingPool {
+
+public:
+
+  static constexpr uint32_t MaxEntries    = 64U;
+  static constexpr uint64_t FrameLatency  = 3U;
+  static constexpr uint64_t ReleaseFrames = 600U;
+
+  struct Key {
+    D3D11_RESOURCE_DIMENSION  dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+    UINT                      width = 0U;
+    UINT                      height = 0U;
+    DXGI_FORMAT               format = DXGI_FORMAT_UNKNOWN;
+
+    bool operator == (const Key&) const = default;
+  };
+
+  /** Describes the staging copy of a single-subresource buffer or 2D texture */
+  static bool getKey(ID3D11Resource* pResource, Key& key) {
+    pResource->GetType(&key.dimension);
+
+    if (key.dimension == D3D11_RESOURCE_DIMENSION_BUFFER) {
+      D3D11_BUFFER_DESC desc = { };
+      static_cast<ID3D11Buffer*>(pResource)->GetDesc(&desc);
+      key.width = desc.ByteWidth;
+      key.height = 1U;
+      return true;
+    }
+
+    if (key.dimension == D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+      D3D11_TEXTURE2D_DESC desc = { };
+      static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+
+      if (desc.SampleDesc.Count > 1U || desc.MipLevels != 1U || desc.ArraySize != 1U) {
+        return false;
+      }
+
+      key.width = desc.Width;
+      key.height = desc.Height;
+      key.format = desc.Format;
+      return true;
+    }
+
+    return false;
+  }
+
+  /**
+   * \brief Uploads through a pool resource
+   *
+   * \param [in] createProc Creates a staging resource for a key
+   * \param [in] mapProc Maps a pool resource for writing without waiting
+   * \param [in] writeProc Fills the mapped pool resource
+   * \param [in] unmapProc Unmaps the pool resource
+   * \param [in] copyProc Copies the pool resource into the game's resource
+   * \returns \c false if no pool resource could be mapped
+   */
+  template<typename Create, typename Map, typename Write, typename Unmap, typename Copy>
+  bool upload(const Key& key, uint64_t frame, Create&& createProc, Map&& mapProc,
+          Write&& writeProc, Unmap&& unmapProc, Copy&& copyProc) {
+    D3D11_MAPPED_SUBRESOURCE mapped = { };
+    Entry* entry = nullptr;
+
+    for (uint32_t i = 0U; i < m_count && !entry; i++) {
+      Entry& candidate = m_entries[i];
+
+      if (candidate.key == key && candidate.lastFrame + FrameLatency <= frame
+       && SUCCEEDED(mapProc(candidate.resource, &mapped))) {
+        entry = &candidate;
+      }
+    }
+
+    if (!entry) {
+      if (m_count == MaxEntries) {
+        return false;
+      }
+
+      Entry& created = m_entries[m_count];
+
+      if (FAILED(createProc(key, &created.resource))) {
+        created.resource = nullptr;
+        return false;
+      }
+
+      created.key = key;
+      created.lastFrame = frame;
+      m_count++;
+
+      if (FAILED(mapProc(created.resource, &mapped))) {
+        return false;
+      }
+
+      entry = &created;
+    }
+
+    writeProc(mapped);
+    unmapProc(entry->resource);
+    copyProc(entry->resource);
+    entry->lastFrame = frame;
+    return true;
+  }
+
+  /** Releases pool resources that were not used for a while */
+  void present(uint64_t frame) {
+    uint32_t kept = 0U;
+
+    for (uint32_t i = 0U; i < m_count; i++) {
+      Entry entry = m_entries[i];
+
+      if (entry.lastFrame + ReleaseFrames < frame) {
+        entry.resource->Release();
+        continue;
+      }
+
+      m_entries[kept++] = entry;
+    }
+
+    m_count = kept;
+  }
+
+private:
+
+  struct Entry {
+    ID3D11Resource* resource = nullptr;
+    Key             key;
+    uint64_t        lastFrame = 0U;
+  };
+
+  std::array<Entry, MaxEntries>   m_entries = { };
+  uint32_t                        m_count = 0U;
+
+};
+
+}
+
+#endif
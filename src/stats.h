@@ -0,0 +1,141 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+
+#include "tag.h"
+
+namespace atfix {
+
+/**
+ * \brief Per-frame draw statistics by bound shader pair
+ *
+ * Fixed-size open addressing table keyed by the shader table
+ * indices of the bound VS and PS. Cleared at the end of every
+ * frame, after an optional snapshot was appended to a CSV file.
+ */
+class DrawStats {
+
+public:
+
+  static constexpr uint32_t MaxEntries = 1024U;
+
+  struct Entry {
+    uint32_t key = 0U;
+    uint32_t draws = 0U;
+    uint64_t indices = 0U;
+    uint64_t instances = 0U;
+    uint32_t stateChanges = 0U;
+    uint32_t skipped = 0U;
+  };
+
+  DrawStats(const char* filename)
+  : m_filename(filename) { }
+
+  /**
+   * \brief Counts a draw
+   *
+   * \param [in] indices Index or vertex count per instance
+   * \param [in] instances Instance count, 1 for plain draws
+   * \param [in] stateChanges Binds since the previous draw
+   */
+  void draw(uint32_t vs, uint32_t ps, uint32_t indices, uint32_t instances, uint32_t stateChanges) {
+    Entry& entry = lookup((vs << 16U) | ps);
+    entry.draws++;
+    entry.indices += static_cast<uint64_t>(indices) * instances;
+    entry.instances += instances;
+    entry.stateChanges += stateChanges;
+  }
+
+  /** Counts a draw that was dropped before reaching the driver */
+  void skip(uint32_t vs, uint32_t ps) {
+    lookup((vs << 16U) | ps).skipped++;
+  }
+
+  /** Writes the finished frame if requested and clears the table */
+  void present(uint64_t frame, bool snapshot, const ShaderTable& shaders) {
+    if (snapshot) {
+      write(frame, shaders);
+    }
+
+    for (uint32_t i = 0U; i < m_used; i++) {
+      m_entries[m_slots[i]] = Entry();
+    }
+
+    m_overflow = Entry();
+    m_used = 0U;
+  }
+
+private:
+
+  Entry& lookup(uint32_t key) {
+    /* Key 0 is the empty marker, shift everything by one */
+    key++;
+
+    uint32_t slot = (key * 2654435761U) % MaxEntries;
+
+    for (uint32_t i = 0U; i < MaxEntries; i++) {
+      Entry& entry = m_entries[slot];
+
+      if (entry.key == key) {
+        return entry;
+      }
+
+      if (!entry.key) {
+        entry.key = key;
+        m_slots[m_used++] = slot;
+        return entry;
+      }
+
+      slot = (slot + 1U) % MaxEntries;
+    }
+
+    return m_overflow;
+  }
+
+  void write(uint64_t frame, const ShaderTable& shaders) {
+    std::ofstream file(m_filename, std::ios::out | (m_header ? std::ios::app : std::ios::trunc));
+
+    if (!m_header) {
+      file << "frame,vs,ps,draws,indices,instances,state_changes,skipped" << std::endl;
+      m_header = true;
+    }
+
+    for (uint32_t i = 0U; i < m_used; i++) {
+      const Entry& entry = m_entries[m_slots[i]];
+      const uint32_t key = entry.key - 1U;
+
+      file << frame << ","
+           << shaders.name(key >> 16U) << ","
+           << shaders.name(key & TAG_INDEX_MASK) << ","
+           << entry.draws << ","
+           << entry.indices << ","
+           << entry.instances << ","
+           << entry.stateChanges << ","
+           << entry.skipped << std::endl;
+    }
+
+    if (m_overflow.draws || m_overflow.skipped) {
+      file << frame << ",overflow,overflow,"
+           << m_overflow.draws << ","
+           << m_overflow.indices << ","
+           << m_overflow.instances << ","
+           << m_overflow.stateChanges << ","
+           << m_overflow.skipped << std::endl;
+    }
+  }
+
+  const char*                         m_filename;
+  std::array<Entry, MaxEntries>       m_entries = { };
+  std::array<uint32_t, MaxEntries>    m_slots = { };
+  uint32_t                            m_used = 0U;
+  Entry                               m_overflow;
+  bool                                m_header = false;
+
+};
+
+}
+
+#endif
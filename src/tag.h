@@ -0,0 +1,144 @@
+#ifndef TAG_H
+#define TAG_H
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <d3d11.h>
+
+#include "util.h"
+
+namespace atfix {
+
+/** Private data GUID used to attach a tag to D3D11 objects */
+inline constexpr GUID TagGuid = { 0x6a3b2f14, 0x51c7, 0x4c0e, { 0x9d, 0x2e, 0x7b, 0x41, 0x0c, 0x88, 0xd3, 0x5f } };
+
+/**
+ * \brief Object tag layout
+ *
+ * The low 16 bits index into the shader table, into the draw rule
+ * table for index buffers, or hold the size divisor of shadow maps
+ * or the format of downgraded render targets and compressed textures.
+ * The upper bits are free for per-object flags.
+ */
+constexpr uint32_t TAG_INDEX_MASK = 0xFFFFU;
+
+/** Shader was swapped for one of our replacements at creation */
+constexpr uint32_t TAG_REPLACED   = (1U << 16);
+
+/** Shader belongs to a disabled effect, draws using it are dropped */
+constexpr uint32_t TAG_DISABLED   = (1U << 17);
+
+/** Shadow map texture or one of its depth views */
+constexpr uint32_t TAG_SHADOW     = (1U << 18);
+
+/** Shader belongs to an effect that is rendered at reduced resolution */
+constexpr uint32_t TAG_REDUCED    = (1U << 19);
+
+/** Target created at render resolution for upscaling, or one of its views */
+constexpr uint32_t TAG_SCALED     = (1U << 20);
+
+/** Render target created with a narrower format, the low bits hold the format */
+constexpr uint32_t TAG_DOWNGRADED = (1U << 21);
+
+/** Texture compressed at creation, the low bits hold the block format */
+constexpr uint32_t TAG_COMPRESSED = (1U << 22);
+
+/** Texture created with a generated mip chain */
+constexpr uint32_t TAG_MIPMAPPED  = (1U << 23);
+
+/** Resource read outside of immediate context pixel shaders, never feed-only */
+constexpr uint32_t TAG_LIVE       = (1U << 24);
+
+inline uint32_t tagIndex(uint32_t tag) {
+  return tag & TAG_INDEX_MASK;
+}
+
+template<typename T>
+void setTag(T* pObject, uint32_t tag) {
+  if (pObject) {
+    pObject->SetPrivateData(TagGuid, sizeof(tag), &tag);
+  }
+}
+
+template<typename T>
+uint32_t getTag(T* pObject) {
+  uint32_t tag = 0U;
+  UINT size = sizeof(tag);
+
+  if (!pObject || FAILED(pObject->GetPrivateData(TagGuid, &size, &tag))) {
+    return 0U;
+  }
+
+  return tag;
+}
+
+/**
+ * \brief Shader hash registry
+ *
+ * Maps the DXBC checksum of every shader the game creates to a
+ * small index, so hot paths can attribute work to a shader hash
+ * without hashing anything. Index 0 means unknown.
+ */
+class ShaderTable {
+
+public:
+
+  static constexpr uint32_t MaxShaders = 4096U;
+
+  using Hash = std::array<uint32_t, 4>;
+
+  uint32_t add(const uint32_t* pHash) {
+    const std::lock_guard lock(m_mutex);
+
+    const Hash hash = { pHash[0], pHash[1], pHash[2], pHash[3] };
+    const uint64_t key = (static_cast<uint64_t>(hash[0]) << 32U) | hash[1];
+
+    auto entry = m_lookup.find(key);
+
+    if (entry != m_lookup.end()) {
+      return entry->second;
+    }
+
+    if (m_count + 1U >= MaxShaders) {
+      return 0U;
+    }
+
+    const uint32_t index = ++m_count;
+    m_hashes[index] = hash;
+    m_lookup.emplace(key, index);
+    return index;
+  }
+
+  const Hash& hash(uint32_t index) const {
+    return m_hashes[index];
+  }
+
+  /** Hash as hex string for reports */
+  std::string name(uint32_t index) const {
+    const Hash& hash = m_hashes[index];
+    std::array<char, 33> str = { };
+    std::snprintf(str.data(), str.size(), "%08x%08x%08x%08x", hash[0], hash[1], hash[2], hash[3]);
+    return std::string(str.data());
+  }
+
+  uint32_t count() const {
+    return m_count + 1U;
+  }
+
+private:
+
+  mutex                                 m_mutex;
+  std::array<Hash, MaxShaders>          m_hashes = { };
+  std::unordered_map<uint64_t, uint32_t> m_lookup;
+  uint32_t                              m_count = 0U;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+#include <d3d11.h>
+
+#include "blit.h"
+#include "filter.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Renders at a fraction of the output resolution
+ *
+ * The game gets a proxy back buffer at render size from GetBuffer,
+ * and render targets and depth buffers it creates at output size are
+ * created at render size instead. At present, the proxy is upscaled
+ * into the real back buffer with UpscaleHlsl.
+ *
+ * The output size is learned from the real back buffer in GetBuffer,
+ * targets created before that stay at output size.
+ */
+class Upscaler {
+
+public:
+
+  Upscaler(uint32_t percent, float sharpness)
+  : m_percent(percent), m_sharpness(sharpness) { }
+
+  ~Upscaler() {
+    resize();
+    releaseRef(m_sampler);
+    releaseRef(m_ps);
+    releaseRef(m_vs);
+  }
+
+  Upscaler(const Upscaler&) = delete;
+  Upscaler& operator = (const Upscaler&) = delete;
+
+  /** Viewport scale of targets created at render size */
+  float scale() const {
+    return static_cast<float>(m_percent) / 100.0f;
+  }
+
+  /**
+   * \brief Output size, 0 until the real back buffer was seen
+   *
+   * Only viewports covering the output size need to be scaled, the
+   * game sizes viewports for the proxy at render size already.
+   */
+  void outputSize(UINT& width, UINT& height) const {
+    const std::lock_guard lock(m_mutex);
+    width = m_width;
+    height = m_height;
+  }
+
+  /**
+   * \brief Picks the size of a texture the game creates
+   *
+   * \returns \c true if \c desc was changed to render size
+   */
+  bool scaleDesc(D3D11_TEXTURE2D_DESC& desc) const {
+    if (!(desc.BindFlags & (D3D11_BIND_RENDER_TARGET | D3D11_BIND_DEPTH_STENCIL))
+     || desc.MipLevels != 1U || desc.ArraySize != 1U) {
+      return false;
+    }
+
+    const std::lock_guard lock(m_mutex);
+
+    if (!m_width || desc.Width != m_width || desc.Height != m_height) {
+      return false;
+    }
+
+    desc.Width = renderSize(desc.Width);
+    desc.Height = renderSize(desc.Height);
+    return true;
+  }
+
+  /**
+   * \brief Gets the proxy for the real back buffer
+   *
+   * \param [in] createTexture Creates a 2D texture from a description
+   * \returns Proxy with a new reference, or null. Multisampled back
+   *    buffers get no proxy, the upscaling pass samples a Texture2D.
+   */
+  template<typename Create>
+  ID3D11Texture2D* getProxy(ID3D11Texture2D* pBackBuffer, Create&& createTexture) {
+    D3D11_TEXTURE2D_DESC desc = { };
+    pBackBuffer->GetDesc(&desc);
+
+    if (desc.SampleDesc.Count > 1U) {
+      return nullptr;
+    }
+
+    const std::lock_guard lock(m_mutex);
+
+    if (!m_proxy) {
+      m_width = desc.Width;
+      m_height = desc.Height;
+
+      desc.Width = renderSize(desc.Width);
+      desc.Height = renderSize(desc.Height);
+      desc.Usage = D3D11_USAGE_DEFAULT;
+      desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+      desc.CPUAccessFlags = 0U;
+      desc.MiscFlags = 0U;
+
+      if (FAILED(createTexture(&desc, &m_proxy))) {
+        m_width = 0U;
+        m_height = 0U;
+        return nullptr;
+      }
+    }
+
+    m_proxy->AddRef();
+    return m_proxy;
+  }
+
+  /** Drops all swap chain dependent objects, call before ResizeBuffers */
+  void resize() {
+    const std::lock_guard lock(m_mutex);
+
+    releaseRef(m_outputRtv);
+    releaseRef(m_proxySrv);
+    releaseRef(m_proxy);
+    m_width = 0U;
+    m_height = 0U;
+  }
+
+  /**
+   * \brief Upscales the proxy into the real back buffer
+   *
+   * Restores all state it touches.
+   *
+   * \param [in] createVs Creates a vertex shader from bytecode and length
+   * \param [in] createPs Creates a pixel shader from bytecode and length
+   * \param [in] createSampler Creates a sampler state from a description
+   * \param [in] getBackBuffer Gets the real back buffer with a new reference
+   */
+  template<typename Procs, typename CreateVs, typename CreatePs, typename CreateSampler, typename GetBackBuffer>
+  void present(ID3D11DeviceContext* pContext, const Procs* procs, ID3D11Device* pDevice,
+          CreateVs&& createVs, CreatePs&& createPs, CreateSampler&& createSampler, GetBackBuffer&& getBackBuffer) {
+    const std::lock_guard lock(m_mutex);
+
+    if (!m_proxy || !init(createVs, createPs, createSampler)) {
+      return;
+    }
+
+    if (!m_outputRtv) {
+      ID3D11Texture2D* backBuffer = getBackBuffer();
+
+      if (!backBuffer) {
+        return;
+      }
+
+      const HRESULT hr = pDevice->CreateRenderTargetView(backBuffer, nullptr, &m_outputRtv);
+      backBuffer->Release();
+
+      if (FAILED(hr)) {
+        return;
+      }
+    }
+
+    if (!m_proxySrv && FAILED(pDevice->CreateShaderResourceView(m_proxy, nullptr, &m_proxySrv))) {
+      return;
+    }
+
+    BlitState saved(pContext);
+
+    std::array<ID3D11RenderTargetView*, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> rtvs = { };
+    ID3D11DepthStencilView* dsv = nullptr;
+    pContext->OMGetRenderTargets(D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT, rtvs.data(), &dsv);
+
+    std::array<D3D11_VIEWPORT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> viewports = { };
+    UINT viewportCount = D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE;
+    pContext->RSGetViewports(&viewportCount, viewports.data());
+
+    const D3D11_VIEWPORT viewport = { 0.0f, 0.0f, static_cast<FLOAT>(m_width), static_cast<FLOAT>(m_height), 0.0f, 1.0f };
+
+    procs->OMSetRenderTargets(pContext, 1U, &m_outputRtv, nullptr);
+    procs->RSSetViewports(pContext, 1U, &viewport);
+    pContext->OMSetBlendState(nullptr, nullptr, 0xFFFFFFFFU);
+    BlitState::draw(pContext, procs, m_vs, m_ps, m_proxySrv, m_sampler);
+
+    procs->OMSetRenderTargets(pContext, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT, rtvs.data(), dsv);
+    procs->RSSetViewports(pContext, viewportCount, viewports.data());
+    saved.restore(pContext, procs);
+
+    for (auto& rtv : rtvs) {
+      releaseRef(rtv);
+    }
+
+    releaseRef(dsv);
+  }
+
+private:
+
+  UINT renderSize(UINT size) const {
+    return std::max(size * m_percent / 100U, 1U);
+  }
+
+  template<typename CreateVs, typename CreatePs, typename CreateSampler>
+  bool init(CreateVs&& createVs, CreatePs&& createPs, CreateSampler&& createSampler) {
+    if (m_initDone) {
+      return m_vs != nullptr;
+    }
+
+    m_initDone = true;
+
+    std::array<char, 16> sharpness = { };
+    std::snprintf(sharpness.data(), sharpness.size(), "%.3f", static_cast<double>(m_sharpness));
+    const D3D_SHADER_MACRO defines[] = { { "SHARPNESS", sharpness.data() }, { nullptr, nullptr } };
+
+    ID3DBlob* vsBlob = compileHlsl(FullscreenVsHlsl, "vs_main", "vs_4_0");
+    ID3DBlob* psBlob = compileHlsl(UpscaleHlsl, "ps_main", "ps_4_0", defines);
+
+    if (vsBlob && psBlob) {
+      const D3D11_SAMPLER_DESC desc = linearClampSamplerDesc();
+
+      if (FAILED(createVs(vsBlob->GetBufferPointer(), vsBlob->GetBufferSize(), &m_vs))
+       || FAILED(createPs(psBlob->GetBufferPointer(), psBlob->GetBufferSize(), &m_ps))
+       || FAILED(createSampler(&desc, &m_sampler))) {
+        releaseRef(m_sampler);
+        releaseRef(m_ps);
+        releaseRef(m_vs);
+      }
+    }
+
+    releaseRef(psBlob);
+    releaseRef(vsBlob);
+    return m_vs != nullptr;
+  }
+
+  uint32_t                  m_percent;
+  float                     m_sharpness;
+
+  mutable mutex             m_mutex;
+  UINT                      m_width = 0U;
+  UINT                      m_height = 0U;
+
+  bool                      m_initDone = false;
+  ID3D11VertexShader*       m_vs = nullptr;
+  ID3D11PixelShader*        m_ps = nullptr;
+  ID3D11SamplerState*       m_sampler = nullptr;
+
+  ID3D11Texture2D*          m_proxy = nullptr;
+  ID3D11ShaderResourceView* m_proxySrv = nullptr;
+  ID3D11RenderTargetView*   m_outputRtv = nullptr;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../src/bc.h"
+
+/*
+ * Times the BC1 and BC3 encoders of bc.h on a synthetic image and
+ * measures the PSNR of the decoded result. Returns non-zero if the
+ * quality drops below the minimum or hasAlpha gets an image wrong.
+ */
+
+using namespace atfix;
+
+namespace {
+
+constexpr uint32_t Size = 1024U;
+constexpr uint32_t Repeats = 5U;
+constexpr double MinColorPsnr = 40.0;
+
+/* The alpha channel is half noise, which eight levels per block
+ * cannot follow better than about 34 dB */
+constexpr double MinAlphaPsnr = 34.0;
+
+/** Smooth gradients, a noisy checkerboard with hard edges and noisy alpha */
+std::vector<uint8_t> makeImage() {
+  std::vector<uint8_t> image(size_t(Size) * Size * 4U);
+  std::mt19937 rng(1U);
+
+  for (uint32_t y = 0U; y < Size; y++) {
+    for (uint32_t x = 0U; x < Size; x++) {
+      uint8_t* pTexel = &image[(size_t(y) * Size + x) * 4U];
+      const float fx = float(x) / float(Size);
+      const float fy = float(y) / float(Size);
+
+      pTexel[0] = uint8_t(255.0f * (0.5f + 0.5f * std::sin(fx * 20.0f)));
+      pTexel[1] = uint8_t(255.0f * fy);
+      pTexel[2] = uint8_t((((x / 64U + y / 64U) & 1U) ? 200U : 40U) + rng() % 16U);
+      pTexel[3] = uint8_t(255.0f * fx * 0.5f + float(rng() % 128U));
+    }
+  }
+
+  return image;
+}
+
+void decodeColorBlock(const uint8_t* pBlock, uint32_t* pTexels) {
+  uint16_t c0 = 0U, c1 = 0U;
+  uint32_t indices = 0U;
+  std::memcpy(&c0, pBlock, 2U);
+  std::memcpy(&c1, pBlock + 2U, 2U);
+  std::memcpy(&indices, pBlock + 4U, 4U);
+
+  const std::array<float, 3> e0 = unpackRgb565(c0);
+  const std::array<float, 3> e1 = unpackRgb565(c1);
+  float palette[4][3];
+
+  for (uint32_t c = 0U; c < 3U; c++) {
+    palette[0][c] = e0[c];
+    palette[1][c] = e1[c];
+    palette[2][c] = (2.0f * e0[c] + e1[c]) / 3.0f;
+    palette[3][c] = (e0[c] + 2.0f * e1[c]) / 3.0f;
+  }
+
+  for (uint32_t i = 0U; i < 16U; i++) {
+    const float* pColor = palette[(indices >> (2U * i)) & 3U];
+    pTexels[i] = (pTexels[i] & 0xFF000000U) | uint32_t(pColor[0] + 0.5f)
+      | (uint32_t(pColor[1] + 0.5f) << 8) | (uint32_t(pColor[2] + 0.5f) << 16);
+  }
+}
+
+void decodeAlphaBlock(const uint8_t* pBlock, uint32_t* pTexels) {
+  uint64_t bits = 0U;
+  std::memcpy(&bits, pBlock, 8U);
+
+  const uint32_t a0 = uint32_t(bits & 0xFFU);
+  const uint32_t a1 = uint32_t((bits >> 8) & 0xFFU);
+  uint32_t palette[8] = { a0, a1 };
+
+  if (a0 > a1) {
+    for (uint32_t i = 1U; i < 7U; i++) {
+      palette[i + 1U] = ((7U - i) * a0 + i * a1) / 7U;
+    }
+  } else {
+    for (uint32_t i = 1U; i < 5U; i++) {
+      palette[i + 1U] = ((5U - i) * a0 + i * a1) / 5U;
+    }
+
+    palette[6] = 0U;
+    palette[7] = 255U;
+  }
+
+  for (uint32_t i = 0U; i < 16U; i++) {
+    pTexels[i] = (pTexels[i] & 0xFFFFFFU) | (palette[(bits >> (16U + 3U * i)) & 7U] << 24);
+  }
+}
+
+double psnr(double squaredError, double samples) {
+  return 10.0 * std::log10(255.0 * 255.0 * samples / std::max(squaredError, 1.0));
+}
+
+bool check(const std::vector<uint8_t>& image, BcFormat format, const char* name) {
+  const uint32_t blocks = Size / 4U;
+  const size_t pitch = size_t(Size) * 4U;
+  std::vector<uint8_t> encoded(size_t(blocks) * blocks * bcBlockBytes(format));
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (uint32_t r = 0U; r < Repeats; r++) {
+    for (uint32_t by = 0U; by < blocks; by++) {
+      encodeBcRow(&image[by * 4U * pitch], pitch, Size, 4U, false, format,
+        &encoded[size_t(by) * blocks * bcBlockBytes(format)]);
+    }
+  }
+
+  const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / Repeats;
+
+  double colorError = 0.0;
+  double alphaError = 0.0;
+
+  for (uint32_t by = 0U; by < blocks; by++) {
+    for (uint32_t bx = 0U; bx < blocks; bx++) {
+      const uint8_t* pBlock = &encoded[(size_t(by) * blocks + bx) * bcBlockBytes(format)];
+      uint32_t texels[16] = { };
+
+      if (format == BcFormat::Bc3) {
+        decodeAlphaBlock(pBlock, texels);
+        pBlock += 8U;
+      }
+
+      decodeColorBlock(pBlock, texels);
+
+      for (uint32_t i = 0U; i < 16U; i++) {
+        const uint8_t* pTexel = &image[(size_t(by * 4U + i / 4U) * Size + bx * 4U + i % 4U) * 4U];
+
+        for (uint32_t c = 0U; c < 3U; c++) {
+          const double d = double(pTexel[c]) - double((texels[i] >> (8U * c)) & 0xFFU);
+          colorError += d * d;
+        }
+
+        const double d = double(pTexel[3]) - double(texels[i] >> 24);
+        alphaError += d * d;
+      }
+    }
+  }
+
+  const double samples = double(Size) * Size;
+  const double colorPsnr = psnr(colorError, samples * 3.0);
+  bool passed = colorPsnr >= MinColorPsnr;
+
+  std::printf("%s %ux%u: %.2f ms (%.1f Mtexel/s), RGB PSNR %.2f dB", name, Size, Size,
+    ms, samples / ms / 1000.0, colorPsnr);
+
+  if (format == BcFormat::Bc3) {
+    const double alphaPsnr = psnr(alphaError, samples);
+    passed &= alphaPsnr >= MinAlphaPsnr;
+    std::printf(", alpha PSNR %.2f dB", alphaPsnr);
+  }
+
+  std::printf(" %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+bool checkAlpha(std::vector<uint8_t> image) {
+  bool passed = hasAlpha(image.data(), image.size());
+
+  for (size_t i = 3U; i < image.size(); i += 4U) {
+    image[i] = 0xFFU;
+  }
+
+  passed &= !hasAlpha(image.data(), image.size());
+
+  /* Sizes that are not a multiple of four texels end in the scalar loop */
+  const size_t bytes = image.size() - 4U;
+  image[bytes - 1U] = 0xFEU;
+  passed &= hasAlpha(image.data(), bytes);
+
+  image[bytes - 1U] = 0xFFU;
+  image[bytes + 3U] = 0xFEU;
+  passed &= !hasAlpha(image.data(), bytes);
+
+  std::printf("hasAlpha %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+}
+
+int main() {
+  const std::vector<uint8_t> image = makeImage();
+  bool passed = true;
+
+  passed &= check(image, BcFormat::Bc1, "BC1");
+  passed &= check(image, BcFormat::Bc3, "BC3");
+  passed &= checkAlpha(image);
+
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <vector>
+
+#include "../src/filter.h"
+
+/*
+ * Checks the CPU reference of the upscaling filter, see filter.h.
+ * Returns non-zero if any check fails.
+ */
+
+using namespace atfix;
+
+namespace {
+
+constexpr uint32_t SrcSize = 32U;
+constexpr uint32_t DstSize = 48U;
+constexpr float Epsilon = 1.0f / 1024.0f;
+
+std::vector<float> makeImage(float left, float right) {
+  std::vector<float> image(SrcSize * SrcSize * 4U);
+
+  for (uint32_t y = 0U; y < SrcSize; y++) {
+    for (uint32_t x = 0U; x < SrcSize; x++) {
+      const float value = x < SrcSize / 2U ? left : right;
+
+      for (uint32_t i = 0U; i < 3U; i++) {
+        image[(y * SrcSize + x) * 4U + i] = value;
+      }
+
+      image[(y * SrcSize + x) * 4U + 3U] = 1.0f;
+    }
+  }
+
+  return image;
+}
+
+/** Largest distance of any output channel from [lo, hi] */
+float maxExcursion(const std::vector<float>& image, float lo, float hi) {
+  float excursion = 0.0f;
+
+  for (uint32_t i = 0U; i < image.size(); i++) {
+    if (i % 4U != 3U) {
+      excursion = std::max({ excursion, lo - image[i], image[i] - hi });
+    }
+  }
+
+  return excursion;
+}
+
+bool check(const char* name, float lo, float hi, float left, float right, float sharpness) {
+  const std::vector<float> src = makeImage(left, right);
+  std::vector<float> dst(DstSize * DstSize * 4U);
+
+  upscaleReference(src.data(), SrcSize, SrcSize, dst.data(), DstSize, DstSize, sharpness);
+
+  const float excursion = maxExcursion(dst, lo, hi);
+  const bool passed = excursion <= Epsilon;
+
+  std::printf("%s, sharpness %.1f: max excursion %g %s\n", name, static_cast<double>(sharpness),
+    static_cast<double>(excursion), passed ? "ok" : "FAILED");
+  return passed;
+}
+
+}
+
+int main() {
+  bool passed = true;
+
+  for (float sharpness : { 0.0f, 0.5f, 1.0f }) {
+    /* A flat image must come out unchanged */
+    passed &= check("flat 0.5", 0.5f, 0.5f, 0.5f, 0.5f, sharpness);
+    passed &= check("flat 0.9", 0.9f, 0.9f, 0.9f, 0.9f, sharpness);
+
+    /* Sharpening must not overshoot either side of an edge */
+    passed &= check("edge 0.2/0.8", 0.2f, 0.8f, 0.2f, 0.8f, sharpness);
+    passed &= check("edge 0.0/1.0", 0.0f, 1.0f, 0.0f, 1.0f, sharpness);
+    passed &= check("edge 0.4/0.5", 0.4f, 0.5f, 0.4f, 0.5f, sharpness);
+  }
+
+  return passed ? 0 : 1;
+}